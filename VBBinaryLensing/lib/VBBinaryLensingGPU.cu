@@ -0,0 +1,325 @@
+// VBBinaryLensing GPU backend (CUDA)
+//
+// Batched point-lens light curves and point-source binary lens magnifications.
+// Built together with the library by "make gpu", see VBBinaryLensingGPU.h for the interface.
+//
+// GNU Lesser General Public License applies to all parts of this code.
+// Please read the separate LICENSE.txt file for more details.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <cuda_runtime.h>
+#include "VBBinaryLensingGPU.h"
+
+const int gputhreads = 128; // Threads per block
+const int gpusegment = 16; // Consecutive points per thread in BinaryMag0, each starting from the roots of the previous one
+const int gpumaxit = 80; // Iterations of the root finder before leaving a point to the CPU
+const size_t gpuchunk = 1 << 24; // Largest number of magnifications calculated by a single launch
+
+struct gpubackend {
+	int device;
+	// Copies of the last times and observer positions, which are kept on the device
+	double *hts, *dts, *hobs, *dobs;
+	int nts, nobs;
+	// Work buffer on the device, enlarged when needed
+	double *dbuf;
+	size_t nbuf;
+};
+
+//////////////////////////////
+//////////////////////////////
+////////Complex numbers on the device
+//////////////////////////////
+//////////////////////////////
+
+struct gcomplex {
+	double re, im;
+};
+
+__device__ inline gcomplex gc(double re, double im) {
+	gcomplex z;
+	z.re = re;
+	z.im = im;
+	return z;
+}
+
+__device__ inline gcomplex operator+(gcomplex a, gcomplex b) { return gc(a.re + b.re, a.im + b.im); }
+__device__ inline gcomplex operator-(gcomplex a, gcomplex b) { return gc(a.re - b.re, a.im - b.im); }
+__device__ inline gcomplex operator*(gcomplex a, gcomplex b) { return gc(a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re); }
+__device__ inline gcomplex operator+(double a, gcomplex b) { return gc(a + b.re, b.im); }
+__device__ inline gcomplex operator-(double a, gcomplex b) { return gc(a - b.re, -b.im); }
+__device__ inline gcomplex operator-(gcomplex a, double b) { return gc(a.re - b, a.im); }
+__device__ inline gcomplex operator*(double a, gcomplex b) { return gc(a * b.re, a * b.im); }
+
+__device__ inline gcomplex operator/(double a, gcomplex b) {
+	double md = a / (b.re * b.re + b.im * b.im);
+	return gc(b.re * md, -b.im * md);
+}
+
+__device__ inline gcomplex operator/(gcomplex a, gcomplex b) {
+	double md = 1 / (b.re * b.re + b.im * b.im);
+	return gc((a.re * b.re + a.im * b.im) * md, (a.im * b.re - a.re * b.im) * md);
+}
+
+__device__ inline gcomplex conj(gcomplex z) { return gc(z.re, -z.im); }
+__device__ inline double abs2(gcomplex z) { return z.re * z.re + z.im * z.im; }
+
+//////////////////////////////
+//////////////////////////////
+////////Kernels
+//////////////////////////////
+//////////////////////////////
+
+__global__ void PointLensKernel(int kind, const double *pr, int npr, int nmodels, const double *frames, const double *ts, const double *obs, int np, double Tol, double *mags) {
+	// One thread per epoch of each model, with the same formulas as the CPU light curve functions
+	size_t idx = blockIdx.x * (size_t)blockDim.x + threadIdx.x;
+	const double *p, *f, *o;
+	double u0, pai1 = 0, pai2 = 0, rho = 0, tE_inv, t0, t, tn, u1, u2, Et0 = 0, Et1 = 0, rho2Tol;
+	int im, i;
+
+	if (idx >= (size_t)nmodels * np) return;
+	im = (int)(idx / np);
+	i = (int)(idx % np);
+	p = pr + (size_t)im * npr;
+	tE_inv = exp(-p[1]);
+	t0 = p[2];
+	t = ts[i];
+	switch (kind) {
+	case 0:
+		u0 = exp(p[0]);
+		break;
+	case 1:
+		u0 = p[0];
+		pai1 = p[3];
+		pai2 = p[4];
+		break;
+	case 2:
+		u0 = exp(p[0]);
+		rho = exp(p[3]);
+		break;
+	default:
+		u0 = p[0];
+		rho = exp(p[3]);
+		pai1 = p[4];
+		pai2 = p[5];
+		break;
+	}
+	if (kind & 1) {
+		f = frames + 11 * im;
+		o = obs + 3 * i;
+		Et0 = o[0] * f[0] + o[1] * f[1] + o[2] * f[2] - f[6] - f[8] * (t - f[10]);
+		Et1 = o[0] * f[3] + o[1] * f[4] + o[2] * f[5] - f[7] - f[9] * (t - f[10]);
+	}
+	tn = (t - t0) * tE_inv + pai1 * Et0 + pai2 * Et1;
+	u1 = u0 + pai1 * Et1 - pai2 * Et0;
+	u2 = tn * tn + u1 * u1;
+	if (kind < 2) {
+		mags[idx] = (u2 + 2) / sqrt(u2 * (u2 + 4));
+	}
+	else {
+		// Same threshold as in ESPLMag2: closer sources are sent back to ESPLMagDark on the CPU
+		rho2Tol = rho * rho / Tol;
+		mags[idx] = (u2 * u2 * u2 * (1 + 0.003 * rho2Tol) > 0.027680640625 * rho2Tol * rho2Tol) ? (u2 + 2) / (sqrt(u2) * sqrt(u2 + 4)) : -1;
+	}
+}
+
+struct gpucoefs {
+	gcomplex c[24];
+};
+
+__device__ static bool Aberth5(const gcomplex *p, gcomplex *z) {
+	// Same iteration as cmplx_roots_batch: Newton's method with implicit deflation (Aberth-Ehrlich)
+	gcomplex pv, dv, s, step;
+	double err, e;
+	for (int iter = 0; iter < gpumaxit; iter++) {
+		err = 0;
+		for (int k = 0; k < 5; k++) {
+			pv = p[5];
+			dv = gc(0, 0);
+			for (int m = 4; m >= 0; m--) {
+				dv = dv * z[k] + pv;
+				pv = pv * z[k] + p[m];
+			}
+			if (pv.re == 0 && pv.im == 0) continue;
+			s = gc(0, 0);
+			for (int j = 0; j < 5; j++) {
+				if (j != k) s = s + 1 / (z[k] - z[j]);
+			}
+			step = 1 / (dv / pv - s);
+			z[k] = z[k] - step;
+			e = abs2(step) / (abs2(z[k]) + 1.e-100);
+			if (e > err || e != e) err = e;
+		}
+		// The convergence is of third order: after a relative step below 1.e-6 the error is at the level of round-off
+		if (err < 1.e-12) return true;
+	}
+	return false;
+}
+
+__global__ void BinaryMag0Kernel(gpucoefs cf, const double *y1s, const double *y2s, double *mags, int np) {
+	// Each thread scans gpusegment consecutive points, starting each point from the roots of the previous one
+	const gcomplex *coefs = cf.c;
+	const double dlmin = 1.0e-4;
+	gcomplex p[6], z[5], y, yc, zc, dza, J1;
+	double good[5], R, Mag;
+	int ord[5], j, i, three, i0, i1;
+	bool warm = false;
+
+	i0 = (blockIdx.x * blockDim.x + threadIdx.x) * gpusegment;
+	i1 = (i0 + gpusegment < np) ? i0 + gpusegment : np;
+	for (int ip = i0; ip < i1; ip++) {
+		y = gc(y1s[ip], y2s[ip]) + coefs[11];
+		yc = conj(y);
+		// Same polynomial as _LensPolynomial in VBBinaryLensingLibrary.h
+		p[0] = coefs[9] * y;
+		p[1] = coefs[10] * (coefs[20] * (coefs[21] + y * (2 * yc - coefs[20])) - 2 * y);
+		p[2] = y * (1 - coefs[7] * yc) - coefs[20] * (coefs[21] + 2 * y * yc * (1 + coefs[22])) + coefs[6] * (yc * (coefs[21] - coefs[22]) + y * (1 + coefs[22] + yc * yc));
+		p[3] = 2 * y * yc + coefs[7] * yc + coefs[6] * (yc * (2 * y - yc) - coefs[21]) - coefs[20] * (y + 2 * yc * (yc * y - coefs[22]));
+		p[4] = yc * (2 * coefs[20] + y);
+		p[4] = yc * (p[4] - 1) - coefs[20] * (p[4] - coefs[21]);
+		p[5] = yc * (coefs[20] - yc);
+		if (!warm) {
+			// Cold start on a circle enclosing the lenses and the source
+			R = 1 + sqrt(abs2(y)) + sqrt(abs2(coefs[20]));
+			for (int k = 0; k < 5; k++) z[k] = gc(R * cos(1.2566370614359173 * k + 0.4), R * sin(1.2566370614359173 * k + 0.4));
+		}
+		if (!Aberth5(p, z)) {
+			mags[ip] = -1;
+			warm = false;
+			continue;
+		}
+		warm = true;
+		// Same selection of the images as in NewImages
+		for (i = 0; i < 5; i++) {
+			zc = conj(z[i]);
+			good[i] = sqrt(abs2((y - z[i]) + coefs[21] / (zc - coefs[20]) + coefs[22] / zc));
+			for (j = i; j > 0 && good[i] > good[ord[j - 1]]; j--) ord[j] = ord[j - 1];
+			ord[j] = i;
+		}
+		three = (good[ord[1]] * dlmin > good[ord[2]] + 1.e-12);
+		Mag = 0;
+		for (j = (three) ? 2 : 0; j < 5; j++) {
+			i = ord[j];
+			dza = z[i] - coefs[20];
+			J1 = coefs[21] / (dza * dza) + coefs[22] / (z[i] * z[i]);
+			Mag += fabs(1 / (1 - J1.re * J1.re - J1.im * J1.im));
+		}
+		mags[ip] = Mag;
+	}
+}
+
+//////////////////////////////
+//////////////////////////////
+////////Host interface
+//////////////////////////////
+//////////////////////////////
+
+gpubackend *VBBGPUOpen(int device) {
+	gpubackend *gpu;
+	int ndev;
+
+	if (cudaGetDeviceCount(&ndev) != cudaSuccess || device >= ndev) return 0;
+	if (cudaSetDevice(device) != cudaSuccess) return 0;
+	gpu = (gpubackend *)calloc(1, sizeof(gpubackend));
+	gpu->device = device;
+	return gpu;
+}
+
+void VBBGPUClose(gpubackend *gpu) {
+	cudaSetDevice(gpu->device);
+	cudaFree(gpu->dts);
+	cudaFree(gpu->dobs);
+	cudaFree(gpu->dbuf);
+	free(gpu->hts);
+	free(gpu->hobs);
+	free(gpu);
+}
+
+static bool ReserveBuffer(gpubackend *gpu, size_t n) {
+	if (n <= gpu->nbuf) return true;
+	cudaFree(gpu->dbuf);
+	gpu->nbuf = 0;
+	if (cudaMalloc((void **)&gpu->dbuf, sizeof(double) * n) != cudaSuccess) {
+		gpu->dbuf = 0;
+		return false;
+	}
+	gpu->nbuf = n;
+	return true;
+}
+
+static bool UploadCached(double **dev, double **host, int *nhost, double *src, int n) {
+	// Arrays already on the device are not uploaded again
+	if (*nhost == n && memcmp(*host, src, sizeof(double) * n) == 0) return true;
+	cudaFree(*dev);
+	free(*host);
+	*nhost = 0;
+	*host = 0;
+	if (cudaMalloc((void **)dev, sizeof(double) * n) != cudaSuccess) {
+		*dev = 0;
+		return false;
+	}
+	if (cudaMemcpy(*dev, src, sizeof(double) * n, cudaMemcpyHostToDevice) != cudaSuccess) return false;
+	*host = (double *)malloc(sizeof(double) * n);
+	memcpy(*host, src, sizeof(double) * n);
+	*nhost = n;
+	return true;
+}
+
+int VBBGPUPointLens(gpubackend *gpu, int kind, double *pr, int npr, int nmodels, double *frames, double *ts, double *obs, int np, double Tol, double *mags) {
+	double *dpr, *dframes, *dmags;
+	size_t n;
+	int nfail = 0, mchunk, nm, nb;
+
+	cudaSetDevice(gpu->device);
+	if (!UploadCached(&gpu->dts, &gpu->hts, &gpu->nts, ts, np)) return -1;
+	if ((kind & 1) && !UploadCached(&gpu->dobs, &gpu->hobs, &gpu->nobs, obs, 3 * np)) return -1;
+	mchunk = (int)(gpuchunk / np);
+	if (mchunk < 1) mchunk = 1;
+	if (mchunk > nmodels) mchunk = nmodels;
+	if (!ReserveBuffer(gpu, (size_t)mchunk * (npr + 11 + np))) return -1;
+	dpr = gpu->dbuf;
+	dframes = dpr + (size_t)mchunk * npr;
+	dmags = dframes + (size_t)mchunk * 11;
+	for (int im = 0; im < nmodels; im += mchunk) {
+		nm = (nmodels - im < mchunk) ? nmodels - im : mchunk;
+		n = (size_t)nm * np;
+		if (cudaMemcpy(dpr, pr + (size_t)im * npr, sizeof(double) * nm * npr, cudaMemcpyHostToDevice) != cudaSuccess) return -1;
+		if ((kind & 1) && cudaMemcpy(dframes, frames + (size_t)im * 11, sizeof(double) * nm * 11, cudaMemcpyHostToDevice) != cudaSuccess) return -1;
+		nb = (int)((n + gputhreads - 1) / gputhreads);
+		PointLensKernel<<<nb, gputhreads>>>(kind, dpr, npr, nm, dframes, gpu->dts, gpu->dobs, np, Tol, dmags);
+		if (cudaGetLastError() != cudaSuccess) return -1;
+		if (cudaMemcpy(mags + (size_t)im * np, dmags, sizeof(double) * n, cudaMemcpyDeviceToHost) != cudaSuccess) return -1;
+	}
+	if (kind >= 2) {
+		n = (size_t)nmodels * np;
+		for (size_t i = 0; i < n; i++) nfail += (mags[i] < 0);
+	}
+	return nfail;
+}
+
+int VBBGPUBinaryMag0(gpubackend *gpu, double *coefs, double *y1s, double *y2s, double *mags, int np) {
+	gpucoefs cf;
+	double *dy1, *dy2, *dmags;
+	int nfail = 0, chunk, n, nb;
+
+	cudaSetDevice(gpu->device);
+	memcpy(cf.c, coefs, sizeof(cf.c));
+	chunk = (np < (int)(gpuchunk / 3)) ? np : (int)(gpuchunk / 3);
+	if (!ReserveBuffer(gpu, (size_t)3 * chunk)) return -1;
+	dy1 = gpu->dbuf;
+	dy2 = dy1 + chunk;
+	dmags = dy2 + chunk;
+	for (int i0 = 0; i0 < np; i0 += chunk) {
+		n = (np - i0 < chunk) ? np - i0 : chunk;
+		if (cudaMemcpy(dy1, y1s + i0, sizeof(double) * n, cudaMemcpyHostToDevice) != cudaSuccess) return -1;
+		if (cudaMemcpy(dy2, y2s + i0, sizeof(double) * n, cudaMemcpyHostToDevice) != cudaSuccess) return -1;
+		nb = ((n + gpusegment - 1) / gpusegment + gputhreads - 1) / gputhreads;
+		BinaryMag0Kernel<<<nb, gputhreads>>>(cf, dy1, dy2, dmags, n);
+		if (cudaGetLastError() != cudaSuccess) return -1;
+		if (cudaMemcpy(mags + i0, dmags, sizeof(double) * n, cudaMemcpyDeviceToHost) != cudaSuccess) return -1;
+	}
+	for (int i = 0; i < np; i++) nfail += (mags[i] < 0);
+	return nfail;
+}
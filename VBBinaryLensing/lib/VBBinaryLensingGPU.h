@@ -0,0 +1,33 @@
+// VBBinaryLensing GPU backend
+//
+// Optional CUDA kernels used by VBBinaryLensing when the library is built by "make gpu".
+// This header is the interface between VBBinaryLensingLibrary.cpp and VBBinaryLensingGPU.cu.
+// It only uses plain arrays, so that the device code does not depend on the library classes.
+//
+// GNU Lesser General Public License applies to all parts of this code.
+// Please read the separate LICENSE.txt file for more details.
+
+#ifndef __binlensgpu
+#define __binlensgpu
+
+struct gpubackend;
+
+// Opens the CUDA device with the given number. Returns 0 if there is no such device.
+gpubackend *VBBGPUOpen(int device);
+void VBBGPUClose(gpubackend *gpu);
+
+// Point-lens light curves for nmodels parameter sets on the same np times, mags has one row per model.
+// kind is 0 for PSPLLightCurve, 1 for PSPLLightCurveParallax, 2 for ESPLLightCurve, 3 for ESPLLightCurveParallax.
+// With parallax, obs contains the observer positions (Earth + satellite) at the np times and frames contains
+// 11 values per model: rad[3], tang[3], Et0[2], vt0[2] and t0_par, as calculated by ComputeParallax.
+// Times and observer positions stay on the device until different ones are passed.
+// ESPL epochs needing the limb darkening integration are set to -1.
+// Returns the number of epochs set to -1, or -1 if the device calculation failed.
+int VBBGPUPointLens(gpubackend *gpu, int kind, double *pr, int npr, int nmodels, double *frames, double *ts, double *obs, int np, double Tol, double *mags);
+
+// Point-source binary lens magnifications, with the 24 complex coefficients calculated by LensCoefficients.
+// Points whose roots do not converge are set to -1.
+// Returns the number of points set to -1, or -1 if the device calculation failed.
+int VBBGPUBinaryMag0(gpubackend *gpu, double *coefs, double *y1s, double *y2s, double *mags, int np);
+
+#endif
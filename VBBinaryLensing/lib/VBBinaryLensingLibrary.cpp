@@ -35,10 +35,102 @@ char systemslash = '/';
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <exception>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define _VBB_AVX2 __attribute__((target("avx2")))
+#endif
+#ifdef _VBB_GPU
+#include "VBBinaryLensingGPU.h"
+#else
+// Without the GPU backend no device can be opened and all calculations stay on the CPU
+static inline gpubackend *VBBGPUOpen(int) { return 0; }
+static inline void VBBGPUClose(gpubackend *) {}
+static inline int VBBGPUPointLens(gpubackend *, int, double *, int, int, double *, double *, double *, int, double, double *) { return -1; }
+static inline int VBBGPUBinaryMag0(gpubackend *, double *, double *, double *, double *, int) { return -1; }
+#endif
+const int gpuminpoints = 4096; // Smaller calculations are left to the CPU
+const int pointblock = 256; // Contiguous positions per thread task in the array version of BinaryMag0
+const int gridchunk = 16; // Contiguous positions per thread task in the array version of BinaryMag2
 
 #ifndef __unmanaged
 using namespace VBBinaryLensingLibrary;
 #endif
+
+// Magnification maps, described in the section "Magnification maps"
+struct magmapnode {
+	int child; // Index of the first of the four children, 0 for leaves
+	int good; // 0 if the interpolation does not meet the accuracy goal in this leaf
+	double mag[4]; // Magnifications at the corners (x0,y0), (x0+size,y0), (x0,y0+size), (x0+size,y0+size)
+};
+
+struct magmap {
+	double s, q, rho, a1, a2, Tol, RelTol;
+	double y1min, y2min, size;
+	int n1, n2, maxdepth, nnodes, LD;
+	magmapnode *nodes;
+	std::atomic<int> refs;
+};
+
+// Persistent result cache, described in the section "Persistent result cache"
+#define MCKEY 10 // Words in the key of a result
+struct magcacheentry {
+	std::atomic<unsigned int> state; // 0 empty, 2 complete, odd while being written (2*t+1 with t the time of the claim in seconds)
+	unsigned int check; // Checksum of key and results
+	unsigned long long key[MCKEY]; // Settings, then bit patterns of s, q, y1, y2, rho, accuracy, RelTol, a1, a2
+	double res[5]; // Mag, astrox1, astrox2, therr, NPS
+};
+
+struct magcache {
+	char *map;
+	size_t size;
+	long long nslots;
+	magcacheentry *entries;
+	char *filename;
+	std::atomic<int> refs;
+};
+
+// Pre-calculated tables for uniform sources and point lenses, described in the section "ESPL tables"
+struct espltable {
+	int nr, nz; // Number of values of rho (rows) and of distances from the lens (columns)
+	double rhomin, rhomax, lrfac; // Rows go from rhomax down to rhomin, lrfac*log(rhomax/rho) is the row index
+	double *in, *out, *inastro, *outastro;
+	char *map;
+	size_t mapsize;
+	std::atomic<int> refs;
+};
+
+// Bounding boxes of the caustics, described in the section "Caustic index"
+struct causticboxes {
+	int ncau; // Number of caustics
+	int *start; // Box start[i] encloses caustic i, boxes start[i]+1 ... start[i+1]-1 enclose consecutive pieces of it
+	double *box; // y1min, y1max, y2min, y2max of each box
+	std::atomic<int> refs;
+};
+
+// Fixed model evaluated on epochs arriving over time, described in the section "Streaming light curves"
+struct lcstream {
+	void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, int);
+	double *pr;
+	int npr;
+	double *ts, *pos; // Epochs received so far and observer positions at these epochs (Earth and satellite, 6 values per epoch)
+	int n, size, satellite; // Satellite and availability of the target coordinates at StreamOpen fix the observer positions
+	bool parallax;
+	complex zr[5]; // Roots of the lens equation at the last epoch, starting point for the next ones
+};
+
+// Wall clock for the timers in stats
+static inline double statsclock(void) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 //////////////////////////////
 //////////////////////////////
 ////////Constructor and destructor
@@ -58,45 +150,227 @@ VBBinaryLensing::VBBinaryLensing() {
 	North2000[1] = 0.3977772982704228;
 	North2000[2] = 0.9174820003578725;
 	t0old = 0.;
+	sv0 = qv0 = sv = qv = -1.0;
+	tposcache = poscache = 0;
+	nposcache = iposcache = satposcache = 0;
+	lenscachesize = 16;
+	lenscache = (lensentry *)malloc(sizeof(lensentry) * lenscachesize);
+	nlenscache = 0;
+	lensclock = 0;
+	lenscachehits = lenscachemisses = 0;
+	curmap = 0;
+	mcache = 0;
+	gpu = 0;
+	stream = 0;
+	espl = 0;
+	magcachehits = magcachemisses = 0;
 	Tol = 1.e-2;
 	RelTol = 0;
+	InterpolationTol = 0;
 	tsat = 0;
 	possat = 0;
 	nsat = 0;
 	ndatasat = 0;
+	satmap = 0;
+	satmapsize = 0;
 	satellite = 0;
 	parallaxsystem = 0;
 	t0_par_fixed = -1;
 	t0_par = 7000;
 	minannuli = 1;
+	maxNPS = maxannuli = 0;
+	maxtime = 0;
+	budgetopen = budgetout = false;
 	curLDprofile = LDlinear;
 	a1 = 0;
 	npLD = 0;
 	LDtab = rCLDtab = CLDtab=0;
 	Mag0 = 0;
 	NPcrit = 200;
-	ESPLoff = true;
+	nthreads = 1;
 	multidark = false;
+	annlist = 0;
+	nbands = 0;
+	bandLD = 0;
+	banda1 = banda2 = 0;
+	gradgeom = 0;
     astrometry=false;
+	causticindex = false;
+	parallelannuli = false;
 	mass_luminosity_exponent = 4.0;
 	mass_radius_exponent = 0.9;
+	ResetStats();
 }
 
-VBBinaryLensing::~VBBinaryLensing() {
-	if (nsat) {
-		for (int i = 0; i<nsat; i++) {
-			for (int j = 0; j<ndatasat[i]; j++) free(possat[i][j]);
-			free(tsat[i]);
-			free(possat[i]);
+VBBinaryLensing::VBBinaryLensing(const VBBinaryLensing &other) : VBBinaryLensing() {
+	// Settings and tables are copied, buffers owned by the instance are duplicated.
+	// The state of calculations in progress (images, annuli, budget, stream, GPU) starts empty as in a new instance.
+	Tol = other.Tol;
+	RelTol = other.RelTol;
+	a1 = other.a1;
+	a2 = other.a2;
+	curLDprofile = other.curLDprofile;
+	t0_par = other.t0_par;
+	t0_par_fixed = other.t0_par_fixed;
+	InterpolationTol = other.InterpolationTol;
+	mass_radius_exponent = other.mass_radius_exponent;
+	mass_luminosity_exponent = other.mass_luminosity_exponent;
+	astrometry = other.astrometry;
+	causticindex = other.causticindex;
+	parallelannuli = other.parallelannuli;
+	satellite = other.satellite;
+	parallaxsystem = other.parallaxsystem;
+	minannuli = other.minannuli;
+	nannuli = other.nannuli;
+	NPS = other.NPS;
+	NPcrit = other.NPcrit;
+	nthreads = other.nthreads;
+	maxNPS = other.maxNPS;
+	maxannuli = other.maxannuli;
+	maxtime = other.maxtime;
+	y_1 = other.y_1;
+	y_2 = other.y_2;
+	av = other.av;
+	therr = other.therr;
+	astrox1 = other.astrox1;
+	astrox2 = other.astrox2;
+	lenscachehits = other.lenscachehits;
+	lenscachemisses = other.lenscachemisses;
+	magcachehits = other.magcachehits;
+	magcachemisses = other.magcachemisses;
+	stats = other.stats;
+	// Target coordinates and observer frame
+	for (int i = 0; i < 3; i++) {
+		Obj[i] = other.Obj[i];
+		rad[i] = other.rad[i];
+		tang[i] = other.tang[i];
+	}
+	// Lens equation coefficients and last roots, used as starting points
+	for (int i = 0; i < 24; i++) {
+		coefs0[i] = other.coefs0[i];
+		coefs[i] = other.coefs[i];
+	}
+	for (int i = 0; i < 5; i++) zr[i] = other.zr[i];
+	sv0 = other.sv0;
+	qv0 = other.qv0;
+	sv = other.sv;
+	qv = other.qv;
+	// Settings of the call in progress (LightCurveMultiBand, LightCurveGradient) seen by the workers of ParallelRun
+	SetBands(other.bandLD, other.banda1, other.banda2, other.nbands);
+	bandsdone = other.bandsdone;
+	gradgeom = other.gradgeom;
+	SetLensCacheSize(other.lenscachesize);
+	if (lenscachesize > 0) {
+		// Critical curves are not copied: they will be recalculated if needed. Caustic boxes are shared
+		nlenscache = other.nlenscache;
+		lensclock = other.lensclock;
+		memcpy(lenscache, other.lenscache, sizeof(lensentry) * nlenscache);
+		for (int i = 0; i < nlenscache; i++) {
+			lenscache[i].crit = 0;
+			if (lenscache[i].cboxes) lenscache[i].cboxes->refs++;
+		}
+	}
+	// Magnification maps and ESPL tables are read-only and shared
+	curmap = other.curmap;
+	mcache = other.mcache;
+	espl = other.espl;
+	if (curmap) curmap->refs++;
+	if (mcache) mcache->refs++;
+	if (espl) espl->refs++;
+	// Copies (e.g. the worker threads of ParallelRun) calculate on the CPU and have no stream: gpu and stream stay 0
+	nposcache = other.nposcache;
+	iposcache = other.iposcache;
+	satposcache = other.satposcache;
+	if (nposcache > 0) {
+		tposcache = (double *)malloc(sizeof(double) * nposcache);
+		poscache = (double *)malloc(sizeof(double) * 6 * nposcache);
+		memcpy(tposcache, other.tposcache, sizeof(double) * nposcache);
+		memcpy(poscache, other.poscache, sizeof(double) * 6 * nposcache);
+	}
+	// Satellite tables are always copied to memory owned by the instance, even if memory-mapped in the original
+	nsat = other.nsat;
+	if (other.tsat) {
+		tsat = (double**)malloc(sizeof(double*) * nsat);
+		possat = (double**)malloc(sizeof(double*) * nsat);
+		ndatasat = (int*)malloc(sizeof(int) * nsat);
+		for (int i = 0; i < nsat; i++) {
+			ndatasat[i] = other.ndatasat[i];
+			tsat[i] = (double*)malloc(sizeof(double) * ndatasat[i]);
+			possat[i] = (double*)malloc(sizeof(double) * 3 * ndatasat[i]);
+			memcpy(tsat[i], other.tsat[i], sizeof(double) * ndatasat[i]);
+			memcpy(possat[i], other.possat[i], sizeof(double) * 3 * ndatasat[i]);
 		}
-		free(tsat);
-		free(possat);
-		free(ndatasat);
 	}
+	npLD = other.npLD;
+	if (npLD > 0) {
+		LDtab = (double *)malloc(sizeof(double)*(npLD + 1));
+		rCLDtab = (double *)malloc(sizeof(double)*(npLD + 1));
+		CLDtab = (double *)malloc(sizeof(double)*(npLD + 1));
+		memcpy(LDtab, other.LDtab, sizeof(double)*(npLD + 1));
+		memcpy(rCLDtab, other.rCLDtab, sizeof(double)*(npLD + 1));
+		memcpy(CLDtab, other.CLDtab, sizeof(double)*(npLD + 1));
+	}
+}
+
+VBBinaryLensing::~VBBinaryLensing() {
+	FreeSatelliteTables();
+	PrepareParallax(0, 0);
 	if (npLD > 0) {
 		free(LDtab);
 		free(rCLDtab);
+		free(CLDtab);
 	}
+	SetLensCacheSize(0);
+	FreeMagMap();
+	CloseMagCache();
+	FreeESPLTable();
+	StreamClose();
+	SetBands(0, 0, 0, 0);
+	if (gpu) VBBGPUClose(gpu);
+}
+
+void VBBinaryLensing::ResetStats(void) {
+	memset(&stats, 0, sizeof(_stats));
+}
+
+void VBBinaryLensing::AddStats(_stats &worker, _stats &start) {
+	// Adds the counts of a worker copy made when the counters were at start
+	stats.newimages += worker.newimages - start.newimages;
+	stats.rootiterations += worker.rootiterations - start.rootiterations;
+	stats.thetas += worker.thetas - start.thetas;
+	stats.annuli += worker.annuli - start.annuli;
+	stats.fallbacks += worker.fallbacks - start.fallbacks;
+	stats.shortcuts += worker.shortcuts - start.shortcuts;
+	stats.finitesource += worker.finitesource - start.finitesource;
+	stats.budgetstops += worker.budgetstops - start.budgetstops;
+	stats.tcontour += worker.tcontour - start.tcontour;
+	stats.tdark += worker.tdark - start.tdark;
+	stats.tlightcurve += worker.tlightcurve - start.tlightcurve;
+}
+
+// The budget of a magnification is counted from the outermost of nested calls (BinaryMagDark calling BinaryMag).
+// When it runs out, the calculations stop at the next check and return the current estimate, with its error in therr.
+
+bool VBBinaryLensing::BudgetOpen(double tim0) {
+	// Returns true if the caller has started the budget and must close it
+	if (budgetopen) return false;
+	budgetopen = true;
+	budgetout = false;
+	budgetNPS = 0;
+	budgetend = (maxtime > 0) ? tim0 + maxtime : 0;
+	return true;
+}
+
+bool VBBinaryLensing::BudgetExhausted(int nps, int nann) {
+	// nps points of the contour in progress are not yet included in budgetNPS, nann is the number of annuli calculated so far
+	if (!budgetout && ((maxNPS > 0 && budgetNPS + nps >= maxNPS) || (maxannuli > 0 && nann >= maxannuli) || (budgetend > 0 && statsclock() > budgetend))) budgetout = true;
+	return budgetout;
+}
+
+void VBBinaryLensing::BudgetClose(bool own) {
+	if (!own) return;
+	budgetopen = false;
+	if (budgetout) stats.budgetstops++;
 }
 
 
@@ -108,6 +382,30 @@ VBBinaryLensing::~VBBinaryLensing() {
 
 
 _sols *VBBinaryLensing::PlotCrit(double a1, double q1) {
+	lensentry *e;
+	_sols *CriticalCurves;
+	_curve *Prov;
+
+	e = LensEntry(a1, q1);
+	if (!e) return ComputeCrit(a1, q1);
+	if (!e->crit || e->NPcrit != NPcrit) {
+		delete e->crit;
+		e->crit = ComputeCrit(a1, q1);
+		e->NPcrit = NPcrit;
+	}
+	// The caller owns the returned curves: the cached ones are copied
+	CriticalCurves = new _sols;
+	for (_curve *scancurve = e->crit->first; scancurve; scancurve = scancurve->next) {
+		Prov = new _curve;
+		for (_point *scanpoint = scancurve->first; scanpoint; scanpoint = scanpoint->next) {
+			Prov->append(scanpoint->x1, scanpoint->x2);
+		}
+		CriticalCurves->append(Prov);
+	}
+	return CriticalCurves;
+}
+
+_sols *VBBinaryLensing::ComputeCrit(double a1, double q1) {
 	complex  a, q, ej, zr[4], x1, x2;
 	_sols *CriticalCurves;
 	_curve *Prov, *Prov2, *isso;
@@ -138,6 +436,7 @@ _sols *VBBinaryLensing::PlotCrit(double a1, double q1) {
 				Prov2->drop(pisso);
 				Prov->append(pisso);
 			}
+			delete Prov2;
 		}
 		else {
 			Prov = CriticalCurves->first;
@@ -183,6 +482,451 @@ _sols *VBBinaryLensing::PlotCrit(double a1, double q1) {
 	return CriticalCurves;
 }
 
+// Critical curves and caustics in flat arrays. The quartic of ComputeCrit is solved for all the angles at once by cmplx_roots_batch
+// and its roots are linked into four branches from phi=0 to phi=2pi, matching each root with the closest at the previous angle.
+// The intervals of phi where a caustic turns by more than critturn (i.e. around the cusps) are then halved, up to critpasses times.
+// Each branch ends at phi=2pi where another one starts at phi=0: the cycles of this permutation are the critical curves.
+
+const int critpasses = 4;
+const double critturn = 0.3;
+
+static void CritPolynomial(double a, double q, double phi, double *pre, double *pim, int l) {
+	// Coefficients of the quartic in ComputeCrit, in lane l of a batch
+	double ec = cos(phi), es = -sin(phi), a2 = a * a, c = a2 * (1 + q) / 16;
+	pre[l] = c * (4 - a2 * ec);
+	pim[l] = -c * a2 * es;
+	pre[MB + l] = a * (q - 1);
+	pim[MB + l] = 0;
+	pre[2 * MB + l] = (q + 1) * (1 + a2 * ec / 2);
+	pim[2 * MB + l] = (q + 1) * a2 * es / 2;
+	pre[3 * MB + l] = pim[3 * MB + l] = 0;
+	pre[4 * MB + l] = -(1 + q) * ec;
+	pim[4 * MB + l] = -(1 + q) * es;
+}
+
+static void CritMatch(double *prev, double *roots, double *z, int *ind) {
+	// Branches take in turn the closest of the remaining roots, as in ComputeCrit. Points are (re,im) pairs.
+	// Branch b gets root ind[b].
+	bool used[4] = { false, false, false, false };
+	double d, md;
+	int best = 0;
+
+	for (int b = 0; b < 4; b++) {
+		md = 1.e100;
+		for (int i = 0; i < 4; i++) {
+			if (used[i]) continue;
+			d = (roots[2 * i] - prev[2 * b]) * (roots[2 * i] - prev[2 * b]) + (roots[2 * i + 1] - prev[2 * b + 1]) * (roots[2 * i + 1] - prev[2 * b + 1]);
+			if (d < md) {
+				md = d;
+				best = i;
+			}
+		}
+		used[best] = true;
+		ind[b] = best;
+		z[2 * b] = roots[2 * best];
+		z[2 * b + 1] = roots[2 * best + 1];
+	}
+}
+
+static inline void CausticPoint(double a, double q, double x1, double x2, double *y) {
+	y[0] = _L1;
+	y[1] = _L2;
+}
+
+static bool CausticTurns(double *c0, double *c1, double *c2) {
+	// True if the segment c1-c2 turns by more than critturn from c0-c1
+	double u1 = c1[0] - c0[0], u2 = c1[1] - c0[1], v1 = c2[0] - c1[0], v2 = c2[1] - c1[1];
+	return u1 * v1 + u2 * v2 < cos(critturn) * sqrt((u1 * u1 + u2 * u2) * (v1 * v1 + v2 * v2));
+}
+
+int VBBinaryLensing::PlotCrit(double a1, double q1, double *x1s, double *x2s, int *offsets, int maxpoints) {
+	double pre[5 * MB], pim[5 * MB], rre[4 * MB], rim[4 * MB], qre[4 * MB], qim[4 * MB], roots[8], w, *ts, *z, *cau, *ts2, *z2, centeroffset;
+	int n, np, seg, nl, k, l, nsplit, nmid, perm[4], ncrit, ib, ip, *mids;
+	bool *split, used[4];
+
+	n = NPcrit;
+	if (n < 4 || 8 * n > maxpoints) {
+		printf("\nPlotCrit needs room for at least 8*NPcrit points");
+		return 0;
+	}
+	centeroffset = a1 / 2.0 * (1.0 - q1) / (1.0 + q1);
+	// Angles ts[0...n] and roots z, with the four branches of angle k at z + 8 * k
+	ts = (double *)malloc(sizeof(double) * (n + 1));
+	z = (double *)malloc(sizeof(double) * 8 * (n + 1));
+	for (k = 0; k <= n; k++) ts[k] = 2 * k * M_PI / n;
+
+	// One lane per segment of consecutive angles, starting from the roots extrapolated from the two previous angles
+	np = n + 1;
+	seg = (np + MB - 1) / MB;
+	for (int i = 0; i < 4; i++) {
+		for (l = 0; l < MB; l++) {
+			rre[i * MB + l] = (1 + a1) * cos(i * M_PI / 2 + 0.4);
+			rim[i * MB + l] = (1 + a1) * sin(i * M_PI / 2 + 0.4);
+		}
+	}
+	for (int it = 0; it < seg; it++) {
+		nl = (np - it + seg - 1) / seg;
+		if (nl > MB) nl = MB;
+		for (l = 0; l < nl; l++) CritPolynomial(a1, q1, ts[l * seg + it], pre, pim, l);
+		cmplx_roots_batch(rre, rim, pre, pim, 4, nl);
+		for (l = 0; l < nl; l++) {
+			k = l * seg + it;
+			for (int i = 0; i < 4; i++) {
+				z[8 * k + 2 * i] = rre[i * MB + l];
+				z[8 * k + 2 * i + 1] = rim[i * MB + l];
+			}
+		}
+		for (int i = 0; i < 4 * MB; i++) {
+			w = rre[i];
+			if (it > 0) rre[i] = 2 * w - qre[i];
+			qre[i] = w;
+			w = rim[i];
+			if (it > 0) rim[i] = 2 * w - qim[i];
+			qim[i] = w;
+		}
+	}
+	for (k = 1; k <= n; k++) {
+		for (int i = 0; i < 8; i++) roots[i] = z[8 * k + i];
+		CritMatch(z + 8 * (k - 1), roots, z + 8 * k, perm);
+	}
+
+	// Refinement of the intervals where the caustics turn sharply, as long as the new points fit in the arrays
+	for (int pass = 0; pass < critpasses && 8 * (n + 1) <= maxpoints; pass++) {
+		cau = (double *)malloc(sizeof(double) * 8 * (n + 1));
+		split = (bool *)malloc(sizeof(bool) * n);
+		for (k = 0; k <= n; k++) {
+			for (int b = 0; b < 4; b++) CausticPoint(a1, q1, z[8 * k + 2 * b], z[8 * k + 2 * b + 1], cau + 8 * k + 2 * b);
+		}
+		nsplit = 0;
+		for (k = 0; k < n; k++) {
+			split[k] = false;
+			for (int b = 0; b < 4 && !split[k]; b++) {
+				split[k] = (k > 0 && CausticTurns(cau + 8 * (k - 1) + 2 * b, cau + 8 * k + 2 * b, cau + 8 * (k + 1) + 2 * b))
+					|| (k + 1 < n && CausticTurns(cau + 8 * k + 2 * b, cau + 8 * (k + 1) + 2 * b, cau + 8 * (k + 2) + 2 * b));
+			}
+			nsplit += split[k];
+		}
+		free(cau);
+		if (nsplit == 0 || 8 * (n + nsplit) > maxpoints) {
+			free(split);
+			break;
+		}
+		ts2 = (double *)malloc(sizeof(double) * (n + nsplit + 1));
+		z2 = (double *)malloc(sizeof(double) * 8 * (n + nsplit + 1));
+		mids = (int *)malloc(sizeof(int) * nsplit);
+		nmid = 0;
+		ip = 0;
+		for (k = 0; k <= n; k++) {
+			ts2[ip] = ts[k];
+			memcpy(z2 + 8 * ip, z + 8 * k, sizeof(double) * 8);
+			ip++;
+			if (k < n && split[k]) {
+				ts2[ip] = 0.5 * (ts[k] + ts[k + 1]);
+				mids[nmid++] = ip++;
+			}
+		}
+		// New angles start from the roots of the previous angle in the order of the branches
+		for (int i0 = 0; i0 < nmid; i0 += MB) {
+			nl = (nmid - i0 < MB) ? nmid - i0 : MB;
+			for (l = 0; l < nl; l++) {
+				k = mids[i0 + l];
+				CritPolynomial(a1, q1, ts2[k], pre, pim, l);
+				for (int i = 0; i < 4; i++) {
+					rre[i * MB + l] = z2[8 * (k - 1) + 2 * i];
+					rim[i * MB + l] = z2[8 * (k - 1) + 2 * i + 1];
+				}
+			}
+			cmplx_roots_batch(rre, rim, pre, pim, 4, nl);
+			for (l = 0; l < nl; l++) {
+				k = mids[i0 + l];
+				for (int i = 0; i < 4; i++) {
+					roots[2 * i] = rre[i * MB + l];
+					roots[2 * i + 1] = rim[i * MB + l];
+				}
+				CritMatch(z2 + 8 * (k - 1), roots, z2 + 8 * k, perm);
+			}
+		}
+		free(ts);
+		free(z);
+		free(split);
+		free(mids);
+		ts = ts2;
+		z = z2;
+		n += nsplit;
+	}
+
+	// Branch b continues into branch perm[b], starting at the same point
+	CritMatch(z + 8 * n, z, roots, perm);
+	for (int b = 0; b < 4; b++) used[b] = false;
+	ncrit = 0;
+	ip = 0;
+	for (int b0 = 0; b0 < 4; b0++) {
+		if (used[b0]) continue;
+		offsets[ncrit++] = ip;
+		for (int b = b0; !used[b]; b = perm[b]) {
+			used[b] = true;
+			for (k = 0; k < n; k++, ip++) {
+				x1s[ip] = z[8 * k + 2 * b] + centeroffset;
+				x2s[ip] = z[8 * k + 2 * b + 1];
+			}
+		}
+	}
+	// Caustics, in the same order as the critical curves
+	for (ib = 0; ib < ncrit; ib++) offsets[ncrit + ib] = offsets[ib] + ip;
+	for (k = 0; k < ip; k++) {
+		CausticPoint(a1, q1, x1s[k] - centeroffset, x2s[k], roots);
+		x1s[ip + k] = roots[0] + centeroffset;
+		x2s[ip + k] = roots[1];
+	}
+	offsets[2 * ncrit] = 2 * ip;
+	free(ts);
+	free(z);
+	return 2 * ncrit;
+}
+
+//////////////////////////////
+//////////////////////////////
+////////Cache of lens-dependent quantities
+//////////////////////////////
+//////////////////////////////
+
+// Entries are identified by (s,q) and the least recently used one is replaced when the cache is full.
+// Only the costly quantities are stored: critical curves (PlotCrit) and caustic boxes (caustic index), calculated when first requested.
+// The equation coefficients take a few operations and are recalculated whenever (s,q) changes, so that light curves with orbital motion,
+// which have a new s at each epoch, do not fill the cache with entries that will never be used again.
+
+static void ComputeLensCoefficients(double s, double q, complex *coefs) {
+	complex a, qc, m1, m2;
+
+	if (q<1) {
+		a = complex(-s, 0);
+		qc = complex(q, 0);
+	}
+	else {
+		a = complex(s, 0);
+		qc = complex(1 / q, 0);
+	}
+	m1 = 1.0 / (1.0 + qc);
+	m2 = qc*m1;
+
+	coefs[20] = a;
+	coefs[21] = m1;
+	coefs[22] = m2;
+	coefs[6] = a*a;
+	coefs[7] = coefs[6] * a;
+	coefs[8] = m2*m2;
+	coefs[9] = coefs[6] * coefs[8];
+	coefs[10] = a*m2;
+	coefs[11] = a*m1;
+}
+
+lensentry *VBBinaryLensing::LensEntry(double s, double q) {
+	lensentry *e;
+
+	if (lenscachesize <= 0) return 0;
+	for (int i = 0; i < nlenscache; i++) {
+		if (lenscache[i].s == s && lenscache[i].q == q) {
+			lenscache[i].lastuse = ++lensclock;
+			lenscachehits++;
+			return lenscache + i;
+		}
+	}
+	lenscachemisses++;
+	if (nlenscache < lenscachesize) {
+		e = lenscache + nlenscache;
+		nlenscache++;
+	}
+	else {
+		e = lenscache;
+		for (int i = 1; i < nlenscache; i++) {
+			if (lenscache[i].lastuse < e->lastuse) e = lenscache + i;
+		}
+		delete e->crit;
+		FreeCausticBoxes(e->cboxes);
+	}
+	e->s = s;
+	e->q = q;
+	e->crit = 0;
+	e->NPcrit = 0;
+	e->cboxes = 0;
+	e->lastuse = ++lensclock;
+	return e;
+}
+
+void VBBinaryLensing::SetLensCacheSize(int size) {
+	ClearLensCache();
+	if (lenscachesize > 0) free(lenscache);
+	lenscache = 0;
+	lenscachesize = (size > 0) ? size : 0;
+	if (lenscachesize > 0) lenscache = (lensentry *)malloc(sizeof(lensentry) * lenscachesize);
+}
+
+int VBBinaryLensing::LensCacheLength(void) {
+	return nlenscache;
+}
+
+void VBBinaryLensing::ClearLensCache(void) {
+	for (int i = 0; i < nlenscache; i++) {
+		delete lenscache[i].crit;
+		FreeCausticBoxes(lenscache[i].cboxes);
+	}
+	nlenscache = 0;
+	lenscachehits = lenscachemisses = 0;
+	sv0 = qv0 = sv = qv = -1.0;
+}
+
+//////////////////////////////
+//////////////////////////////
+////////Caustic index
+//////////////////////////////
+//////////////////////////////
+
+// With causticindex set, BinaryMag2 first checks the distance of the source from the caustics of the lens.
+// Each caustic returned by PlotCrit is covered by boxes enclosing pieces of cboxpoints consecutive points,
+// enlarged by the longest step between them, so that the caustic between the calculated points is also inside.
+// Sources farther than CausticSafeDistance(rho) from all boxes get the point-source magnification directly,
+// without allocating images for the quadrupole and ghost image tests.
+
+const int cboxpoints = 16;
+
+causticboxes *VBBinaryLensing::CausticBoxes(double s, double q) {
+	lensentry *e;
+	causticboxes *cb;
+	_sols *crit;
+	_curve *scancurve;
+	_point *p, *pn;
+	double *b, *bc, step;
+	int ncau, npts, nbox, ib, k;
+
+	e = LensEntry(s, q);
+	if (!e) return 0;
+	if (e->cboxes) return e->cboxes;
+	if (!e->crit || e->NPcrit != NPcrit) {
+		delete e->crit;
+		e->crit = ComputeCrit(s, q);
+		e->NPcrit = NPcrit;
+	}
+	crit = e->crit;
+	// Critical curves come first, then their caustics
+	ncau = crit->length / 2;
+	scancurve = crit->first;
+	for (int i = 0; i < ncau; i++) scancurve = scancurve->next;
+	nbox = 0;
+	for (_curve *c = scancurve; c; c = c->next) nbox += 1 + (c->length + cboxpoints - 1) / cboxpoints;
+	cb = (causticboxes *)malloc(sizeof(causticboxes));
+	cb->ncau = ncau;
+	cb->start = (int *)malloc(sizeof(int) * (ncau + 1));
+	cb->box = (double *)malloc(sizeof(double) * 4 * nbox);
+	cb->refs = 1;
+	ib = 0;
+	for (int i = 0; i < ncau; i++, scancurve = scancurve->next) {
+		cb->start[i] = ib;
+		bc = cb->box + 4 * ib++;
+		bc[0] = bc[2] = 1.e100;
+		bc[1] = bc[3] = -1.e100;
+		p = scancurve->first;
+		npts = scancurve->length;
+		while (p) {
+			b = cb->box + 4 * ib++;
+			b[0] = b[1] = p->x1;
+			b[2] = b[3] = p->x2;
+			step = 0;
+			// Each piece ends with the first point of the next one, the last piece closes the curve
+			for (k = 0; k < cboxpoints && p; k++) {
+				pn = (p->next) ? p->next : (npts > 1) ? scancurve->first : p;
+				if (pn->x1 < b[0]) b[0] = pn->x1;
+				if (pn->x1 > b[1]) b[1] = pn->x1;
+				if (pn->x2 < b[2]) b[2] = pn->x2;
+				if (pn->x2 > b[3]) b[3] = pn->x2;
+				if (*p - *pn > step) step = *p - *pn;
+				p = p->next;
+			}
+			b[0] -= step;
+			b[1] += step;
+			b[2] -= step;
+			b[3] += step;
+			if (b[0] < bc[0]) bc[0] = b[0];
+			if (b[1] > bc[1]) bc[1] = b[1];
+			if (b[2] < bc[2]) bc[2] = b[2];
+			if (b[3] > bc[3]) bc[3] = b[3];
+		}
+	}
+	cb->start[ncau] = ib;
+	e->cboxes = cb;
+	return cb;
+}
+
+void VBBinaryLensing::FreeCausticBoxes(causticboxes *cb) {
+	if (cb && --cb->refs == 0) {
+		free(cb->start);
+		free(cb->box);
+		free(cb);
+	}
+}
+
+static inline bool BoxFartherThan(double *b, double y1, double y2, double dist2) {
+	double d1, d2;
+
+	d1 = (y1 < b[0]) ? b[0] - y1 : (y1 > b[1]) ? y1 - b[1] : 0;
+	d2 = (y2 < b[2]) ? b[2] - y2 : (y2 > b[3]) ? y2 - b[3] : 0;
+	return d1 * d1 + d2 * d2 > dist2;
+}
+
+bool VBBinaryLensing::FarFromCaustics(causticboxes *cb, double y1, double y2, double dist) {
+	double dist2 = dist * dist;
+
+	for (int i = 0; i < cb->ncau; i++) {
+		if (BoxFartherThan(cb->box + 4 * cb->start[i], y1, y2, dist2)) continue;
+		for (int ib = cb->start[i] + 1; ib < cb->start[i + 1]; ib++) {
+			if (!BoxFartherThan(cb->box + 4 * ib, y1, y2, dist2)) return false;
+		}
+	}
+	return true;
+}
+
+double VBBinaryLensing::CausticSafeDistance(double rho) {
+	// Beyond this distance from the caustics, the finite-source correction stays below Tol/2 
+	// (calibrated on s from 0.3 to 4, q from 1.e-4 to 1, rho from 1.e-4 to 0.05, Tol from 1.e-4 to 1.e-2, with a safety factor 1.5)
+	return 2 * cbrt(rho * rho / Tol);
+}
+
+bool VBBinaryLensing::BinaryMag2Indexed(double s, double q, double *y1s, double *y2s, double rho, double *mags, int np) {
+	// Light curve points far from the caustics are calculated by the array version of BinaryMag0, the others by BinaryMag2
+	causticboxes *cb;
+	double *buf, *fy1, *fy2, *fmag, dist;
+	int *ifar, *inear, nfar, nnear;
+
+	if (astrometry || curmap || !(cb = CausticBoxes(s, q))) return false;
+	dist = CausticSafeDistance(rho);
+	buf = (double *)malloc(sizeof(double) * 3 * np);
+	fy1 = buf;
+	fy2 = fy1 + np;
+	fmag = fy2 + np;
+	ifar = (int *)malloc(sizeof(int) * 2 * np);
+	inear = ifar + np;
+	nfar = nnear = 0;
+	for (int i = 0; i < np; i++) {
+		if (FarFromCaustics(cb, y1s[i], y2s[i], dist)) {
+			fy1[nfar] = y1s[i];
+			fy2[nfar] = y2s[i];
+			ifar[nfar++] = i;
+		}
+		else {
+			inear[nnear++] = i;
+		}
+	}
+	BinaryMag0(s, q, fy1, fy2, fmag, nfar);
+	for (int k = 0; k < nfar; k++) mags[ifar[k]] = fmag[k];
+	stats.shortcuts += nfar;
+	ParallelRun(nnear, 4, [&](VBBinaryLensing *VBBL, int k) {
+		int i = inear[k];
+		mags[i] = VBBL->BinaryMag2(s, q, y1s[i], y2s[i], rho);
+	});
+	free(buf);
+	free(ifar);
+	return true;
+}
+
 void VBBinaryLensing::PrintCau(double a, double q, double y1, double y2, double rho) {
 	_sols *CriticalCurves;
 	_curve *scancurve;
@@ -218,11 +962,9 @@ void VBBinaryLensing::PrintCau(double a, double q, double y1, double y2, double
 //////////////////////////////
 
 void VBBinaryLensing::SetObjectCoordinates(char* modelfile, char* sateltabledir) {
-	double RA, Dec, dis, phiprec;
 	FILE* f;
 	char CoordinateString[512];
 	char filename[256];
-	int ic;
 
 	f = fopen(modelfile, "r");
 	if (f != 0) {
@@ -230,117 +972,256 @@ void VBBinaryLensing::SetObjectCoordinates(char* modelfile, char* sateltabledir)
 		fclose(f);
 		SetObjectCoordinates(CoordinateString);
 
-		// Looking for satellite table files in the specified directory
-		sprintf(filename, "%s%csatellite*.txt", sateltabledir, systemslash);
-		nsat = 0;
-		for (unsigned char c = 32; c < 255; c++) {
-			filename[strlen(filename) - 5] = c;
-			f = fopen(filename, "r");
-			if (f != 0) {
-				nsat++;
-				fclose(f);
-			}
+		// The binary tables written by ConvertSatelliteTables are preferred to the text tables
+		sprintf(filename, "%s%csatellites.bin", sateltabledir, systemslash);
+		if (!LoadSatelliteTables(filename)) {
+			ReadSatelliteTables(sateltabledir);
 		}
+	}
+	else {
+		printf("\nFile not found!\n");
+	}
+}
+
+void VBBinaryLensing::ReadSatelliteTables(char* sateltabledir) {
+	double RA, Dec, dis, phiprec;
+	FILE* f;
+	char filename[256];
+	int ic;
 
+	FreeSatelliteTables();
+
+	// Looking for satellite table files in the specified directory
+	sprintf(filename, "%s%csatellite*.txt", sateltabledir, systemslash);
+	nsat = 0;
+	for (unsigned char c = 32; c < 255; c++) {
+		filename[strlen(filename) - 5] = c;
+		f = fopen(filename, "r");
+		if (f != 0) {
+			nsat++;
+			fclose(f);
+		}
+	}
 
-		tsat = (double**)malloc(sizeof(double*) * nsat);
-		possat = (double***)malloc(sizeof(double**) * nsat);
-		ndatasat = (int*)malloc(sizeof(int) * nsat);
 
-		// Reading satellite table files
-		ic = 0;
-		for (unsigned char c = 32; c < 255; c++) {
-			filename[strlen(filename) - 5] = c;
-			f = fopen(filename, "r");
-			if (f != 0) {
-				int flag2 = 0;
-				long startpos = 0;
-				char teststring[1000];
-				ndatasat[ic] = 1;
-
-				// Finding start of data
+	tsat = (double**)malloc(sizeof(double*) * nsat);
+	possat = (double**)malloc(sizeof(double*) * nsat);
+	ndatasat = (int*)malloc(sizeof(int) * nsat);
+
+	// Reading satellite table files
+	ic = 0;
+	for (unsigned char c = 32; c < 255; c++) {
+		filename[strlen(filename) - 5] = c;
+		f = fopen(filename, "r");
+		if (f != 0) {
+			int flag2 = 0;
+			long startpos = 0;
+			char teststring[1000];
+			ndatasat[ic] = 1;
+
+			// Finding start of data
+			while (!feof(f)) {
+				fscanf(f, "%s", teststring);
+				if (!feof(f)) {
+					fseek(f, 1, SEEK_CUR);
+					teststring[5] = 0;
+					if (strcmp(teststring, "$$SOE") == 0) {
+						flag2 = 1;
+						break;
+					}
+				}
+			}
+			// Finding end of data
+			if (flag2) {
+				flag2 = 0;
+				startpos = ftell(f);
 				while (!feof(f)) {
-					fscanf(f, "%s", teststring);
+					fscanf(f, "%[^\n]s", teststring);
 					if (!feof(f)) {
 						fseek(f, 1, SEEK_CUR);
 						teststring[5] = 0;
-						if (strcmp(teststring, "$$SOE") == 0) {
+						if (strcmp(teststring, "$$EOE") == 0) {
 							flag2 = 1;
 							break;
 						}
-					}
-				}
-				// Finding end of data
-				if (flag2) {
-					flag2 = 0;
-					startpos = ftell(f);
-					while (!feof(f)) {
-						fscanf(f, "%[^\n]s", teststring);
-						if (!feof(f)) {
-							fseek(f, 1, SEEK_CUR);
-							teststring[5] = 0;
-							if (strcmp(teststring, "$$EOE") == 0) {
-								flag2 = 1;
-								break;
-							}
-							else {
-								ndatasat[ic]++;
-							}
+						else {
+							ndatasat[ic]++;
 						}
 					}
 				}
+			}
 
-				// Allocating memory according to the length of the table
-				tsat[ic] = (double*)malloc(sizeof(double) * ndatasat[ic]);
-				possat[ic] = (double**)malloc(sizeof(double*) * ndatasat[ic]);
-				for (int j = 0; j < ndatasat[ic]; j++) {
-					possat[ic][j] = (double*)malloc(sizeof(double) * 3);
-				}
-				ndatasat[ic]--;
-
-				// Reading data
-				if (f) {
-					fseek(f, startpos, SEEK_SET);
-					for (int id = 0; id < ndatasat[ic]; id++) {
-
-						if (fscanf(f, "%lf %lf %lf %lf %lf", &(tsat[ic][id]), &RA, &Dec, &dis, &phiprec) == 5) {
-							tsat[ic][id] -= 2450000;
-							RA *= M_PI / 180;
-							Dec *= M_PI / 180;
-							for (int i = 0; i < 3; i++) {
-								possat[ic][id][i] = dis * (cos(RA) * cos(Dec) * Eq2000[i] + sin(RA) * cos(Dec) * Quad2000[i] + sin(Dec) * North2000[i]);
-							}
-						}
-						else {
-							ndatasat[ic] = id;
-							break;
+			// Allocating memory according to the length of the table
+			// Positions are stored contiguously, three coordinates per epoch
+			tsat[ic] = (double*)malloc(sizeof(double) * ndatasat[ic]);
+			possat[ic] = (double*)malloc(sizeof(double) * 3 * ndatasat[ic]);
+			ndatasat[ic]--;
+
+			// Reading data
+			if (f) {
+				fseek(f, startpos, SEEK_SET);
+				for (int id = 0; id < ndatasat[ic]; id++) {
+
+					if (fscanf(f, "%lf %lf %lf %lf %lf", &(tsat[ic][id]), &RA, &Dec, &dis, &phiprec) == 5) {
+						tsat[ic][id] -= 2450000;
+						RA *= M_PI / 180;
+						Dec *= M_PI / 180;
+						for (int i = 0; i < 3; i++) {
+							possat[ic][3 * id + i] = dis * (cos(RA) * cos(Dec) * Eq2000[i] + sin(RA) * cos(Dec) * Quad2000[i] + sin(Dec) * North2000[i]);
 						}
 					}
-					fclose(f);
+					else {
+						ndatasat[ic] = id;
+						break;
+					}
 				}
+				fclose(f);
+			}
+
+			ic++;
+		}
+	}
+}
+
+// Binary satellite tables: 8 characters "VBBSAT1", the number of satellites and a padding int,
+// the number of epochs of each satellite (padded to a multiple of 8 bytes),
+// then for each satellite the epochs (JD-2450000) followed by the positions (three coordinates per epoch).
+// All data are in the machine representation. The file is memory-mapped where possible,
+// so that all processes using the same tables share a single copy.
+
+static const char sattablesheader[8] = { 'V','B','B','S','A','T','1',0 };
+
+// Read-only mapping of a whole file (a plain copy in memory on Windows), 0 if the file cannot be read
+static char *MapFile(char *filename, size_t *size) {
+	FILE *f;
+	char *map;
+
+	f = fopen(filename, "rb");
+	if (f == 0) return 0;
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+#ifdef _WIN32
+	map = (char *)malloc(*size);
+	fseek(f, 0, SEEK_SET);
+	if (map && fread(map, 1, *size, f) != *size) {
+		free(map);
+		map = 0;
+	}
+	fclose(f);
+#else
+	map = (*size > 0) ? (char *)::mmap(0, *size, PROT_READ, MAP_SHARED, fileno(f), 0) : (char *)MAP_FAILED;
+	fclose(f);
+	if (map == (char *)MAP_FAILED) map = 0;
+#endif
+	return map;
+}
+
+static void UnmapFile(char *map, size_t size) {
+#ifdef _WIN32
+	free(map);
+#else
+	munmap(map, size);
+#endif
+}
 
-				ic++;
+bool VBBinaryLensing::LoadSatelliteTables(char *filename) {
+	char *map;
+	size_t size, pos;
+	int nsatv, *nd;
+
+	if ((map = MapFile(filename, &size)) == 0) return false;
+
+	// Checking the consistency of the file
+	nsatv = -1;
+	if (size >= 16 && memcmp(map, sattablesheader, 8) == 0) {
+		nsatv = *((int *)(map + 8));
+		nd = (int *)(map + 16);
+		pos = 16 + (4 * (size_t)nsatv + 7) / 8 * 8;
+		if (nsatv < 0 || pos > size) {
+			nsatv = -1;
+		}
+		else {
+			for (int i = 0; i < nsatv; i++) {
+				if (nd[i] < 0) nsatv = -1;
+				else pos += 4 * sizeof(double) * (size_t)nd[i];
 			}
+			if (pos != size) nsatv = -1;
 		}
 	}
-	else {
-		printf("\nFile not found!\n");
+	if (nsatv < 0) {
+		printf("\nInvalid satellite tables in %s !", filename);
+		UnmapFile(map, size);
+		return false;
+	}
+
+	FreeSatelliteTables();
+	nsat = nsatv;
+	satmap = map;
+	satmapsize = size;
+	tsat = (double**)malloc(sizeof(double*) * nsat);
+	possat = (double**)malloc(sizeof(double*) * nsat);
+	ndatasat = (int*)malloc(sizeof(int) * nsat);
+	pos = 16 + (4 * (size_t)nsat + 7) / 8 * 8;
+	for (int i = 0; i < nsat; i++) {
+		ndatasat[i] = nd[i];
+		tsat[i] = (double *)(map + pos);
+		pos += sizeof(double) * ndatasat[i];
+		possat[i] = (double *)(map + pos);
+		pos += 3 * sizeof(double) * ndatasat[i];
 	}
+	return true;
 }
 
-void VBBinaryLensing::SetObjectCoordinates(char *CoordinateString) {
-	double RA, Dec, hr, mn, sc, deg, pr, ssc;
+void VBBinaryLensing::ConvertSatelliteTables(char *sateltabledir) {
+	FILE *f;
+	char filename[256];
+	int head[2], zero = 0;
+
+	ReadSatelliteTables(sateltabledir);
+	sprintf(filename, "%s%csatellites.bin", sateltabledir, systemslash);
+	if ((f = fopen(filename, "wb")) != 0) {
+		head[0] = nsat;
+		head[1] = 0;
+		fwrite(sattablesheader, sizeof(char), 8, f);
+		fwrite(head, sizeof(int), 2, f);
+		fwrite(ndatasat, sizeof(int), nsat, f);
+		if (nsat % 2) fwrite(&zero, sizeof(int), 1, f);
+		for (int i = 0; i < nsat; i++) {
+			fwrite(tsat[i], sizeof(double), ndatasat[i], f);
+			fwrite(possat[i], sizeof(double), 3 * ndatasat[i], f);
+		}
+		fclose(f);
+	}
+	else {
+		printf("\nCannot write %s !", filename);
+	}
+}
 
-	if (nsat) {
-		for (int i = 0; i<nsat; i++) {
-			for (int j = 0; j<ndatasat[i]; j++) free(possat[i][j]);
+void VBBinaryLensing::FreeSatelliteTables(void) {
+	if (satmap) {
+		UnmapFile(satmap, satmapsize);
+		satmap = 0;
+		satmapsize = 0;
+	}
+	else {
+		for (int i = 0; i < nsat; i++) {
 			free(tsat[i]);
 			free(possat[i]);
 		}
-		free(tsat);
-		free(possat);
-		free(ndatasat);
 	}
+	free(tsat);
+	free(possat);
+	free(ndatasat);
+	tsat = 0;
+	possat = 0;
+	ndatasat = 0;
+	nsat = 0;
+}
+
+void VBBinaryLensing::SetObjectCoordinates(char *CoordinateString) {
+	double RA, Dec, hr, mn, sc, deg, pr, ssc;
+
+	FreeSatelliteTables();
 	sscanf(CoordinateString, "%lf:%lf:%lf %lf:%lf:%lf", &hr, &mn, &sc, &deg, &pr, &ssc);
 	RA = (hr + mn / 60 + sc / 3600) * M_PI / 12,
 	Dec = (fabs(deg) + pr / 60 + ssc / 3600) * M_PI / 180;
@@ -356,17 +1237,17 @@ void VBBinaryLensing::SetObjectCoordinates(char *CoordinateString) {
 
 }
 
+static const double a0 = 1.00000261, adot = 0.00000562; // Ephemeris from JPL website 
+static const double e0 = 0.01671123, edot = -0.00004392;
+static const double inc0 = -0.00001531, incdot = -0.01294668;
+static const double L0 = 100.46457166, Ldot = 35999.37244981;
+static const double om0 = 102.93768193, omdot = 0.32327364;
+static const double deg = M_PI / 180;
+
 void VBBinaryLensing::ComputeParallax(double t, double t0, double *Et) {
-	static double a0 = 1.00000261, adot = 0.00000562; // Ephemeris from JPL website 
-	static double e0 = 0.01671123, edot = -0.00004392;
-	static double inc0 = -0.00001531, incdot = -0.01294668;
-	static double L0 = 100.46457166, Ldot = 35999.37244981;
-	static double om0 = 102.93768193, omdot = 0.32327364;
-	static double deg = M_PI / 180;
-	static double a, e, inc, L, om, M, EE, dE, dM;
-	static double x1, y1, vx, vy, Ear[3], vEar[3];
-	static double Et0[2], vt0[2], r, sp, ty, Spit;
-	int c = 0, ic;
+	double a, e, inc, L, om, M, EE, dE, dM;
+	double x1, y1, vx, vy, Ear[3], vEar[3], Sat[3], *pos;
+	double r, sp, ty;
 
 	if (t0_par_fixed == 0) t0_par = t0;
 	if (t0_par_fixed == -1) {
@@ -436,32 +1317,23 @@ void VBBinaryLensing::ComputeParallax(double t, double t0, double *Et) {
 			}
 		}
 
-		ty = (t - 1545) / 36525.0;
-
-		a = a0 + adot*ty;
-		e = e0 + edot*ty;
-		inc = (inc0 + incdot*ty)*deg;
-		L = (L0 + Ldot*ty)*deg;
-		om = (om0 + omdot*ty)*deg;
-
-		M = L - om;
-		M -= floor((M + M_PI) / (2 * M_PI)) * 2 * M_PI;
-
-		EE = M + e*sin(M);
-		dE = 1;
-		while (dE > 1.e-8) {
-			dM = M - (EE - e*sin(EE));
-			dE = dM / (1 - e*cos(EE));
-			EE += dE;
+		// Precalculated positions are looked for starting from the epoch following the last one used
+		if (nposcache > 0 && satposcache == satellite) {
+			if (iposcache >= nposcache || tposcache[iposcache] != t) iposcache = 0;
 		}
-		x1 = a*(cos(EE) - e);
-		y1 = a*sqrt(1 - e*e)*sin(EE);
-		//	r=a*(1-e*cos(EE));
-
-		Ear[0] = x1*cos(om) - y1*sin(om);
-		Ear[1] = x1*sin(om)*cos(inc) + y1*cos(om)*cos(inc);
-		Ear[2] = x1*sin(om)*sin(inc) + y1*cos(om)*sin(inc);
-		Et[0] = Et[1] = 0;
+		if (nposcache > 0 && satposcache == satellite && tposcache[iposcache] == t) {
+			pos = poscache + 6 * iposcache;
+			for (int i = 0; i < 3; i++) {
+				Ear[i] = pos[i];
+				Sat[i] = pos[i + 3];
+			}
+			iposcache++;
+		}
+		else {
+			ObserverPosition(t, Ear, Sat);
+		}
+
+		Et[0] = Et[1] = 0;
 		for (int i = 0; i < 3; i++) {
 			Et[0] += Ear[i] * rad[i];
 			Et[1] += Ear[i] * tang[i];
@@ -469,38 +1341,101 @@ void VBBinaryLensing::ComputeParallax(double t, double t0, double *Et) {
 		Et[0] += -Et0[0] - vt0[0] * (t - t0_par);
 		Et[1] += -Et0[1] - vt0[1] * (t - t0_par);
 
-		if (satellite > 0 && satellite <= nsat) {
-			if (ndatasat[satellite - 1] > 2) {
-				int left, right;
-				if (t < tsat[satellite - 1][0]) {
-					ic = 0;
+		for (int i = 0; i < 3; i++) {
+			Et[0] += Sat[i] * rad[i];
+			Et[1] += Sat[i] * tang[i];
+		}
+	}
+}
+
+void VBBinaryLensing::PrepareParallax(double *ts, int np) {
+	if (nposcache > 0) {
+		free(tposcache);
+		free(poscache);
+	}
+	tposcache = poscache = 0;
+	nposcache = 0;
+	if (np > 0) {
+		// Without coordinates there is nothing to prepare: the light curves with parallax report it themselves
+		if (t0_par_fixed == -1) return;
+		tposcache = (double *)malloc(sizeof(double) * np);
+		poscache = (double *)malloc(sizeof(double) * 6 * np);
+		memcpy(tposcache, ts, sizeof(double) * np);
+		for (int i = 0; i < np; i++) ObserverPosition(ts[i], poscache + 6 * i, poscache + 6 * i + 3);
+		nposcache = np;
+		iposcache = 0;
+		satposcache = satellite;
+	}
+}
+
+bool VBBinaryLensing::ParallaxPrepared(double *ts, int np) {
+	if (nposcache != np || satposcache != satellite) return false;
+	return memcmp(tposcache, ts, sizeof(double) * np) == 0;
+}
+
+void VBBinaryLensing::ObserverPosition(double t, double *Ear, double *Sat) {
+	double a, e, inc, L, om, M, EE, dE, dM;
+	double x1, y1, ty;
+	int ic;
+
+	// Earth position in the ecliptic reference frame
+	ty = (t - 1545) / 36525.0;
+
+	a = a0 + adot*ty;
+	e = e0 + edot*ty;
+	inc = (inc0 + incdot*ty)*deg;
+	L = (L0 + Ldot*ty)*deg;
+	om = (om0 + omdot*ty)*deg;
+
+	M = L - om;
+	M -= floor((M + M_PI) / (2 * M_PI)) * 2 * M_PI;
+
+	EE = M + e*sin(M);
+	dE = 1;
+	while (dE > 1.e-8) {
+		dM = M - (EE - e*sin(EE));
+		dE = dM / (1 - e*cos(EE));
+		EE += dE;
+	}
+	x1 = a*(cos(EE) - e);
+	y1 = a*sqrt(1 - e*e)*sin(EE);
+	//	r=a*(1-e*cos(EE));
+
+	Ear[0] = x1*cos(om) - y1*sin(om);
+	Ear[1] = x1*sin(om)*cos(inc) + y1*cos(om)*cos(inc);
+	Ear[2] = x1*sin(om)*sin(inc) + y1*cos(om)*sin(inc);
+
+	// Satellite position relative to Earth, if any
+	Sat[0] = Sat[1] = Sat[2] = 0;
+	if (satellite > 0 && satellite <= nsat) {
+		if (ndatasat[satellite - 1] > 2) {
+			int left, right;
+			if (t < tsat[satellite - 1][0]) {
+				ic = 0;
+			}
+			else {
+				if (t > tsat[satellite - 1][ndatasat[satellite - 1] - 1]) {
+					ic = ndatasat[satellite - 1] - 2;
 				}
 				else {
-					if (t > tsat[satellite - 1][ndatasat[satellite - 1] - 1]) {
-						ic = ndatasat[satellite - 1] - 2;
-					}
-					else {
-						left = 0;
-						right = ndatasat[satellite - 1] - 1;
-						while (right - left > 1) {
-							ic = (right + left) / 2;
-							if (tsat[satellite - 1][ic] > t) {
-								right = ic;
-							}
-							else {
-								left = ic;
-							}
+					left = 0;
+					right = ndatasat[satellite - 1] - 1;
+					while (right - left > 1) {
+						ic = (right + left) / 2;
+						if (tsat[satellite - 1][ic] > t) {
+							right = ic;
+						}
+						else {
+							left = ic;
 						}
-						ic = left;
 					}
-				}
-				ty = t - tsat[satellite - 1][ic];
-				for (int i = 0; i < 3; i++) {
-					Spit = possat[satellite - 1][ic][i] * (1 - ty) + possat[satellite - 1][ic + 1][i] * ty;
-					Et[0] += Spit*rad[i];
-					Et[1] += Spit*tang[i];
+					ic = left;
 				}
 			}
+			ty = t - tsat[satellite - 1][ic];
+			for (int i = 0; i < 3; i++) {
+				Sat[i] = possat[satellite - 1][3 * ic + i] * (1 - ty) + possat[satellite - 1][3 * (ic + 1) + i] * ty;
+			}
 		}
 	}
 }
@@ -513,40 +1448,28 @@ void VBBinaryLensing::ComputeParallax(double t, double t0, double *Et) {
 
 
 double VBBinaryLensing::BinaryMag0(double a1, double q1, double y1v, double y2v, _sols **Images) {
-	static complex a, q, m1, m2, y;
-	static double av = -1.0, qv = -1.0;
-	static complex  coefs[24], d1, d2, dy, dJ, dz;
-	static double Mag, Ai;
+	complex a, q, y;
+	complex *coefs = coefs0;
+	double Mag, Ai;
     
-	static _theta *stheta;
-	static _curve *Prov, *Prov2;
-	static _point *scan1, *scan2;
+	_theta *stheta;
+	_curve *Prov, *Prov2;
+	_point *scan1, *scan2;
 
 	Mag = Ai = -1.0;
 	stheta = new _theta(-1.);
-	if ((a1 != av) || (q1 != qv)) {
-		av = a1;
-		qv = q1;
-		if (q1<1) {
-			a = complex(-a1, 0);
-			q = complex(q1, 0);
-		}
-		else {
-			a = complex(a1, 0);
-			q = complex(1 / q1, 0);
-		}
-		m1 = 1.0 / (1.0 + q);
-		m2 = q*m1;
-
-		coefs[20] = a;
-		coefs[21] = m1;
-		coefs[22] = m2;
-		coefs[6] = a*a;
-		coefs[7] = coefs[6] * a;
-		coefs[8] = m2*m2;
-		coefs[9] = coefs[6] * coefs[8];
-		coefs[10] = a*m2;
-		coefs[11] = a*m1;
+	if (q1<1) {
+		a = complex(-a1, 0);
+		q = complex(q1, 0);
+	}
+	else {
+		a = complex(a1, 0);
+		q = complex(1 / q1, 0);
+	}
+	if ((a1 != sv0) || (q1 != qv0)) {
+		sv0 = a1;
+		qv0 = q1;
+		ComputeLensCoefficients(a1, q1, coefs);
 		coefs[23] = 0;
 
 	}
@@ -601,21 +1524,124 @@ double VBBinaryLensing::BinaryMag0(double a1, double q1, double y1v, double y2v,
 }
 
 double VBBinaryLensing::BinaryMag0(double a1, double q1, double y1v, double y2v) {
-	static _sols *images;
-	static double mag;
+	_sols *images;
+	double mag;
 	mag = BinaryMag0(a1, q1, y1v, y2v, &images);
 	delete images;
 	return mag;
 }
 
+void VBBinaryLensing::BinaryMag0(double a1, double q1, double *y1s, double *y2s, double *mags, int np) {
+	// Point-source magnifications for an array of source positions.
+	// The array is split in MB contiguous segments, which are scanned together, one lane per segment.
+	// Each lane starts from the roots found for the previous point of its segment.
+	complex coefs[24], poly[6], y, yc, z, zc, dza, J1;
+	double pre[6 * MB], pim[6 * MB], rre[5 * MB], rim[5 * MB], good[5], Mag;
+	const double dlmin = 1.0e-4;
+	int ord[5], i, j, l, nl, ip, three, seg, nfail;
+	bool warm;
+
+	if (np <= 0) return;
+	ComputeLensCoefficients(a1, q1, coefs);
+	if (gpu && np >= gpuminpoints && (nfail = VBBGPUBinaryMag0(gpu, (double *)coefs, y1s, y2s, mags, np)) >= 0) {
+		// Points whose roots did not converge on the device are calculated here
+		for (ip = 0; nfail > 0 && ip < np; ip++) {
+			if (mags[ip] < 0) {
+				BinaryMag0(a1, q1, y1s + ip, y2s + ip, mags + ip, 1);
+				nfail--;
+			}
+		}
+		NPS = 1;
+		return;
+	}
+	if (nthreads > 1 && np > pointblock) {
+		// Contiguous blocks on each thread, so that the warm starts still come from neighbouring positions
+		ParallelRun((np + pointblock - 1) / pointblock, 1, [&](VBBinaryLensing *VBBL, int ib) {
+			int i0 = ib * pointblock;
+			VBBL->BinaryMag0(a1, q1, y1s + i0, y2s + i0, mags + i0, (np - i0 < pointblock) ? np - i0 : pointblock);
+		});
+		NPS = 1;
+		return;
+	}
+	seg = (np + MB - 1) / MB;
+	// Lanes start from the roots of the last calculation, if any (e.g. all zero on a new instance),
+	// otherwise from a circle around the lenses as in PlotCrit
+	warm = true;
+	for (i = 0; i < 5; i++) {
+		warm = warm && fabs(zr[i].re) + fabs(zr[i].im) < 1.e100; // false for nan
+		for (j = 0; j < i; j++) warm = warm && (zr[i].re != zr[j].re || zr[i].im != zr[j].im);
+	}
+	for (l = 0; l < MB; l++) {
+		for (i = 0; i < 5; i++) {
+			rre[i * MB + l] = (warm) ? zr[i].re : (1 + a1) * cos(i * 2 * M_PI / 5 + 0.4);
+			rim[i * MB + l] = (warm) ? zr[i].im : (1 + a1) * sin(i * 2 * M_PI / 5 + 0.4);
+		}
+	}
+	for (int it = 0; it < seg; it++) {
+		nl = (np - it + seg - 1) / seg; // Number of segments still containing points
+		if (nl > MB) nl = MB;
+		for (l = 0; l < nl; l++) {
+			ip = l * seg + it;
+			y = complex(y1s[ip], y2s[ip]) + coefs[11];
+			yc = conj(y);
+			_LensPolynomial(poly)
+			for (i = 0; i <= 5; i++) {
+				pre[i * MB + l] = poly[i].re;
+				pim[i * MB + l] = poly[i].im;
+			}
+		}
+		cmplx_roots_batch(rre, rim, pre, pim, 5, nl);
+		for (l = 0; l < nl; l++) {
+			ip = l * seg + it;
+			y = complex(y1s[ip], y2s[ip]) + coefs[11];
+			// Same selection of the images as in NewImages
+			for (i = 0; i < 5; i++) {
+				z = complex(rre[i * MB + l], rim[i * MB + l]);
+				zc = conj(z);
+				good[i] = abs(_LL);
+				for (j = i; j > 0 && good[i] > good[ord[j - 1]]; j--) ord[j] = ord[j - 1];
+				ord[j] = i;
+			}
+			three = (good[ord[1]] * dlmin > good[ord[2]] + 1.e-12);
+			Mag = 0;
+			for (j = (three) ? 2 : 0; j < 5; j++) {
+				i = ord[j];
+				z = complex(rre[i * MB + l], rim[i * MB + l]);
+				dza = z - coefs[20];
+				J1 = coefs[21] / (dza * dza) + coefs[22] / (z * z);
+				Mag += fabs(1 / (1 - J1.re * J1.re - J1.im * J1.im));
+			}
+			mags[ip] = Mag;
+		}
+	}
+	for (i = 0; i < 5; i++) zr[i] = complex(rre[i * MB], rim[i * MB]);
+	NPS = 1;
+}
+
+void VBBinaryLensing::BinaryMag0(double a1, double q1, double *y1s, double *y2s, double *mags, double *astrox1s, double *astrox2s, int np) {
+	// Point-source magnifications and centroids for an array of source positions.
+	// The centroids need the images, so each position goes through NewImages, starting from the roots of the previous one.
+	bool astrometryv = astrometry;
+
+	astrometry = true;
+	ParallelRun(np, pointblock, [&](VBBinaryLensing *VBBL, int i) {
+		mags[i] = VBBL->BinaryMag0(a1, q1, y1s[i], y2s[i]);
+		astrox1s[i] = VBBL->astrox1;
+		astrox2s[i] = VBBL->astrox2;
+	});
+	astrometry = astrometryv;
+	NPS = 1;
+}
+
 double VBBinaryLensing::BinaryMagSafe(double s, double q, double y1v, double y2v, double RS, _sols **images) {
-	static double Mag, mag1, mag2, RSi, RSo, delta1,delta2;
-	static int NPSsafe;
+	double Mag, mag1, mag2, RSi, RSo, delta1,delta2;
+	int NPSsafe;
 	Mag = BinaryMag(s, q, y1v, y2v, RS,Tol,images);
 	RSi = RS;
 	RSo = RS;
 	NPSsafe = NPS;
 	if (Mag < 0) {
+		stats.fallbacks++;
 		mag1 = -1;
 		delta1 = 3.33333333e-8;
 		while (mag1 < 0.1 && RSi>=0) {
@@ -645,49 +1671,35 @@ double VBBinaryLensing::BinaryMagSafe(double s, double q, double y1v, double y2v
 }
 
 double VBBinaryLensing::BinaryMag(double a1, double q1, double y1v, double y2v, double RSv, double Tol, _sols **Images) {
-	static complex a, q, m1, m2, y0, y, yc, z, zc;
-	static double av = -1.0, qv = -1.0;
-	static complex coefs[24], d1, d2, dy, dJ, dz;
-	static double thoff = 0.01020304,errbuff;
-	static double Mag, th;
+	complex y0, y;
+	const double thoff = 0.01020304;
+	double errbuff;
+	double Mag = -1, th;
 ////////////////////////////  
-	static double errimage, maxerr, currerr, Magold;
-	static int NPSmax, flag, NPSold,flagbad,flagbadmax=3;
-	static _curve *Prov, *Prov2;
-	static _point *scan1, *scan2;
-	static _thetas *Thetas;
-	static _theta *stheta, *itheta;
-
-#ifdef _PRINT_TIMES
-	static double tim0, tim1;
-#endif
+	double errimage, maxerr, currerr, Magold;
+	int NPSmax, flag, NPSold,flagbad;
+	const int flagbadmax=3;
+	_curve *Prov, *Prov2;
+	_point *scan1, *scan2;
+	_thetas *Thetas;
+	_theta *stheta, *itheta, *ntheta;
+	double tim0 = statsclock();
+	bool budgetown = BudgetOpen(tim0);
+	// Single exit, so that the budget is closed also when the contour fails
+	auto finish = [&](double m) {
+		delete Thetas;
+		budgetNPS += NPS;
+		BudgetClose(budgetown);
+		stats.tcontour += statsclock() - tim0;
+		return m;
+	};
 
 	// Initialization of the equation coefficients
 
-	if ((a1 != av) || (q1 != qv)) {
-		av = a1;
+	if ((a1 != sv) || (q1 != qv)) {
+		sv = a1;
 		qv = q1;
-		if (q1<1) {
-			a = complex(-a1, 0);
-			q = complex(q1, 0);
-		}
-		else {
-			a = complex(a1, 0);
-			q = complex(1 / q1, 0);
-		}
-		m1 = 1.0 / (1.0 + q);
-		m2 = q*m1;
-
-		coefs[20] = a;
-		coefs[21] = m1;
-		coefs[22] = m2;
-		coefs[6] = a*a;
-		coefs[7] = coefs[6] * a;
-		coefs[8] = m2*m2;
-		coefs[9] = coefs[6] * coefs[8];
-		coefs[10] = a*m2;
-		coefs[11] = a*m1;
-		
+		ComputeLensCoefficients(a1, q1, coefs);
 	}
 	coefs[23] = RSv;
 
@@ -709,13 +1721,11 @@ double VBBinaryLensing::BinaryMag(double a1, double q1, double y1v, double y2v,
 	Thetas = new _thetas;
 	th = thoff;
 	stheta = Thetas->insert(th);
+	stats.thetas++;
 	stheta->maxerr = 1.e100;
 	y = y0 + complex(RSv*cos(thoff), RSv*sin(thoff)); 
 
 
-#ifdef _PRINT_TIMES
-	tim0 = Environment::TickCount;
-#endif
 	flag = 0;
 	flagbad = 0;
 	while (flag == 0) {
@@ -726,18 +1736,14 @@ double VBBinaryLensing::BinaryMag(double a1, double q1, double y1v, double y2v,
 		else {
 			delete Prov;
 			stheta->th += 0.01;
-			if (stheta->th > 2.0 * M_PI) {
-				delete Thetas;
-				return -1;
-			}
+			if (stheta->th > 2.0 * M_PI) return finish(-1);
 			y = y0 + complex(RSv*cos(stheta->th), RSv*sin(stheta->th));
 		}
 	}
-#ifdef _PRINT_TIMES
-	tim1 = Environment::TickCount;
-	GM += tim1 - tim0;
-#endif
+	for (int i = 0; i < 5; i++) Thetas->first->zr[i] = zr[i];
 	stheta = Thetas->insert(2.0*M_PI + Thetas->first->th);
+	stats.thetas++;
+	for (int i = 0; i < 5; i++) stheta->zr[i] = zr[i];
 	stheta->maxerr = 0.;
 	stheta->Mag = 0.;
     stheta->astrox1 = 0.;
@@ -757,25 +1763,25 @@ double VBBinaryLensing::BinaryMag(double a1, double q1, double y1v, double y2v,
 	delete Prov;
 
 	th = M_PI + Thetas->first->th;
+	itheta = Thetas->first;
 	flag = 0;
 	Magold = -1.;
 	NPSold = 2;
 	currerr = 1.e100;
 	do {
 		stheta = Thetas->insert(th);
+		stats.thetas++;
 		y = y0 + complex(RSv*cos(th), RSv*sin(th));
-#ifdef _PRINT_TIMES
-		tim0 = Environment::TickCount;
-#endif
 		//if (NPS == 422) {
 		//	NPS = NPS;
 		//}
 
+		// The roots at the closest theta already calculated are the best starting point for the root finder
+		ntheta = (th - stheta->prev->th < stheta->next->th - th) ? stheta->prev : stheta->next;
+		for (int i = 0; i < 5; i++) zr[i] = ntheta->zr[i];
+
 		Prov = NewImages(y, coefs, stheta);
-#ifdef _PRINT_TIMES
-		tim1 = Environment::TickCount;
-		GM += tim1 - tim0;
-#endif
+		for (int i = 0; i < 5; i++) stheta->zr[i] = zr[i];
 		if (Prov->length > 0) {
 			flagbad = 0;
 			OrderImages((*Images), Prov);
@@ -788,10 +1794,7 @@ double VBBinaryLensing::BinaryMag(double a1, double q1, double y1v, double y2v,
 			delete Prov;
 			flagbad++;
 			if (flagbad == flagbadmax) {
-				if (NPS < 16) {
-					delete Thetas;
-					return -1;
-				}
+				if (NPS < 16) return finish(-1);
 				errbuff += stheta->prev->maxerr;
 				stheta->prev->maxerr = 0;
 				NPS--;
@@ -861,7 +1864,7 @@ double VBBinaryLensing::BinaryMag(double a1, double q1, double y1v, double y2v,
 			printf("\nNPS= %d Mag = %lf maxerr= %lg currerr =%lg th = %lf", NPS, Mag / (M_PI * RSv * RSv), maxerr / (M_PI * RSv * RSv), currerr / (M_PI * RSv * RSv), th);
 #endif
 		}
-	} while ((currerr > errimage) && (currerr > RelTol * Mag) && (NPS < NPSmax) && ((flag < NPSold)/* || NPS<8 ||(currerr>10*errimage)*/)/*&&(flagits)*/);
+	} while ((currerr > errimage) && (currerr > RelTol * Mag) && (NPS < NPSmax) && ((flag < NPSold)/* || NPS<8 ||(currerr>10*errimage)*/)/*&&(flagits)*/ && !BudgetExhausted(NPS, 0));
     if(astrometry){
 		astrox1 /= (Mag);
 		astrox2 /= (Mag);
@@ -869,38 +1872,56 @@ double VBBinaryLensing::BinaryMag(double a1, double q1, double y1v, double y2v,
 	Mag /= (M_PI*RSv*RSv);
 	therr = (currerr+errbuff) / (M_PI*RSv*RSv);
  
-	delete Thetas;
 //	if (NPS == NPSmax) return 1.e100*Tol; // Only for testing
-	return Mag;
+	return finish(Mag);
        
 }
 
 double VBBinaryLensing::BinaryMag(double a1, double q1, double y1v, double y2v, double RSv, double Tol) {
-	static _sols *images;
-	static double mag;
+	_sols *images;
+	double mag;
 	mag = BinaryMag(a1, q1, y1v, y2v, RSv, Tol, &images);
 	delete images;
 	return mag;
 }
 
 double VBBinaryLensing::BinaryMag2(double s, double q, double y1v, double y2v, double rho) {
-	static double Mag, rho2, y2a;//, sms , dy1, dy2;
-	static int c;
-	static _sols *Images;
+	double Mag, rho2, y2a;//, sms , dy1, dy2;
+	int c;
+	_sols *Images;
 
 	c = 0;
 
+	if (MagMapServes(s, q, rho)) {
+		Mag = MagMap(y1v, y2v);
+		if (Mag > 0) {
+			NPS = 0;
+			return Mag;
+		}
+	}
+
 	y2a = fabs(y2v);
 
+	if (causticindex && !astrometry) {
+		causticboxes *cb = CausticBoxes(s, q);
+		if (cb && FarFromCaustics(cb, y1v, y2v, CausticSafeDistance(rho))) {
+			stats.shortcuts++;
+			BinaryMag0(s, q, &y1v, &y2v, &Mag, 1);
+			return Mag;
+		}
+	}
+
 	Mag0 = BinaryMag0(s, q, y1v, y2a, &Images);
 	delete Images;
 	rho2 = rho*rho;
 	corrquad *= 6 * (rho2 + 1.e-4*Tol);
 	corrquad2 *= (rho+1.e-3);
 	if (corrquad<Tol && corrquad2<1 && (/*rho2 * s * s<q || */ safedist>4 * rho2)) {
+		stats.shortcuts++;
 		Mag = Mag0;
 	}
 	else {
+		stats.finitesource++;
 		Mag = BinaryMagDark(s, q, y1v, y2a, rho, Tol);
 	}
 	Mag0 = 0;
@@ -912,16 +1933,147 @@ double VBBinaryLensing::BinaryMag2(double s, double q, double y1v, double y2v, d
 	return Mag;
 }
 
+void VBBinaryLensing::BinaryMag2(double s, double q, double *y1s, double *y2s, double rho, double *mags, int np) {
+	// Magnifications for an array of source positions, e.g. a grid or an external trajectory.
+	// Threads take contiguous runs of gridchunk positions, so that each instance keeps the lens coefficients 
+	// and NewImages starts from the roots of the previous position.
+	double tim0 = statsclock();
+
+	if (np > 0 && !(causticindex && BinaryMag2Indexed(s, q, y1s, y2s, rho, mags, np))) {
+		ParallelRun(np, gridchunk, [&](VBBinaryLensing *VBBL, int i) {
+			mags[i] = VBBL->BinaryMag2(s, q, y1s[i], y2s[i], rho);
+		});
+	}
+	stats.tlightcurve += statsclock() - tim0;
+}
+
+void VBBinaryLensing::BinaryMag2(double s, double q, double *y1s, double *y2s, double rho, double *mags, double *astrox1s, double *astrox2s, int np) {
+	// Same with the centroids, which are not available from the caustic index or the maps
+	double tim0 = statsclock();
+	bool astrometryv = astrometry;
+
+	astrometry = true;
+	ParallelRun(np, gridchunk, [&](VBBinaryLensing *VBBL, int i) {
+		mags[i] = VBBL->BinaryMag2(s, q, y1s[i], y2s[i], rho);
+		astrox1s[i] = VBBL->astrox1;
+		astrox2s[i] = VBBL->astrox2;
+	});
+	astrometry = astrometryv;
+	stats.tlightcurve += statsclock() - tim0;
+}
+
+
+static void AnnulusErrors(annulus *scan) {
+	// Errors of the annulus scan->prev just inserted and of scan, including the curvature of the magnification profile
+	double rb;
+
+	if (scan->prev->prev->nim == scan->prev->nim) {
+		scan->prev->err = fabs((scan->prev->Mag - scan->prev->prev->Mag)*(scan->prev->prev->f - scan->prev->f)*(scan->prev->bin*scan->prev->bin - scan->prev->prev->bin*scan->prev->prev->bin) / 4);
+	}
+	else {
+		scan->prev->err = fabs((scan->prev->bin*scan->prev->bin*scan->prev->Mag - scan->prev->prev->bin*scan->prev->prev->bin*scan->prev->prev->Mag)*(scan->prev->prev->f - scan->prev->f) / 4);
+	}
+	if (scan->nim == scan->prev->nim) {
+		scan->err = fabs((scan->Mag - scan->prev->Mag)*(scan->prev->f - scan->f)*(scan->bin*scan->bin - scan->prev->bin*scan->prev->bin) / 4);
+	}
+	else {
+		scan->err = fabs((scan->bin*scan->bin*scan->Mag - scan->prev->bin*scan->prev->bin*scan->prev->Mag)*(scan->prev->f - scan->f) / 4);
+	}
+	rb = (scan->Mag + scan->prev->prev->Mag - 2 * scan->prev->Mag);
+	scan->prev->err += fabs(rb*(scan->prev->prev->f - scan->prev->f)*(scan->prev->bin*scan->prev->bin - scan->prev->prev->bin*scan->prev->prev->bin));
+	scan->err += fabs(rb*(scan->prev->f - scan->f)*(scan->bin*scan->bin - scan->prev->bin*scan->prev->bin));
+}
+
+int VBBinaryLensing::ParallelAnnuli(double a, double q, double RSv, annulus *first, int nsplit, int *totNPS) {
+	// Splits the nsplit annuli with the largest errors and calculates the new ones on nthreads threads.
+	// The splits are independent, since each one only changes the errors of the new annulus and of the one it was taken from.
+	// Returns the number of annuli added.
+	annulus **split, *scan, *scan2;
+	int *nps, n, i, nps0;
+	bool *out;
+	double tc, maxerr;
+
+	split = (annulus **)malloc(sizeof(annulus *) * nsplit);
+	for (n = 0; n < nsplit; n++) {
+		maxerr = 0;
+		scan = 0;
+		for (scan2 = first->next; scan2; scan2 = scan2->next) {
+			if (scan2->err > maxerr) {
+				for (i = 0; i < n && split[i] != scan2; i++);
+				if (i == n) {
+					maxerr = scan2->err;
+					scan = scan2;
+				}
+			}
+		}
+		if (!scan) break;
+		split[n] = scan;
+	}
+	if (n == 0) split[n++] = first->next; // No errors left, but more annuli requested by minannuli
+
+	for (i = 0; i < n; i++) {
+		scan = split[i];
+		tc = (scan->prev->cum + scan->cum)*0.5;
+		scan2 = new annulus;
+		scan2->bin = rCLDprofile(tc, scan->prev, scan);
+		scan2->cum = tc;
+		scan2->f = LDprofile(scan2->bin);
+		scan2->prev = scan->prev;
+		scan2->next = scan;
+		scan->prev->next = scan2;
+		scan->prev = scan2;
+	}
+
+	nps = (int *)malloc(sizeof(int) * n);
+	out = (bool *)malloc(sizeof(bool) * n);
+	nps0 = budgetNPS;
+	ParallelRun(n, 1, [&](VBBinaryLensing *VBBL, int i) {
+		annulus *scan = split[i]->prev;
+		_sols *Images;
+		if (!VBBL->budgetopen) {
+			// Workers continue the budget of this calculation, copies start with no budget open
+			VBBL->budgetopen = true;
+			VBBL->budgetout = false;
+			VBBL->budgetNPS = nps0;
+			VBBL->budgetend = budgetend;
+		}
+		scan->Mag = VBBL->BinaryMagSafe(a, q, VBBL->y_1, VBBL->y_2, RSv*scan->bin, &Images);
+		scan->cerr = VBBL->therr;
+		if (astrometry) {
+			scan->LDastrox1 = VBBL->astrox1*scan->Mag;
+			scan->LDastrox2 = VBBL->astrox2*scan->Mag;
+		}
+		scan->nim = Images->length;
+		delete Images;
+		nps[i] = VBBL->NPS;
+		out[i] = VBBL->budgetout;
+	});
+
+	// The points of the workers are added to the budget here, those of this instance were already added by BinaryMag
+	for (i = 0; i < n; i++) {
+		AnnulusErrors(split[i]);
+		*totNPS += nps[i];
+		budgetNPS += nps[i];
+		if (out[i]) budgetout = true;
+	}
+	free(split);
+	free(nps);
+	free(out);
+	return n;
+}
 
 double VBBinaryLensing::BinaryMagDark(double a, double q, double y1, double y2, double RSv, double Tolnew) {
-	static double Mag, Magold, Tolv;
-    static double LDastrox1,LDastrox2;
-	static double tc, lc, rc, cb,rb;
-	static int c, flag;
-	static double currerr, maxerr;
-	static annulus *first, *scan, *scan2;
-	static int nannold, totNPS;
-	static _sols *Images;
+	double Mag, Magold, Tolv;
+    double LDastrox1,LDastrox2;
+	double tc, lc, rc, cb,rb;
+	int c, flag, nsplit;
+	double currerr, maxerr, conterr, ba, bb;
+	annulus *first, *scan, *scan2;
+	int nannold, totNPS;
+	_sols *Images;
+	unsigned long long key[MCKEY];
+	double tim0 = statsclock();
+	bool budgetown;
 
 	Mag = -1.0;
 	Magold = 0.;
@@ -929,11 +2081,18 @@ double VBBinaryLensing::BinaryMagDark(double a, double q, double y1, double y2,
 	LDastrox1 = LDastrox2 = 0.0;
 	c = 0;
 	totNPS = 1;
+	currerr = conterr = 0;
 
+	if (mcache && !multidark) MagCacheKey(a, q, y1, y2, RSv, Tolnew, key);
 	Tol = Tolnew;
 	y_1 = y1;
 	y_2 = y2;
-	while ((Mag<0.9) && (c<3)) {
+	if (mcache && !multidark && MagCacheGet(key, &Mag)) {
+		stats.tdark += statsclock() - tim0;
+		return Mag;
+	}
+	budgetown = BudgetOpen(tim0);
+	while ((Mag<0.9) && (c<3) && (c == 0 || !budgetout)) {
 
 		first = new annulus;
 		first->bin = 0.;
@@ -954,6 +2113,7 @@ double VBBinaryLensing::BinaryMagDark(double a, double q, double y1, double y2,
 		scr2 = sscr2 = 0;
 		first->f = LDprofile(0);
 		first->err = 0;
+		first->cerr = 0;
 		first->prev = 0;
 
 
@@ -964,6 +2124,7 @@ double VBBinaryLensing::BinaryMagDark(double a, double q, double y1, double y2,
 		scan->bin = 1.;
 		scan->cum = 1.;
 		scan->Mag = BinaryMagSafe(a, q, y_1, y_2, RSv, &Images);
+		scan->cerr = therr;
 		if(astrometry){
 			scan->LDastrox1 = astrox1*scan->Mag;
 			scan->LDastrox2 = astrox2*scan->Mag;
@@ -989,7 +2150,33 @@ double VBBinaryLensing::BinaryMagDark(double a, double q, double y1, double y2,
 		currerr = scan->err;
 		flag = 0;
 		nannuli = nannold = 1;
-		while (((flag<nannold + 5) && (currerr>Tolv) && (currerr>RelTol*Mag)) || (nannuli<minannuli)) {
+		while ((((flag<nannold + 5) && (currerr>Tolv) && (currerr>RelTol*Mag)) || (nannuli<minannuli)) && !BudgetExhausted(0, nannuli)) {
+			if (parallelannuli && nthreads > 1) {
+				// nthreads annuli at a time, then the integrals are summed again over all annuli
+				nsplit = (maxannuli > 0 && nannuli + nthreads > maxannuli) ? maxannuli - nannuli : nthreads;
+				nsplit = ParallelAnnuli(a, q, RSv, first, nsplit, &totNPS);
+				nannuli += nsplit;
+				Magold = Mag;
+				Mag = currerr = 0;
+				if (astrometry) LDastrox1 = LDastrox2 = 0;
+				for (scan = first->next; scan; scan = scan->next) {
+					rb = (scan->cum - scan->prev->cum) / (scan->bin*scan->bin - scan->prev->bin*scan->prev->bin);
+					Mag += (scan->bin*scan->bin*scan->Mag - scan->prev->bin*scan->prev->bin*scan->prev->Mag)*rb;
+					if (astrometry) {
+						LDastrox1 += (scan->bin*scan->bin*scan->LDastrox1 - scan->prev->bin*scan->prev->bin*scan->prev->LDastrox1)*rb;
+						LDastrox2 += (scan->bin*scan->bin*scan->LDastrox2 - scan->prev->bin*scan->prev->bin*scan->prev->LDastrox2)*rb;
+					}
+					currerr += scan->err;
+				}
+				if (fabs(Magold - Mag) * 2 < Tolv) {
+					flag += nsplit;
+				}
+				else {
+					flag = 0;
+					nannold = nannuli;
+				}
+				continue;
+			}
 			maxerr = 0;
 			for (scan2 = first->next; scan2; scan2 = scan2->next) {
 #ifdef _PRINT_ERRORS_DARK
@@ -1021,27 +2208,14 @@ double VBBinaryLensing::BinaryMagDark(double a, double q, double y1, double y2,
 			scan->prev->cum = tc;
 			scan->prev->f = LDprofile(cb);
 			scan->prev->Mag = BinaryMagSafe(a, q, y_1, y_2, RSv*cb, &Images);
+			scan->prev->cerr = therr;
 			if(astrometry){
 				scan->prev->LDastrox1=astrox1*scan->prev->Mag;
 				scan->prev->LDastrox2=astrox2*scan->prev->Mag;
 			}
 			totNPS += NPS;
 			scan->prev->nim = Images->length;
-			if (scan->prev->prev->nim == scan->prev->nim) {
-				scan->prev->err = fabs((scan->prev->Mag - scan->prev->prev->Mag)*(scan->prev->prev->f - scan->prev->f)*(scan->prev->bin*scan->prev->bin - scan->prev->prev->bin*scan->prev->prev->bin) / 4);
-			}
-			else {
-				scan->prev->err = fabs((scan->prev->bin*scan->prev->bin*scan->prev->Mag - scan->prev->prev->bin*scan->prev->prev->bin*scan->prev->prev->Mag)*(scan->prev->prev->f - scan->prev->f) / 4);
-			}
-			if (scan->nim == scan->prev->nim) {
-				scan->err = fabs((scan->Mag - scan->prev->Mag)*(scan->prev->f - scan->f)*(scan->bin*scan->bin - scan->prev->bin*scan->prev->bin) / 4);
-			}
-			else {
-				scan->err = fabs((scan->bin*scan->bin*scan->Mag - scan->prev->bin*scan->prev->bin*scan->prev->Mag)*(scan->prev->f - scan->f) / 4);
-			}
-			rb = (scan->Mag + scan->prev->prev->Mag - 2 * scan->prev->Mag);
-			scan->prev->err += fabs(rb*(scan->prev->prev->f - scan->prev->f)*(scan->prev->bin*scan->prev->bin - scan->prev->prev->bin*scan->prev->prev->bin));
-			scan->err += fabs(rb*(scan->prev->f - scan->f)*(scan->bin*scan->bin - scan->prev->bin*scan->prev->bin));
+			AnnulusErrors(scan);
 #ifdef _PRINT_ERRORS_DARK
 			printf("\n%d", Images->length);
 #endif
@@ -1067,8 +2241,24 @@ double VBBinaryLensing::BinaryMagDark(double a, double q, double y1, double y2,
 			}
 
 		}
+		stats.annuli += nannuli;
+		if (budgetout) {
+			// Contours cut by the budget may be far from the accuracy goal: their errors are propagated to Mag,
+			// which depends on the magnification of each annulus through the brightness of the two rings around it
+			conterr = 0;
+			for (scan = first->next; scan; scan = scan->next) {
+				bb = (scan->cum - scan->prev->cum) / (scan->bin*scan->bin - scan->prev->bin*scan->prev->bin);
+				ba = (scan->next) ? (scan->next->cum - scan->cum) / (scan->next->bin*scan->next->bin - scan->bin*scan->bin) : 0;
+				conterr += scan->cerr*scan->bin*scan->bin*fabs(bb - ba);
+			}
+		}
 
 		if (multidark) {
+			while (annlist) {
+				scan = annlist->next;
+				delete annlist;
+				annlist = scan;
+			}
 			annlist = first;
 		}else{
 			while (first) {
@@ -1083,12 +2273,17 @@ double VBBinaryLensing::BinaryMagDark(double a, double q, double y1, double y2,
 	}
 	NPS = totNPS;
 	therr = currerr;
+	if (budgetout) therr += conterr;
     if(astrometry){
 		LDastrox1/=Mag;
 		LDastrox2/=Mag;
 		astrox1=LDastrox1;
 		astrox2=LDastrox2;
     }
+	// Failed results and results cut by the budget are not stored
+	if (mcache && !multidark && !budgetout && Mag >= 0.9) MagCachePut(key, Mag);
+	BudgetClose(budgetown);
+	stats.tdark += statsclock() - tim0;
 	return Mag;
 }
 
@@ -1129,9 +2324,109 @@ void VBBinaryLensing::BinaryMagMultiDark(double a, double q, double y1, double y
 	multidark = false;
 }
 
+void VBBinaryLensing::BinaryMag2MultiBand(double s, double q, double y1v, double y2v, double rho, double *mags, int stride) {
+	// Same as BinaryMag2 for the nbands limb darkening profiles in bandLD, banda1, banda2.
+	// The annuli are computed once for the band with the strongest limb darkening and re-weighted for the others.
+	LDprofiles LDv = curLDprofile;
+	double a1v = a1, a2v = a2;
+	double Mag, rho2, y2a, f0, f1, maxdark;
+	int idrv, nmap;
+	annulus *scan;
+	_sols *Images;
+
+	// The magnification map is used only if it serves all bands
+	nmap = 0;
+	for (int ib = 0; curmap && ib < nbands && nmap == ib; ib++) {
+		curLDprofile = bandLD[ib];
+		a1 = banda1[ib];
+		a2 = banda2[ib];
+		if (MagMapServes(s, q, rho) && (mags[ib * stride] = MagMap(y1v, y2v)) > 0) nmap++;
+	}
+	curLDprofile = LDv;
+	a1 = a1v;
+	a2 = a2v;
+	if (nmap > 0 && nmap == nbands) {
+		NPS = 0;
+		return;
+	}
+
+	y2a = fabs(y2v);
+
+	// Far from the caustics the magnification does not depend on the limb darkening
+	if (causticindex && !astrometry) {
+		causticboxes *cb = CausticBoxes(s, q);
+		if (cb && FarFromCaustics(cb, y1v, y2v, CausticSafeDistance(rho))) {
+			stats.shortcuts++;
+			BinaryMag0(s, q, &y1v, &y2v, &Mag, 1);
+			for (int ib = 0; ib < nbands; ib++) mags[ib * stride] = Mag;
+			return;
+		}
+	}
+
+	Mag0 = BinaryMag0(s, q, y1v, y2a, &Images);
+	delete Images;
+	rho2 = rho*rho;
+	corrquad *= 6 * (rho2 + 1.e-4*Tol);
+	corrquad2 *= (rho + 1.e-3);
+	if (corrquad<Tol && corrquad2<1 && safedist>4 * rho2) {
+		stats.shortcuts++;
+		for (int ib = 0; ib < nbands; ib++) mags[ib * stride] = Mag0;
+		Mag0 = 0;
+		return;
+	}
+
+	stats.finitesource++;
+	// The contrast between center and limb drives the sampling of the annuli in BinaryMagDark
+	idrv = 0;
+	maxdark = -1.e100;
+	for (int ib = 0; ib < nbands; ib++) {
+		curLDprofile = bandLD[ib];
+		a1 = banda1[ib];
+		a2 = banda2[ib];
+		scr2 = sscr2 = 0;
+		f0 = LDprofile(0);
+		scr2 = sscr2 = 1;
+		f1 = LDprofile(0.9999999);
+		if (f0 - f1 > maxdark) {
+			maxdark = f0 - f1;
+			idrv = ib;
+		}
+	}
+	curLDprofile = bandLD[idrv];
+	a1 = banda1[idrv];
+	a2 = banda2[idrv];
+	multidark = true;
+	mags[idrv * stride] = BinaryMagDark(s, q, y1v, y2a, rho, Tol);
+	multidark = false;
+	Mag0 = 0;
+
+	for (int ib = 0; ib < nbands; ib++) {
+		if (ib != idrv) {
+			curLDprofile = bandLD[ib];
+			a1 = banda1[ib];
+			a2 = banda2[ib];
+			Mag = 0;
+			for (scan = annlist->next; scan; scan = scan->next) {
+				scan->cum = CLDprofile(scan->bin);
+				Mag += (scan->bin*scan->bin*scan->Mag - scan->prev->bin*scan->prev->bin*scan->prev->Mag)*(scan->cum - scan->prev->cum) / (scan->bin*scan->bin - scan->prev->bin*scan->prev->bin);
+			}
+			mags[ib * stride] = Mag;
+		}
+	}
+
+	while (annlist) {
+		scan = annlist->next;
+		delete annlist;
+		annlist = scan;
+	}
+	curLDprofile = LDv;
+	a1 = a1v;
+	a2 = a2v;
+}
+
 double VBBinaryLensing::LDprofile(double r) {
-	static int ir;
-	static double rr,ret;
+	int ir;
+	double rr, ret = 1;
 	switch(curLDprofile){
 	case LDuser:
 		rr = r * npLD;
@@ -1154,96 +2449,75 @@ double VBBinaryLensing::LDprofile(double r) {
 	return ret;
 }
 
-double VBBinaryLensing::rCLDprofile(double tc,annulus *left,annulus *right) {
-	static int ic;
-	static double rc,cb,lc,r2,cr2,cc,lb,rb;
+double VBBinaryLensing::CLDprofile(double r) {
+	// Fraction of the flux within radius r (in units of the source radius).
+	// scr2 and sscr2 are left as needed by LDprofile(r).
+	int ir;
+	double rr,r2,cr2,cc;
 
+	if (r >= 1) return 1;
 	switch (curLDprofile) {
+	default: // Uniform source
+		cc = r * r;
+		break;
 	case LDuser:
-		rc = tc * npLD;
-		ic = (int)rc;
-		rc -= ic;
-		cb = rCLDtab[ic] * (1 - rc) + rCLDtab[ic + 1] * rc;
+		rr = r * npLD;
+		ir = (int)rr;
+		rr -= ir;
+		cc = CLDtab[ir] * (1 - rr) + CLDtab[ir + 1] * rr;
 		break;
 	case LDlinear:
-		lb = left->bin;
-		rb = right->bin;
-		lc = left->cum;
-		rc = right->cum;
-		do {
-			cb = rb + (tc - rc)*(rb - lb) / (rc - lc);
-			r2 = cb * cb; 
-			cr2 = 1 - r2;
-			scr2 = 1-sqrt(cr2);
-			cc = (3 * r2 - a1 * (r2 - 2 * scr2*cr2)) / (3 - a1);
-			if (cc > tc) {
-				rb = cb;
-				rc = cc;
-			}
-			else {
-				lb = cb;
-				lc = cc;
-			}
-		} while (fabs(cc - tc) > 1.e-5);
+		r2 = r * r; 
+		cr2 = 1 - r2;
+		scr2 = 1-sqrt(cr2);
+		cc = (3 * r2 - a1 * (r2 - 2 * scr2*cr2)) / (3 - a1);
 		break;
 	case LDsquareroot:
-		lb = left->bin;
-		rb = right->bin;
-		lc = left->cum;
-		rc = right->cum;
-		do {
-			cb = rb + (tc - rc)*(rb - lb) / (rc - lc);
-			r2 = cb * cb;
-			cr2 = 1 - r2;
-			scr2 = sqrt(cr2);
-			sscr2 = 1 - sqrt(scr2);
-			scr2 = 1 - scr2;
-			cc = (3 * r2 - a1 * (r2 - 2 * scr2*cr2) - 0.6*a2*(r2 - 4 * sscr2*cr2)) / (3 - a1 - 0.6*a2);
-			if (cc > tc) {
-				rb = cb;
-				rc = cc;
-			}
-			else {
-				lb = cb;
-				lc = cc;
-			}
-		} while (fabs(cc - tc) > 1.e-5);
+		r2 = r * r;
+		cr2 = 1 - r2;
+		scr2 = sqrt(cr2);
+		sscr2 = 1 - sqrt(scr2);
+		scr2 = 1 - scr2;
+		cc = (3 * r2 - a1 * (r2 - 2 * scr2*cr2) - 0.6*a2*(r2 - 4 * sscr2*cr2)) / (3 - a1 - 0.6*a2);
 		break;
 	case LDquadratic:
-		lb = left->bin;
-		rb = right->bin;
-		lc = left->cum;
-		rc = right->cum;
-		do {
-			cb = rb + (tc - rc)*(rb - lb) / (rc - lc);
-			r2 = cb * cb;
-			cr2 = 1 - r2;
-			scr2 = 1- sqrt(cr2);
-			sscr2 = scr2*scr2;
-			cc = (3 * r2 - a1 * (r2 - 2 * scr2*cr2) + a2*(4*scr2-(2+4*scr2)*r2+1.5*r2*r2)) / (3 - a1 - 0.5*a2);
-			if (cc > tc) {
-				rb = cb;
-				rc = cc;
-			}
-			else {
-				lb = cb;
-				lc = cc;
-			}
-		} while (fabs(cc - tc) > 1.e-5);
+		r2 = r * r;
+		cr2 = 1 - r2;
+		scr2 = 1- sqrt(cr2);
+		sscr2 = scr2*scr2;
+		cc = (3 * r2 - a1 * (r2 - 2 * scr2*cr2) + a2*(4*scr2-(2+4*scr2)*r2+1.5*r2*r2)) / (3 - a1 - 0.5*a2);
 		break;
 	case LDlog:
+		r2 = r * r;
+		cr2 = 1 - r2;
+		scr2 = sqrt(cr2);
+		sscr2 = scr2*log(scr2);
+		scr2 = 1 - scr2;
+		cc = (3 * r2 - a1 * (r2 - 2 * scr2*cr2) + 2*a2*(scr2*(1+scr2*(scr2/3-1)) + sscr2*cr2)) / (3 - a1 + 0.6666666666666666*a2);
+		break;
+	}
+
+	return cc;
+}
+
+double VBBinaryLensing::rCLDprofile(double tc,annulus *left,annulus *right) {
+	int ic;
+	double rc,cb,lc,cc,lb,rb;
+
+	if (curLDprofile == LDuser) {
+		rc = tc * npLD;
+		ic = (int)rc;
+		rc -= ic;
+		cb = rCLDtab[ic] * (1 - rc) + rCLDtab[ic + 1] * rc;
+	}
+	else {
 		lb = left->bin;
 		rb = right->bin;
 		lc = left->cum;
 		rc = right->cum;
 		do {
 			cb = rb + (tc - rc)*(rb - lb) / (rc - lc);
-			r2 = cb * cb;
-			cr2 = 1 - r2;
-			scr2 = sqrt(cr2);
-			sscr2 = scr2*log(scr2);
-			scr2 = 1 - scr2;
-			cc = (3 * r2 - a1 * (r2 - 2 * scr2*cr2) + 2*a2*(scr2*(1+scr2*(scr2/3-1)) + sscr2*cr2)) / (3 - a1 + 0.6666666666666666*a2);
+			cc = CLDprofile(cb);
 			if (cc > tc) {
 				rb = cb;
 				rc = cc;
@@ -1253,7 +2527,6 @@ double VBBinaryLensing::rCLDprofile(double tc,annulus *left,annulus *right) {
 				lc = cc;
 			}
 		} while (fabs(cc - tc) > 1.e-5);
-		break;
 	}
 
 	return cb;
@@ -1264,6 +2537,7 @@ void VBBinaryLensing::SetLDprofile(double (*UserLDprofile)(double),int newnpLD)
 	if (npLD > 0) {
 		free(LDtab);
 		free(rCLDtab);
+		free(CLDtab);
 	}
 	if (newnpLD > 0) {
 		npLD = newnpLD;
@@ -1307,7 +2581,6 @@ void VBBinaryLensing::SetLDprofile(double (*UserLDprofile)(double),int newnpLD)
 		//}
 		//printf("\n--------------------\n\n");
 
-		free(CLDtab);
 		curLDprofile = LDuser;
 	}
 	else {
@@ -1321,28 +2594,160 @@ void VBBinaryLensing::SetLDprofile(LDprofiles LDval) {
 		npLD = 0;
 		free(LDtab);
 		free(rCLDtab);
+		free(CLDtab);
 	}
 	curLDprofile = LDval;
 }
 
+// ESPL tables: 8 characters "VBBESP1", the numbers of rows and columns (two ints), rhomin and rhomax,
+// then the tables ESPLin, ESPLout, ESPLinastro, ESPLoutastro, each with nr rows of nz values.
+// Row ir is for rho=rhomax*(rhomin/rhomax)^(ir/(nr-1)), column iz for z=iz/(nz-1),
+// with z=u/rho in ESPLin and ESPLinastro and z=rho/u in ESPLout and ESPLoutastro.
+// Files without header are the original tables with 151 rows and 101 columns for 1.e-4<rho<100.
+// The file is memory-mapped where possible, so that all instances and processes share a single copy.
+
+static const char espltableheader[8] = { 'V','B','B','E','S','P','1',0 };
+
 void VBBinaryLensing::LoadESPLTable(char *filename){
-	FILE *f;
+	espltable *et;
+	char *map;
+	size_t size, pos = 0;
+	int dims[2] = { __rsize, __zsize };
+	double range[2] = { 1.e-4, 1.e2 };
 
-	if((f = fopen(filename, "rb"))!=0){
-		fread(ESPLin, sizeof(double), __rsize * __zsize, f);
-		fread(ESPLout, sizeof(double), __rsize * __zsize, f);
-        fread(ESPLinastro, sizeof(double), __rsize * __zsize, f);
-		fread(ESPLoutastro, sizeof(double), __rsize * __zsize, f);
-		fclose(f);
-		ESPLoff=false;
-	}else{
+	if ((map = MapFile(filename, &size)) == 0) {
 		printf("\nESPL table not found !");
+		return;
+	}
+	if (size >= 32 && memcmp(map, espltableheader, 8) == 0) {
+		memcpy(dims, map + 8, sizeof(dims));
+		memcpy(range, map + 16, sizeof(range));
+		pos = 32;
+	}
+	if (dims[0] < 2 || dims[1] < 2 || !(range[0] > 0 && range[1] > range[0]) || size != pos + 4 * sizeof(double) * dims[0] * dims[1]) {
+		printf("\nInvalid ESPL table in %s !", filename);
+		UnmapFile(map, size);
+		return;
+	}
+
+	FreeESPLTable();
+	et = new espltable;
+	et->nr = dims[0];
+	et->nz = dims[1];
+	et->rhomin = range[0];
+	et->rhomax = range[1];
+	et->lrfac = (et->nr - 1) / log(et->rhomax / et->rhomin);
+	et->in = (double *)(map + pos);
+	et->out = et->in + et->nr * et->nz;
+	et->inastro = et->out + et->nr * et->nz;
+	et->outastro = et->inastro + et->nr * et->nz;
+	et->map = map;
+	et->mapsize = size;
+	et->refs = 1;
+	espl = et;
+}
+
+void VBBinaryLensing::FreeESPLTable(void) {
+	if (espl && --espl->refs == 0) {
+		UnmapFile(espl->map, espl->mapsize);
+		delete espl;
+	}
+	espl = 0;
+}
+
+// Magnification and centroid of a uniform source of radius rho at distance u from a point lens.
+// The source is sliced in arcs of radius r around the lens; each integral over r is split at |u-rho|
+// and the substitution r=r1+(r2-r1)(1-cos t)/2 removes the square root singularities at the ends of the intervals.
+
+static void ESPLUniform(double u, double rho, double *mag, double *astro) {
+	const int nq = 500;
+	double r1[2], r2[2], full[2], r, dr, c, phi0, A, M = 0, X = 0;
+	int ns;
+
+	if (u < rho) {
+		// Circles with r<rho-u are entirely within the source
+		r1[0] = 0;
+		r2[0] = rho - u;
+		full[0] = 1;
+		r1[1] = rho - u;
+		ns = 2;
+	}
+	else {
+		r1[1] = u - rho;
+		ns = 1;
+	}
+	r2[1] = u + rho;
+	full[1] = 0;
+	for (int is = 2 - ns; is < 2; is++) {
+		for (int k = 0; k < nq; k++) {
+			c = M_PI * (k + 0.5) / nq;
+			r = r1[is] + (r2[is] - r1[is]) * (1 - cos(c)) * 0.5;
+			dr = (r2[is] - r1[is]) * sin(c) * 0.5 * M_PI / nq;
+			if (full[is]) {
+				phi0 = M_PI;
+			}
+			else {
+				c = (r * r + u * u - rho * rho) / (2 * r * u);
+				phi0 = (c >= 1) ? 0 : (c <= -1) ? M_PI : acos(c);
+			}
+			A = (r * r + 2) / sqrt(r * r + 4) * dr; // Point-source magnification times r dr
+			M += A * phi0;
+			X += A * (r * r + 3) / (r * r + 2) * r * sin(phi0);
+		}
+	}
+	*mag = 2 * M / (M_PI * rho * rho);
+	*astro = X / M;
+}
+
+void VBBinaryLensing::BuildESPLTable(char *filename, int nr, int nz, double rhomin, double rhomax) {
+	FILE *f;
+	double *tab, lrfac;
+	int dims[2] = { nr, nz };
+	double range[2] = { rhomin, rhomax };
+
+	if (nr < 2 || nz < 2 || !(rhomin > 0 && rhomax > rhomin)) {
+		printf("\nInvalid ESPL table parameters !");
+		return;
+	}
+	tab = (double *)malloc(sizeof(double) * 4 * nr * nz);
+	lrfac = log(rhomax / rhomin) / (nr - 1);
+	// Rows are independent and are distributed among nthreads threads
+	ParallelRun(nr, 1, [&](VBBinaryLensing *, int ir) {
+		double rho = rhomax * exp(-ir * lrfac), u, u2, z, mag, astro;
+		double *in = tab + ir * nz, *out = in + nr * nz, *inastro = out + nr * nz, *outastro = inastro + nr * nz;
+		// The first columns are the limits for a source centered on the lens and for a far source
+		in[0] = out[0] = inastro[0] = outastro[0] = 1;
+		for (int iz = 1; iz < nz; iz++) {
+			z = iz / (nz - 1.);
+			u = z * rho;
+			ESPLUniform(u, rho, &mag, &astro);
+			in[iz] = mag / sqrt(1 + 4. / (rho * rho));
+			inastro[iz] = astro / ((1 - 1. / (4 + rho * rho)) * u);
+			// Same shift as in ESPLMag, so that z=1 falls within the source
+			u = 0.99999999999999 * rho / z;
+			u2 = u * u;
+			ESPLUniform(u, rho, &mag, &astro);
+			out[iz] = mag * sqrt(u2 * (u2 + 4)) / (u2 + 2);
+			outastro[iz] = astro * (u2 + 2) / (u * (u2 + 3));
+		}
+	});
+
+	if ((f = fopen(filename, "wb")) != 0) {
+		fwrite(espltableheader, sizeof(char), 8, f);
+		fwrite(dims, sizeof(int), 2, f);
+		fwrite(range, sizeof(double), 2, f);
+		fwrite(tab, sizeof(double), 4 * nr * nz, f);
+		fclose(f);
 	}
+	else {
+		printf("\nCannot write %s !", filename);
+	}
+	free(tab);
 }
 
 
 double VBBinaryLensing::PSPLMag(double u) {
-	static double u2,u22;
+	double u2,u22;
 	u2 = u * u;
 	u22 = u2 + 2;
 	if (astrometry) {
@@ -1353,17 +2758,22 @@ double VBBinaryLensing::PSPLMag(double u) {
 
 
 double VBBinaryLensing::ESPLMag(double u, double RSv) {
-	double mag,z,fr,cz,cr,u2;
-	int iz, ir;
+	double mag,z,fr,cz,cr,u2,*tab,*tab1;
+	int iz, ir, nz;
        
-	if (ESPLoff) {
+	if (!espl) {
 		printf("\nLoad ESPL table first!");
 		return 0;
 	}
          
-	fr = -10.857362047581296* log(0.01* RSv);
-	if (fr > __rsize - 1) fr = __rsize -1.000001;
-	if (fr < 0) printf("Source too large!");
+	nz = espl->nz;
+	fr = espl->lrfac * log(espl->rhomax / RSv);
+	if (fr > espl->nr - 1) fr = espl->nr -1.000001;
+	if (fr < 0) {
+		// The table is mapped read-only: the first row is used rather than reading outside
+		printf("Source too large!");
+		fr = 0;
+	}
 	ir = (int) floor(fr);
 	fr -= ir;
 	cr = 1 - fr;
@@ -1371,30 +2781,38 @@ double VBBinaryLensing::ESPLMag(double u, double RSv) {
 	z = u / RSv;
 
 	if (z < 1) {
-		z *= __zsize -1;
+		z *= nz -1;
 		iz = (int) floor(z);
 		z -= iz;
 		cz = 1 - z;
+		tab = espl->in + ir * nz + iz;
+		tab1 = tab + nz;
 		mag = sqrt(1 + 4. / (RSv*RSv));
-		mag *= ESPLin[ir][iz] * cr*cz + ESPLin[ir + 1][iz] * fr*cz + ESPLin[ir][iz + 1] * cr*z + ESPLin[ir + 1][iz + 1] * fr*z;
+		mag *= tab[0] * cr*cz + tab1[0] * fr*cz + tab[1] * cr*z + tab1[1] * fr*z;
                 if (astrometry) {
+                	tab = espl->inastro + ir * nz + iz;
+                	tab1 = tab + nz;
                 	astrox1=(1-1./(4+RSv*RSv))*u;
-                	astrox1 *= ESPLinastro[ir][iz] * cr*cz + ESPLinastro[ir + 1][iz] * fr*cz + ESPLinastro[ir][iz + 1] * cr*z + ESPLinastro[ir + 1][iz + 1] * fr*z;
+                	astrox1 *= tab[0] * cr*cz + tab1[0] * fr*cz + tab[1] * cr*z + tab1[1] * fr*z;
                 }
 	}
 	else {
 		z = 0.99999999999999 / z;
-		z *= __zsize - 1;
+		z *= nz - 1;
 		iz = (int)floor(z);
 		z -= iz;
 		cz = 1 - z;
+		tab = espl->out + ir * nz + iz;
+		tab1 = tab + nz;
 
 		u2 = u*u;
 		mag = (u2 + 2) / sqrt(u2*(u2 + 4));
-		mag *= ESPLout[ir][iz] * cr*cz + ESPLout[ir + 1][iz] * fr*cz + ESPLout[ir][iz + 1] * cr*z + ESPLout[ir + 1][iz + 1] * fr*z;
+		mag *= tab[0] * cr*cz + tab1[0] * fr*cz + tab[1] * cr*z + tab1[1] * fr*z;
 		if (astrometry) {
+			tab = espl->outastro + ir * nz + iz;
+			tab1 = tab + nz;
 			astrox1 = u * (u2 + 3) / (u2 + 2);
-			astrox1 *= ESPLoutastro[ir][iz] * cr*cz + ESPLoutastro[ir + 1][iz] * fr*cz + ESPLoutastro[ir][iz + 1] * cr*z + ESPLoutastro[ir + 1][iz + 1] * fr*z;
+			astrox1 *= tab[0] * cr*cz + tab1[0] * fr*cz + tab[1] * cr*z + tab1[1] * fr*z;
 		}
 	} 
 
@@ -1520,51 +2938,1582 @@ double VBBinaryLensing::ESPLMagDark(double u, double RSv) {
 				scan->prev->LDastrox1=astrox1*scan->prev->Mag;
 				 
 			}
-			scan->prev->nim = 2;
-			scan->prev->err = fabs((scan->prev->Mag - scan->prev->prev->Mag)*(scan->prev->prev->f - scan->prev->f)*(scan->prev->bin*scan->prev->bin - scan->prev->prev->bin*scan->prev->prev->bin) / 4);
-			scan->err = fabs((scan->Mag - scan->prev->Mag)*(scan->prev->f - scan->f)*(scan->bin*scan->bin - scan->prev->bin*scan->prev->bin) / 4);
-			rb = (scan->Mag + scan->prev->prev->Mag - 2 * scan->prev->Mag);
-			scan->prev->err += fabs(rb*(scan->prev->prev->f - scan->prev->f)*(scan->prev->bin*scan->prev->bin - scan->prev->prev->bin*scan->prev->prev->bin));
-			scan->err += fabs(rb*(scan->prev->f - scan->f)*(scan->bin*scan->bin - scan->prev->bin*scan->prev->bin));
-#ifdef _PRINT_ERRORS_DARK
-			printf("\n%d", Images->length);
+			scan->prev->nim = 2;
+			scan->prev->err = fabs((scan->prev->Mag - scan->prev->prev->Mag)*(scan->prev->prev->f - scan->prev->f)*(scan->prev->bin*scan->prev->bin - scan->prev->prev->bin*scan->prev->prev->bin) / 4);
+			scan->err = fabs((scan->Mag - scan->prev->Mag)*(scan->prev->f - scan->f)*(scan->bin*scan->bin - scan->prev->bin*scan->prev->bin) / 4);
+			rb = (scan->Mag + scan->prev->prev->Mag - 2 * scan->prev->Mag);
+			scan->prev->err += fabs(rb*(scan->prev->prev->f - scan->prev->f)*(scan->prev->bin*scan->prev->bin - scan->prev->prev->bin*scan->prev->prev->bin));
+			scan->err += fabs(rb*(scan->prev->f - scan->f)*(scan->bin*scan->bin - scan->prev->bin*scan->prev->bin));
+#ifdef _PRINT_ERRORS_DARK
+			printf("\n%d", Images->length);
+#endif
+
+			Mag += (scan->bin*scan->bin*scan->Mag - cb*cb*scan->prev->Mag)*(scan->cum - scan->prev->cum) / (scan->bin*scan->bin - scan->prev->bin*scan->prev->bin);
+			Mag += (cb*cb*scan->prev->Mag - scan->prev->prev->bin*scan->prev->prev->bin*scan->prev->prev->Mag)*(scan->prev->cum - scan->prev->prev->cum) / (scan->prev->bin*scan->prev->bin - scan->prev->prev->bin*scan->prev->prev->bin);
+                        if(astrometry){
+				LDastrox1 += ( scan->bin*scan->bin*scan->LDastrox1 - cb*cb*scan->prev->LDastrox1)*(scan->cum - scan->prev->cum) / (scan->bin*scan->bin - scan->prev->bin*scan->prev->bin);
+				LDastrox1 += ( cb*cb*scan->prev->LDastrox1 - scan->prev->prev->bin*scan->prev->prev->bin*scan->prev->prev->LDastrox1)*(scan->prev->cum - scan->prev->prev->cum) / (scan->prev->bin*scan->prev->bin - scan->prev->prev->bin*scan->prev->prev->bin);
+				 
+			}
+			currerr += scan->err + scan->prev->err;
+
+			if (fabs(Magold - Mag) * 2<Tolv) {
+				flag++;
+			}
+			else {
+				flag = 0;
+				nannold = nannuli;
+			}
+
+		}
+		stats.annuli += nannuli;
+
+		while (first) {
+			scan = first->next;
+			delete first;
+			first = scan;
+		}
+
+		Tolv /= 10;
+		c++;
+	}
+	therr = currerr;
+        if(astrometry){
+		LDastrox1/=Mag;
+		astrox1=LDastrox1;
+		 
+    }
+	return Mag;
+}
+
+//////////////////////////////
+//////////////////////////////
+////////Array kernels for single lenses
+//////////////////////////////
+//////////////////////////////
+
+// Plain loops are written without branches; the AVX2 versions are chosen at run time
+// on processors supporting them and perform exactly the same operations.
+
+static void PSPLMagU2(double *u2, double *mags, int i0, int np) {
+	for (int i = i0; i < np; i++) {
+		mags[i] = (u2[i] + 2) / sqrt(u2[i] * (u2[i] + 4));
+	}
+}
+
+static void ESPLMagRow(double *u, double RSv, double *row, int nz, double magin, double *mags, int i0, int np) {
+	double z, u2, mag;
+	int iz, out;
+	for (int i = i0; i < np; i++) {
+		z = u[i] / RSv;
+		out = (z >= 1);
+		z = (out) ? 0.99999999999999 / z : z;
+		z *= nz - 1;
+		iz = (int)floor(z);
+		z -= iz;
+		iz += out * nz;
+		u2 = u[i] * u[i];
+		mag = (out) ? (u2 + 2) / sqrt(u2 * (u2 + 4)) : magin;
+		mags[i] = mag * (row[iz] * (1 - z) + row[iz + 1] * z);
+	}
+}
+
+static void ESPLMag2Far(double *u, double *mags, int i0, int np) {
+	double u2;
+	for (int i = i0; i < np; i++) {
+		u2 = u[i] * u[i];
+		mags[i] = (u2 + 2) / (u[i] * sqrt(u2 + 4));
+	}
+}
+
+#ifdef _VBB_AVX2
+_VBB_AVX2 static int PSPLMagU2AVX2(double *u2, double *mags, int np) {
+	const __m256d two = _mm256_set1_pd(2.), four = _mm256_set1_pd(4.);
+	__m256d x;
+	int i;
+	for (i = 0; i + 4 <= np; i += 4) {
+		x = _mm256_loadu_pd(u2 + i);
+		x = _mm256_div_pd(_mm256_add_pd(x, two), _mm256_sqrt_pd(_mm256_mul_pd(x, _mm256_add_pd(x, four))));
+		_mm256_storeu_pd(mags + i, x);
+	}
+	return i;
+}
+
+_VBB_AVX2 static int ESPLMagRowAVX2(double *u, double RSv, double *row, int nz, double magin, double *mags, int np) {
+	const __m256d one = _mm256_set1_pd(1.), two = _mm256_set1_pd(2.), four = _mm256_set1_pd(4.);
+	const __m256d rs = _mm256_set1_pd(RSv), zout = _mm256_set1_pd(0.99999999999999), zs = _mm256_set1_pd(nz - 1);
+	const __m256d offout = _mm256_set1_pd(nz), vmagin = _mm256_set1_pd(magin);
+	const __m256d zero = _mm256_setzero_pd(), all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+	__m256d x, z, out, fz, u2, mag;
+	__m128i iz;
+	int i;
+	for (i = 0; i + 4 <= np; i += 4) {
+		x = _mm256_loadu_pd(u + i);
+		z = _mm256_div_pd(x, rs);
+		out = _mm256_cmp_pd(z, one, _CMP_GE_OQ);
+		z = _mm256_blendv_pd(z, _mm256_div_pd(zout, z), out);
+		z = _mm256_mul_pd(z, zs);
+		fz = _mm256_floor_pd(z);
+		z = _mm256_sub_pd(z, fz);
+		iz = _mm256_cvttpd_epi32(_mm256_add_pd(fz, _mm256_and_pd(out, offout)));
+		u2 = _mm256_mul_pd(x, x);
+		mag = _mm256_div_pd(_mm256_add_pd(u2, two), _mm256_sqrt_pd(_mm256_mul_pd(u2, _mm256_add_pd(u2, four))));
+		mag = _mm256_blendv_pd(vmagin, mag, out);
+		x = _mm256_add_pd(_mm256_mul_pd(_mm256_mask_i32gather_pd(zero, row, iz, all, 8), _mm256_sub_pd(one, z)), _mm256_mul_pd(_mm256_mask_i32gather_pd(zero, row + 1, iz, all, 8), z));
+		_mm256_storeu_pd(mags + i, _mm256_mul_pd(mag, x));
+	}
+	return i;
+}
+
+_VBB_AVX2 static int ESPLMag2FarAVX2(double *u, double *mags, int np) {
+	const __m256d two = _mm256_set1_pd(2.), four = _mm256_set1_pd(4.);
+	__m256d x, u2;
+	int i;
+	for (i = 0; i + 4 <= np; i += 4) {
+		x = _mm256_loadu_pd(u + i);
+		u2 = _mm256_mul_pd(x, x);
+		_mm256_storeu_pd(mags + i, _mm256_div_pd(_mm256_add_pd(u2, two), _mm256_mul_pd(x, _mm256_sqrt_pd(_mm256_add_pd(u2, four)))));
+	}
+	return i;
+}
+#endif
+
+static void PSPLMagU2Array(double *u2, double *mags, int np) {
+	int i0 = 0;
+#ifdef _VBB_AVX2
+	if (__builtin_cpu_supports("avx2")) i0 = PSPLMagU2AVX2(u2, mags, np);
+#endif
+	PSPLMagU2(u2, mags, i0, np);
+}
+
+void VBBinaryLensing::PSPLMag(double *u, double *mags, int np) {
+	for (int i = 0; i < np; i++) mags[i] = u[i] * u[i];
+	PSPLMagU2Array(mags, mags, np);
+}
+
+void VBBinaryLensing::ESPLMag(double *u, double RSv, double *mags, int np) {
+	double *row, *in, *out, fr, cr;
+	int ir, nz, i0 = 0;
+
+	if (!espl) {
+		printf("\nLoad ESPL table first!");
+		return;
+	}
+
+	nz = espl->nz;
+	fr = espl->lrfac * log(espl->rhomax / RSv);
+	if (fr > espl->nr - 1) fr = espl->nr - 1.000001;
+	if (fr < 0) {
+		// The table is mapped read-only: the first row is used rather than reading outside
+		printf("Source too large!");
+		fr = 0;
+	}
+	ir = (int)floor(fr);
+	fr -= ir;
+	cr = 1 - fr;
+	// Interpolation in rho is the same for all points: tables are reduced to one row
+	row = (double *)malloc(sizeof(double) * (2 * nz + 1));
+	in = espl->in + ir * nz;
+	out = espl->out + ir * nz;
+	for (int iz = 0; iz < nz; iz++) {
+		row[iz] = in[iz] * cr + in[iz + nz] * fr;
+		row[iz + nz] = out[iz] * cr + out[iz + nz] * fr;
+	}
+	row[2 * nz] = row[2 * nz - 1];
+
+#ifdef _VBB_AVX2
+	if (__builtin_cpu_supports("avx2")) i0 = ESPLMagRowAVX2(u, RSv, row, nz, sqrt(1 + 4. / (RSv*RSv)), mags, np);
+#endif
+	ESPLMagRow(u, RSv, row, nz, sqrt(1 + 4. / (RSv*RSv)), mags, i0, np);
+	free(row);
+}
+
+void VBBinaryLensing::ESPLMag2(double *u, double rho, double *mags, int np) {
+	double u2, u6, rho2Tol = rho*rho / Tol, fac, thr;
+	int i0 = 0;
+
+	if (gradgeom) {
+		// Called by LightCurveGradient through an ESPL light curve
+		for (int i = 0; i < np; i++) gradgeom[4 * np + i] = rho;
+		return;
+	}
+
+#ifdef _VBB_AVX2
+	if (__builtin_cpu_supports("avx2")) i0 = ESPLMag2FarAVX2(u, mags, np);
+#endif
+	ESPLMag2Far(u, mags, i0, np);
+
+	// Points close to the source need the full limb darkening calculation
+	fac = 1 + 0.003*rho2Tol;
+	thr = 0.027680640625*rho2Tol*rho2Tol;
+	for (int i = 0; i < np; i++) {
+		u2 = u[i] * u[i];
+		u6 = u2*u2*u2;
+		if (!(u6*fac > thr)) mags[i] = ESPLMagDark(u[i], rho);
+	}
+	Mag0 = 0;
+}
+
+//////////////////////////////
+//////////////////////////////
+////////Parallel and batch evaluation
+//////////////////////////////
+//////////////////////////////
+
+// Value restored when leaving the scope, also by an exception
+template <class T> struct restoreguard {
+	T &v, v0;
+	restoreguard(T &var, T val) : v(var), v0(var) { v = val; }
+	~restoreguard() { v = v0; }
+};
+
+template <class Job> void VBBinaryLensing::ParallelRun(int n, int chunk, Job job) {
+	// Tasks are handed out in small chunks from a shared counter,
+	// so that threads meeting expensive tasks (e.g. caustic crossings) do not hold back the others.
+	int nt = (n + chunk - 1) / chunk;
+	long long hits0 = magcachehits, misses0 = magcachemisses;
+	_stats stats0 = stats;
+	if (nthreads < nt) nt = nthreads;
+
+	if (nt <= 1) {
+		for (int i = 0; i < n; i++) job(this, i);
+		return;
+	}
+
+	std::atomic<int> next(0);
+	std::atomic<bool> failed(false);
+	std::exception_ptr err;
+	auto work = [&](VBBinaryLensing *VBBL) {
+		int i0;
+		try {
+			while ((i0 = next.fetch_add(chunk)) < n) {
+				for (int i = i0; i < i0 + chunk && i < n; i++) job(VBBL, i);
+			}
+		}
+		catch (...) {
+			// The first exception is passed to the caller once all threads have stopped
+			next = n;
+			if (!failed.exchange(true)) err = std::current_exception();
+		}
+	};
+
+	std::vector<VBBinaryLensing *> workers;
+	std::vector<std::thread> threads;
+	{
+		restoreguard<int> serial(nthreads, 1); // Each worker, including this instance, runs serially
+		for (int it = 1; it < nt; it++) {
+			workers.push_back(new VBBinaryLensing(*this));
+			threads.push_back(std::thread(work, workers.back()));
+		}
+		work(this);
+		for (int it = 0; it < nt - 1; it++) {
+			threads[it].join();
+			magcachehits += workers[it]->magcachehits - hits0;
+			magcachemisses += workers[it]->magcachemisses - misses0;
+			AddStats(workers[it]->stats, stats0);
+			delete workers[it];
+		}
+	}
+	if (err) std::rethrow_exception(err);
+}
+
+void VBBinaryLensing::BinaryMag2Parallel(double s, double *seps, double q, double *y1s, double *y2s, double rho, double *mags, int np, double *ts) {
+	double tim0 = statsclock();
+	// With orbital motion each epoch has a different lens: caustic boxes would be calculated for each epoch and never used again
+	restoreguard<bool> noindex(causticindex, causticindex && !seps);
+
+	if (gradgeom) {
+		// Called by LightCurveGradient, which only needs the geometry (rows s, q, y1, y2, rho)
+		for (int i = 0; i < np; i++) {
+			gradgeom[i] = (seps) ? seps[i] : s;
+			gradgeom[np + i] = q;
+			gradgeom[4 * np + i] = rho;
+		}
+		return;
+	}
+	if (nbands > 0) {
+		// Called by LightCurveMultiBand: mags is the first row of the nbands x np output
+		bandsdone = true;
+		ParallelRun(np, 4, [&](VBBinaryLensing *VBBL, int i) {
+			VBBL->BinaryMag2MultiBand((seps) ? seps[i] : s, q, y1s[i], y2s[i], rho, mags + i, np);
+		});
+	}
+	else if (!(InterpolationTol > 0 && BinaryMag2Adaptive(s, seps, q, y1s, y2s, rho, mags, np, ts)) && !(causticindex && !seps && BinaryMag2Indexed(s, q, y1s, y2s, rho, mags, np))) {
+		ParallelRun(np, 4, [&](VBBinaryLensing *VBBL, int i) {
+			mags[i] = VBBL->BinaryMag2((seps) ? seps[i] : s, q, y1s[i], y2s[i], rho);
+		});
+	}
+	stats.tlightcurve += statsclock() - tim0;
+}
+
+bool VBBinaryLensing::BinaryMag2Adaptive(double s, double *seps, double q, double *y1s, double *y2s, double rho, double *mags, int np, double *ts) {
+	// Adaptive sampling of the light curve, the analogue in time of the sampling of the source boundary in BinaryMag.
+	// The magnification is calculated every lcstride points, then each interval is bisected.
+	// An interval is filled by quadratic interpolation if the midpoint differs from the linear interpolation 
+	// by less than InterpolationTol and the source moves by less than rho across the interval, 
+	// so that caustic crossings cannot hide between the calculated points.
+	// Between point-source calculations (far from caustics), the source may move by lcfar*rho.
+	const int lcstride = 16;
+	const double lcfar = 4;
+	int *todo, *buf, *ia, *ib, *ja, *jb, *swp, ntodo, nint, nnew, a, b, m;
+	char *fs;
+	double ta, tm, tb, lin, dy1, dy2, dmax;
+
+	if (np < 2 * lcstride) return false;
+	for (int i = 1; i < np; i++) {
+		if (!(ts[i] > ts[i - 1])) return false; // Only for increasing times
+	}
+	todo = (int *)malloc(sizeof(int) * np);
+	buf = (int *)malloc(sizeof(int) * 4 * np);
+	ia = buf;
+	ib = ia + np;
+	ja = ib + np;
+	jb = ja + np;
+	fs = (char *)malloc(np);
+
+	auto calc = [&](int n) {
+		ParallelRun(n, 4, [&](VBBinaryLensing *VBBL, int k) {
+			int i = todo[k];
+			mags[i] = VBBL->BinaryMag2((seps) ? seps[i] : s, q, y1s[i], y2s[i], rho);
+			fs[i] = (VBBL->NPS > 1);
+		});
+	};
+
+	ntodo = 0;
+	for (int i = 0; i < np - 1; i += lcstride) todo[ntodo++] = i;
+	todo[ntodo++] = np - 1;
+	calc(ntodo);
+	nint = 0;
+	for (int k = 1; k < ntodo; k++) {
+		ia[nint] = todo[k - 1];
+		ib[nint] = todo[k];
+		nint++;
+	}
+
+	while (nint > 0) {
+		ntodo = 0;
+		for (int c = 0; c < nint; c++) todo[ntodo++] = (ia[c] + ib[c]) / 2;
+		calc(ntodo);
+		nnew = 0;
+		for (int c = 0; c < nint; c++) {
+			a = ia[c];
+			b = ib[c];
+			m = (a + b) / 2;
+			ta = ts[a];
+			tm = ts[m];
+			tb = ts[b];
+			lin = mags[a] + (mags[b] - mags[a]) * (tm - ta) / (tb - ta);
+			dy1 = y1s[b] - y1s[a];
+			dy2 = y2s[b] - y2s[a];
+			dmax = (fs[a] || fs[m] || fs[b]) ? rho : lcfar * rho;
+			if (dy1 * dy1 + dy2 * dy2 < dmax * dmax && fabs(mags[m] - lin) < InterpolationTol) {
+				for (int i = a + 1; i < b; i++) {
+					if (i == m) continue;
+					double t = ts[i];
+					mags[i] = mags[a] * (t - tm) * (t - tb) / ((ta - tm) * (ta - tb)) + mags[m] * (t - ta) * (t - tb) / ((tm - ta) * (tm - tb)) + mags[b] * (t - ta) * (t - tm) / ((tb - ta) * (tb - tm));
+				}
+			}
+			else {
+				if (m - a > 1) {
+					ja[nnew] = a;
+					jb[nnew] = m;
+					nnew++;
+				}
+				if (b - m > 1) {
+					ja[nnew] = m;
+					jb[nnew] = b;
+					nnew++;
+				}
+			}
+		}
+		swp = ia; ia = ja; ja = swp;
+		swp = ib; ib = jb; jb = swp;
+		nint = nnew;
+	}
+
+	free(todo);
+	free(buf);
+	free(fs);
+	return true;
+}
+
+void VBBinaryLensing::LightCurveBatch(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, int), double *pr, int npr, int nmodels, double *ts, double *mags, int np) {
+	// Observer positions only depend on time and are computed once for all models with parallax,
+	// unless they have already been prepared by the user for the same times
+	typedef void (VBBinaryLensing::*lightcurve)(double *, double *, double *, double *, double *, int);
+	double *tposv = tposcache, *posv = poscache;
+	int nposv = nposcache, satposv = satposcache;
+	bool parallax = LightCurve == (lightcurve)&VBBinaryLensing::PSPLLightCurveParallax || LightCurve == (lightcurve)&VBBinaryLensing::ESPLLightCurveParallax
+		|| LightCurve == (lightcurve)&VBBinaryLensing::BinaryLightCurveParallax || LightCurve == (lightcurve)&VBBinaryLensing::BinSourceLightCurveParallax;
+	bool prepared = !parallax || ParallaxPrepared(ts, np);
+	if (!prepared) {
+		nposcache = 0;
+		PrepareParallax(ts, np);
+	}
+
+	if (!(gpu && LightCurveBatchGPU(LightCurve, pr, npr, nmodels, ts, mags, np))) {
+		ParallelRun(nmodels, 1, [&](VBBinaryLensing *VBBL, int im) {
+			std::vector<double> y1s(np), y2s(np);
+			(VBBL->*LightCurve)(pr + im * npr, ts, mags + im * np, y1s.data(), y2s.data(), np);
+		});
+	}
+
+	if (!prepared) {
+		PrepareParallax(0, 0);
+		tposcache = tposv;
+		poscache = posv;
+		nposcache = nposv;
+		satposcache = satposv;
+	}
+}
+
+void VBBinaryLensing::LightCurveBatch(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, double *, int), double *pr, int npr, int nmodels, double *ts, double *mags, int np) {
+	double *tposv = tposcache, *posv = poscache;
+	int nposv = nposcache, satposv = satposcache;
+	bool prepared = ParallaxPrepared(ts, np);
+	if (!prepared) {
+		nposcache = 0;
+		PrepareParallax(ts, np);
+	}
+
+	ParallelRun(nmodels, 1, [&](VBBinaryLensing *VBBL, int im) {
+		std::vector<double> y1s(np), y2s(np), seps(np);
+		(VBBL->*LightCurve)(pr + im * npr, ts, mags + im * np, y1s.data(), y2s.data(), seps.data(), np);
+	});
+
+	if (!prepared) {
+		PrepareParallax(0, 0);
+		tposcache = tposv;
+		poscache = posv;
+		nposcache = nposv;
+		satposcache = satposv;
+	}
+}
+
+void VBBinaryLensing::SetBands(LDprofiles *LDs, double *a1s, double *a2s, int nb) {
+	// The bands of LightCurveMultiBand are copied, so that each worker of ParallelRun owns its copy. SetBands(0, 0, 0, 0) frees them.
+	if (nbands > 0) {
+		free(bandLD);
+		free(banda1);
+	}
+	bandLD = 0;
+	banda1 = banda2 = 0;
+	nbands = nb;
+	if (nb > 0) {
+		bandLD = (LDprofiles *)malloc(sizeof(LDprofiles) * nb);
+		banda1 = (double *)malloc(sizeof(double) * 2 * nb);
+		banda2 = banda1 + nb;
+		memcpy(bandLD, LDs, sizeof(LDprofiles) * nb);
+		memcpy(banda1, a1s, sizeof(double) * nb);
+		memcpy(banda2, a2s, sizeof(double) * nb);
+	}
+}
+
+void VBBinaryLensing::LightCurveMultiBand(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, int), double *pr, double *ts, double *mags, double *y1s, double *y2s, int np, LDprofiles *LDs, double *a1s, double *a2s, int nb) {
+	LDprofiles LDv = curLDprofile;
+	double a1v = a1, a2v = a2;
+
+	for (int ib = 0; ib < nb; ib++) {
+		if (LDs[ib] == LDuser && npLD == 0) {
+			printf("\nSet a user limb darkening profile first!");
+			return;
+		}
+	}
+	SetBands(LDs, a1s, a2s, nb);
+	bandsdone = false;
+	(this->*LightCurve)(pr, ts, mags, y1s, y2s, np);
+	SetBands(0, 0, 0, 0);
+
+	// Light curves that do not go through BinaryMag2Parallel are calculated again for each band
+	if (!bandsdone) {
+		for (int ib = 0; ib < nb; ib++) {
+			curLDprofile = LDs[ib];
+			a1 = a1s[ib];
+			a2 = a2s[ib];
+			(this->*LightCurve)(pr, ts, mags + ib * np, y1s, y2s, np);
+		}
+		curLDprofile = LDv;
+		a1 = a1v;
+		a2 = a2v;
+	}
+}
+
+void VBBinaryLensing::LightCurveMultiBand(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, double *, int), double *pr, double *ts, double *mags, double *y1s, double *y2s, double *seps, int np, LDprofiles *LDs, double *a1s, double *a2s, int nb) {
+	LDprofiles LDv = curLDprofile;
+	double a1v = a1, a2v = a2;
+
+	for (int ib = 0; ib < nb; ib++) {
+		if (LDs[ib] == LDuser && npLD == 0) {
+			printf("\nSet a user limb darkening profile first!");
+			return;
+		}
+	}
+	SetBands(LDs, a1s, a2s, nb);
+	bandsdone = false;
+	(this->*LightCurve)(pr, ts, mags, y1s, y2s, seps, np);
+	SetBands(0, 0, 0, 0);
+
+	// Light curves that do not go through BinaryMag2Parallel are calculated again for each band
+	if (!bandsdone) {
+		for (int ib = 0; ib < nb; ib++) {
+			curLDprofile = LDs[ib];
+			a1 = a1s[ib];
+			a2 = a2s[ib];
+			(this->*LightCurve)(pr, ts, mags + ib * np, y1s, y2s, seps, np);
+		}
+		curLDprofile = LDv;
+		a1 = a1v;
+		a2 = a2v;
+	}
+}
+
+//////////////////////////////
+//////////////////////////////
+////////Streaming light curves
+//////////////////////////////
+//////////////////////////////
+
+// The stream keeps the epochs received so far with the observer positions needed by parallax, which are computed only once per epoch.
+// New epochs start from the roots of the lens equation found for the last epoch, as consecutive points of a light curve do.
+
+void VBBinaryLensing::StreamOpen(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, int), double *pr, int npr) {
+	StreamClose();
+	stream = new lcstream;
+	stream->LightCurve = LightCurve;
+	stream->npr = npr;
+	stream->pr = (double *)malloc(sizeof(double) * npr);
+	memcpy(stream->pr, pr, sizeof(double) * npr);
+	stream->ts = stream->pos = 0;
+	stream->n = stream->size = 0;
+	stream->satellite = satellite;
+	stream->parallax = (t0_par_fixed != -1);
+	for (int i = 0; i < 5; i++) stream->zr[i] = zr[i];
+}
+
+void VBBinaryLensing::StreamClose(void) {
+	if (!stream) return;
+	free(stream->pr);
+	free(stream->ts);
+	free(stream->pos);
+	delete stream;
+	stream = 0;
+}
+
+void VBBinaryLensing::StreamRun(double *pr, int i0, int np, double *mags) {
+	// Light curve on the epochs i0 ... i0+np-1 of the stream, with their stored observer positions
+	double *tposv = tposcache, *posv = poscache, *ys;
+	int nposv = nposcache, iposv = iposcache, satposv = satposcache;
+
+	if (stream->pos) {
+		tposcache = stream->ts + i0;
+		poscache = stream->pos + 6 * i0;
+		nposcache = np;
+		iposcache = 0;
+		satposcache = stream->satellite;
+	}
+	ys = (double *)malloc(sizeof(double) * 2 * np);
+	(this->*stream->LightCurve)(pr, stream->ts + i0, mags, ys, ys + np, np);
+	free(ys);
+	tposcache = tposv;
+	poscache = posv;
+	nposcache = nposv;
+	iposcache = iposv;
+	satposcache = satposv;
+}
+
+int VBBinaryLensing::StreamAdd(double *ts, double *mags, int np) {
+	lcstream *st = stream;
+	int satv = satellite;
+
+	if (!st) {
+		printf("\nUse StreamOpen before adding epochs");
+		return 0;
+	}
+	if (np <= 0) return st->n;
+	if (st->n + np > st->size) {
+		st->size = 2 * (st->n + np);
+		st->ts = (double *)realloc(st->ts, sizeof(double) * st->size);
+		if (st->parallax) st->pos = (double *)realloc(st->pos, sizeof(double) * 6 * st->size);
+	}
+	memcpy(st->ts + st->n, ts, sizeof(double) * np);
+	if (st->parallax) {
+		satellite = st->satellite;
+		for (int i = st->n; i < st->n + np; i++) ObserverPosition(st->ts[i], st->pos + 6 * i, st->pos + 6 * i + 3);
+		satellite = satv;
+	}
+	for (int i = 0; i < 5; i++) zr[i] = st->zr[i];
+	StreamRun(st->pr, st->n, np, mags);
+	for (int i = 0; i < 5; i++) st->zr[i] = zr[i];
+	st->n += np;
+	return st->n;
+}
+
+int VBBinaryLensing::StreamReevaluate(double *pr, int nlast, double *mags) {
+	// Parameters and roots of the stream are left untouched, so that trial models do not affect the following epochs
+	lcstream *st = stream;
+
+	if (!st) {
+		printf("\nUse StreamOpen before reevaluating epochs");
+		return 0;
+	}
+	if (nlast > st->n) nlast = st->n;
+	if (nlast <= 0) return 0;
+	for (int i = 0; i < 5; i++) zr[i] = st->zr[i];
+	StreamRun(pr, st->n - nlast, nlast, mags);
+	return nlast;
+}
+
+//////////////////////////////
+//////////////////////////////
+////////GPU offload
+//////////////////////////////
+//////////////////////////////
+
+bool VBBinaryLensing::UseGPU(int device) {
+	if (gpu) VBBGPUClose(gpu);
+	gpu = (device >= 0) ? VBBGPUOpen(device) : 0;
+	return gpu != 0;
+}
+
+bool VBBinaryLensing::LightCurveBatchGPU(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, int), double *pr, int npr, int nmodels, double *ts, double *mags, int np) {
+	// Point-lens batches are calculated on the device. With parallax, the observer positions are those prepared
+	// by LightCurveBatch and the reference frame of each model is calculated here by ComputeParallax.
+	// Models with ESPL epochs needing the limb darkening integration are calculated again on the CPU.
+	typedef void (VBBinaryLensing::*lightcurve)(double *, double *, double *, double *, double *, int);
+	double *obs = 0, *frames = 0, *f, Et[2];
+	int kind, nfail;
+
+	if (LightCurve == (lightcurve)&VBBinaryLensing::PSPLLightCurve) kind = 0;
+	else if (LightCurve == (lightcurve)&VBBinaryLensing::PSPLLightCurveParallax) kind = 1;
+	else if (LightCurve == (lightcurve)&VBBinaryLensing::ESPLLightCurve) kind = 2;
+	else if (LightCurve == (lightcurve)&VBBinaryLensing::ESPLLightCurveParallax) kind = 3;
+	else return false;
+	if ((double)nmodels * np < gpuminpoints) return false;
+
+	if (kind & 1) {
+		if (nposcache != np) return false;
+		obs = (double *)malloc(sizeof(double) * (3 * np + 11 * (size_t)nmodels));
+		frames = obs + 3 * np;
+		for (int i = 0; i < np; i++) {
+			for (int k = 0; k < 3; k++) obs[3 * i + k] = poscache[6 * i + k] + poscache[6 * i + 3 + k];
+		}
+		for (int im = 0; im < nmodels; im++) {
+			f = frames + 11 * (size_t)im;
+			t0old = 0;
+			ComputeParallax(ts[0], pr[im * npr + 2], Et);
+			for (int k = 0; k < 3; k++) {
+				f[k] = rad[k];
+				f[3 + k] = tang[k];
+			}
+			f[6] = Et0[0];
+			f[7] = Et0[1];
+			f[8] = vt0[0];
+			f[9] = vt0[1];
+			f[10] = t0_par;
+		}
+	}
+	nfail = VBBGPUPointLens(gpu, kind, pr, npr, nmodels, frames, ts, obs, np, Tol, mags);
+	free(obs);
+	if (nfail < 0) return false;
+
+	if (nfail > 0) {
+		ParallelRun(nmodels, 1, [&](VBBinaryLensing *VBBL, int im) {
+			double *m = mags + (size_t)im * np;
+			int i = 0;
+			while (i < np && m[i] >= 0) i++;
+			if (i < np) {
+				std::vector<double> y1s(np), y2s(np);
+				(VBBL->*LightCurve)(pr + im * npr, ts, m, y1s.data(), y2s.data(), np);
+			}
+		});
+	}
+	return true;
+}
+
+//////////////////////////////
+//////////////////////////////
+////////Light curve gradients
+//////////////////////////////
+//////////////////////////////
+
+// The geometry of a light curve (s, q, y1, y2, rho at each time) is cheap and is differentiated numerically
+// with respect to the parameters. The magnification is differentiated with respect to the geometry:
+// analytically for point sources, by central differences on contour integrations for extended sources.
+// The derivatives with respect to the parameters follow by the chain rule.
+
+double VBBinaryLensing::BinaryMag0Grad(double s, double q, double y1, double y2, double *grad) {
+	// Derivatives of the point-source magnification with respect to s, q, y1, y2.
+	// In the frame of the center of mass, masses m[j] are at x[j] and the lens equation is zeta = z - sum m[j]/(conj(z) - x[j]).
+	// A displacement of the source or of the lenses moves each image by dz and changes its Jacobian determinant J = 1 - |kappa|^2.
+	_sols *Images;
+	complex z, d[2], kappa, dkappa, c, dz, dk, df;
+	double m[2], x[2], dm[2][2], dx[2][2], J, dJ, Mag;
+
+	m[0] = 1 / (1 + q);
+	m[1] = q / (1 + q);
+	x[0] = -s * q / (1 + q);
+	x[1] = s / (1 + q);
+	dm[0][0] = dm[0][1] = 0; // s
+	dx[0][0] = -q / (1 + q);
+	dx[0][1] = 1 / (1 + q);
+	dm[1][0] = -1 / ((1 + q) * (1 + q)); // q
+	dm[1][1] = -dm[1][0];
+	dx[1][0] = dx[1][1] = -s / ((1 + q) * (1 + q));
+
+	Mag = BinaryMag0(s, q, y1, y2, &Images);
+	for (int k = 0; k < 4; k++) grad[k] = 0;
+	for (_curve *cim = Images->first; cim; cim = cim->next) {
+		z = complex(cim->first->x1 - coefs0[11].re, cim->first->x2);
+		kappa = dkappa = 0;
+		for (int j = 0; j < 2; j++) {
+			d[j] = 1 / (z - x[j]);
+			kappa = kappa + m[j] * d[j] * d[j];
+			dkappa = dkappa - 2 * m[j] * d[j] * d[j] * d[j];
+		}
+		J = 1 - kappa.re * kappa.re - kappa.im * kappa.im;
+		for (int k = 0; k < 4; k++) {
+			// Source displacement and derivatives of the lens equation and of kappa at fixed z
+			c = (k == 2) ? complex(1, 0) : (k == 3) ? complex(0, 1) : complex(0, 0);
+			df = dk = 0;
+			if (k < 2) {
+				for (int j = 0; j < 2; j++) {
+					df = df + dm[k][j] * d[j] + m[j] * dx[k][j] * d[j] * d[j];
+					dk = dk + dm[k][j] * d[j] * d[j] + 2 * m[j] * dx[k][j] * d[j] * d[j] * d[j];
+				}
+			}
+			c = c + conj(df);
+			dz = (c - conj(kappa) * conj(c)) / J;
+			dk = dk + dkappa * dz;
+			dJ = -2 * (kappa.re * dk.re + kappa.im * dk.im);
+			grad[k] -= ((J > 0) ? dJ : -dJ) / (J * J);
+		}
+	}
+	delete Images;
+	return Mag;
+}
+
+double VBBinaryLensing::BinaryMag2Grad(double s, double q, double y1, double y2, double rho, double *grad) {
+	// Derivatives of BinaryMag2 with respect to s, q, y1, y2, rho
+	double Mag, x[5] = { s, q, y1, y2, rho }, h[5], xv, magp, magm;
+
+	Mag = BinaryMag2(s, q, y1, y2, rho);
+	if (NPS == 1) {
+		// Point-source approximation, as in BinaryMag2
+		BinaryMag0Grad(s, q, y1, fabs(y2), grad);
+		if (y2 < 0) grad[3] = -grad[3];
+		grad[4] = 0;
+	}
+	else {
+		// Steps are a fraction of the source radius, so that caustics move by much less than rho.
+		// The errors of the magnifications (about Tol) are divided by the step: with 0.01 rho they stay at the percent level
+		// of the derivatives for Tol up to 1.e-2, while smaller steps would need smaller tolerances and cost much more.
+		h[0] = h[2] = h[3] = h[4] = 1.e-2 * rho;
+		h[1] = 1.e-2 * rho * q;
+		for (int k = 0; k < 5; k++) {
+			xv = x[k];
+			x[k] = xv + h[k];
+			magp = BinaryMag2(x[0], x[1], x[2], x[3], x[4]);
+			x[k] = xv - h[k];
+			magm = BinaryMag2(x[0], x[1], x[2], x[3], x[4]);
+			x[k] = xv;
+			grad[k] = (magp - magm) / (2 * h[k]);
+		}
+	}
+	return Mag;
+}
+
+double VBBinaryLensing::ESPLMag2Grad(double u, double rho, double *grad) {
+	// Derivatives of ESPLMag2 with respect to u and rho
+	double Mag, u2, u6, rho2Tol, h;
+
+	u2 = u*u;
+	rho2Tol = rho*rho / Tol;
+	u6 = u2*u2*u2;
+	if (u6*(1 + 0.003*rho2Tol) > 0.027680640625*rho2Tol*rho2Tol) {
+		Mag = (u2 + 2) / (u*sqrt(u2 + 4));
+		grad[0] = -8 / (u2*(u2 + 4)*sqrt(u2 + 4));
+		grad[1] = 0;
+	}
+	else {
+		Mag = ESPLMagDark(u, rho);
+		h = 1.e-3 * rho;
+		grad[0] = (ESPLMagDark(u + h, rho) - ESPLMagDark(fabs(u - h), rho)) / (2 * h);
+		grad[1] = (ESPLMagDark(u, rho + h) - ESPLMagDark(u, rho - h)) / (2 * h);
+	}
+	return Mag;
+}
+
+template <class Curve> void VBBinaryLensing::LightCurveGradientRun(int kind, bool parallax, int npr, Curve curve, double *pr, double *ts, double *mags, double *grads, double *y1s, double *y2s, double *seps, int np) {
+	// kind is 0 for PSPL, 1 for ESPL, 2 for binary lenses.
+	// The geometry is stored in five rows of np values: s, q, y1, y2, rho.
+	double *geom, *gplus, *gminus, *dgeom, prv, prp, prm;
+	double *tposv = tposcache, *posv = poscache;
+	int nposv = nposcache, satposv = satposcache;
+	bool prepared = !parallax || ParallaxPrepared(ts, np);
+	double tim0 = statsclock();
+
+	if (!prepared) {
+		nposcache = 0;
+		PrepareParallax(ts, np);
+	}
+	geom = (double *)malloc(sizeof(double) * 5 * np * (npr + 3));
+	gplus = geom + 5 * np;
+	gminus = gplus + 5 * np;
+	dgeom = gminus + 5 * np;
+
+	auto capture = [&](double *g) {
+		for (int i = 0; i < np; i++) g[i] = g[np + i] = g[4 * np + i] = 0;
+		gradgeom = g;
+		curve(g + 2 * np, g + 3 * np);
+		gradgeom = 0;
+	};
+	capture(geom);
+	for (int k = 0; k < npr; k++) {
+		prv = pr[k];
+		prp = prv + 1.e-5 * (1 + fabs(prv));
+		prm = prv - 1.e-5 * (1 + fabs(prv));
+		pr[k] = prp;
+		capture(gplus);
+		pr[k] = prm;
+		capture(gminus);
+		pr[k] = prv;
+		for (int j = 0; j < 5 * np; j++) dgeom[k * 5 * np + j] = (gplus[j] - gminus[j]) / (prp - prm);
+	}
+
+	ParallelRun(np, 4, [&](VBBinaryLensing *VBBL, int i) {
+		double dA[5] = { 0, 0, 0, 0, 0 }, du[2], u, u2, Mag, *g;
+		double y1 = geom[2 * np + i], y2 = geom[3 * np + i];
+		if (kind == 2) {
+			Mag = VBBL->BinaryMag2Grad(geom[i], geom[np + i], y1, y2, geom[4 * np + i], dA);
+		}
+		else {
+			u2 = y1 * y1 + y2 * y2;
+			u = sqrt(u2);
+			if (kind == 1) {
+				Mag = VBBL->ESPLMag2Grad(u, geom[4 * np + i], du);
+				dA[4] = du[1];
+			}
+			else {
+				Mag = (u2 + 2) / sqrt(u2 * (u2 + 4));
+				du[0] = -8 / (u2 * (u2 + 4) * sqrt(u2 + 4));
+			}
+			dA[2] = du[0] * y1 / u;
+			dA[3] = du[0] * y2 / u;
+		}
+		mags[i] = Mag;
+		for (int k = 0; k < npr; k++) {
+			g = dgeom + k * 5 * np + i;
+			grads[k * np + i] = dA[0] * g[0] + dA[1] * g[np] + dA[2] * g[2 * np] + dA[3] * g[3 * np] + dA[4] * g[4 * np];
+		}
+	});
+
+	for (int i = 0; i < np; i++) {
+		y1s[i] = geom[2 * np + i];
+		y2s[i] = geom[3 * np + i];
+		if (seps) seps[i] = geom[i];
+	}
+	free(geom);
+	if (!prepared) {
+		PrepareParallax(0, 0);
+		tposcache = tposv;
+		poscache = posv;
+		nposcache = nposv;
+		satposcache = satposv;
+	}
+	stats.tlightcurve += statsclock() - tim0;
+}
+
+void VBBinaryLensing::LightCurveGradient(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, int), double *pr, double *ts, double *mags, double *grads, double *y1s, double *y2s, int np) {
+	typedef void (VBBinaryLensing::*LightCurve3)(double *, double *, double *, double *, double *, int);
+	static const struct { LightCurve3 lc; int kind, npr; bool parallax; } curves[] = {
+		{ &VBBinaryLensing::PSPLLightCurve, 0, 3, false },
+		{ &VBBinaryLensing::PSPLLightCurveParallax, 0, 5, true },
+		{ &VBBinaryLensing::ESPLLightCurve, 1, 4, false },
+		{ &VBBinaryLensing::ESPLLightCurveParallax, 1, 6, true },
+		{ &VBBinaryLensing::BinaryLightCurve, 2, 7, false },
+		{ &VBBinaryLensing::BinaryLightCurveW, 2, 7, false },
+		{ &VBBinaryLensing::BinaryLightCurveParallax, 2, 9, true } };
+
+	for (int ic = 0; ic < (int)(sizeof(curves) / sizeof(curves[0])); ic++) {
+		if (LightCurve == curves[ic].lc) {
+			// The parameters are perturbed in a copy, so that pr can be shared, e.g. by other threads
+			std::vector<double> prw(pr, pr + curves[ic].npr);
+			LightCurveGradientRun(curves[ic].kind, curves[ic].parallax, curves[ic].npr, [&](double *y1v, double *y2v) {
+				(this->*LightCurve)(prw.data(), ts, mags, y1v, y2v, np);
+			}, prw.data(), ts, mags, grads, y1s, y2s, 0, np);
+			return;
+		}
+	}
+	printf("\nLightCurveGradient is not available for this light curve!");
+}
+
+void VBBinaryLensing::LightCurveGradient(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, double *, int), double *pr, double *ts, double *mags, double *grads, double *y1s, double *y2s, double *seps, int np) {
+	typedef void (VBBinaryLensing::*LightCurve4)(double *, double *, double *, double *, double *, double *, int);
+	static const struct { LightCurve4 lc; int npr; } curves[] = {
+		{ &VBBinaryLensing::BinaryLightCurveOrbital, 12 },
+		{ &VBBinaryLensing::BinaryLightCurveKepler, 14 } };
+
+	for (int ic = 0; ic < (int)(sizeof(curves) / sizeof(curves[0])); ic++) {
+		if (LightCurve == curves[ic].lc) {
+			std::vector<double> prw(pr, pr + curves[ic].npr);
+			LightCurveGradientRun(2, true, curves[ic].npr, [&](double *y1v, double *y2v) {
+				(this->*LightCurve)(prw.data(), ts, mags, y1v, y2v, seps, np);
+			}, prw.data(), ts, mags, grads, y1s, y2s, seps, np);
+			return;
+		}
+	}
+	printf("\nLightCurveGradient is not available for this light curve!");
+}
+
+//////////////////////////////
+//////////////////////////////
+////////Magnification maps
+//////////////////////////////
+//////////////////////////////
+
+// A map covers the rectangle y1min<y1<y1max, 0<y2<y2max (BinaryMag2 is symmetric in y2) with a grid of square base cells.
+// Each base cell is the root of a quadtree. A cell is divided into four until the bilinear interpolation of the magnifications 
+// at its corners reproduces BinaryMag2 at the center and at the midpoints of the sides within Tol (or RelTol).
+// Cells closer than rho to a caustic are also divided until they are smaller than rho.
+// Leaves that still fail the test at the maximum depth are marked as bad and BinaryMag2 does the full calculation there.
+
+struct magmapbuild {
+	double s, q, rho, Tol, RelTol, *caus;
+	int ncaus, maxdepth;
+};
+
+static void RefineMagMapCell(VBBinaryLensing *VBBL, magmapbuild *mb, std::vector<magmapnode> &nodes, int inode, double x0, double y0, double size, int depth) {
+	double m[9], x[3], y[3], err, d, dmin, cl;
+	int flag;
+	magmapnode nc;
+
+	// Nine points of the cell numbered as x + 3 y
+	x[0] = x0; x[1] = x0 + 0.5*size; x[2] = x0 + size;
+	y[0] = y0; y[1] = y0 + 0.5*size; y[2] = y0 + size;
+	m[0] = nodes[inode].mag[0];
+	m[2] = nodes[inode].mag[1];
+	m[6] = nodes[inode].mag[2];
+	m[8] = nodes[inode].mag[3];
+	m[1] = VBBL->BinaryMag2(mb->s, mb->q, x[1], y[0], mb->rho);
+	m[3] = VBBL->BinaryMag2(mb->s, mb->q, x[0], y[1], mb->rho);
+	m[4] = VBBL->BinaryMag2(mb->s, mb->q, x[1], y[1], mb->rho);
+	m[5] = VBBL->BinaryMag2(mb->s, mb->q, x[2], y[1], mb->rho);
+	m[7] = VBBL->BinaryMag2(mb->s, mb->q, x[1], y[2], mb->rho);
+
+	flag = 1;
+	for (int i = 0; i < 9; i++) if (!(m[i] > 0)) flag = 0;
+	err = fabs(m[1] - 0.5*(m[0] + m[2]));
+	d = fabs(m[7] - 0.5*(m[6] + m[8])); if (d > err) err = d;
+	d = fabs(m[3] - 0.5*(m[0] + m[6])); if (d > err) err = d;
+	d = fabs(m[5] - 0.5*(m[2] + m[8])); if (d > err) err = d;
+	d = fabs(m[4] - 0.25*(m[0] + m[2] + m[6] + m[8])); if (d > err) err = d;
+	if (err > mb->Tol && err > mb->RelTol*m[4]) flag = 0;
+
+	if (flag && size > mb->rho) {
+		dmin = 1.e100;
+		for (int i = 0; i < mb->ncaus; i++) {
+			d = (mb->caus[2 * i] - x[1])*(mb->caus[2 * i] - x[1]) + (mb->caus[2 * i + 1] - y[1])*(mb->caus[2 * i + 1] - y[1]);
+			if (d < dmin) dmin = d;
+		}
+		cl = mb->rho + size;
+		if (dmin < cl*cl) flag = 0;
+	}
+
+	if (flag || depth >= mb->maxdepth) {
+		nodes[inode].good = flag;
+		return;
+	}
+
+	nodes[inode].child = nodes.size();
+	nc.child = 0;
+	nc.good = 0;
+	for (int j = 0; j < 2; j++) {
+		for (int i = 0; i < 2; i++) {
+			nc.mag[0] = m[i + 3 * j];
+			nc.mag[1] = m[i + 1 + 3 * j];
+			nc.mag[2] = m[i + 3 * (j + 1)];
+			nc.mag[3] = m[i + 1 + 3 * (j + 1)];
+			nodes.push_back(nc);
+		}
+	}
+	for (int j = 0; j < 2; j++) {
+		for (int i = 0; i < 2; i++) {
+			RefineMagMapCell(VBBL, mb, nodes, nodes[inode].child + i + 2 * j, x[i], y[j], 0.5*size, depth + 1);
+		}
+	}
+}
+
+void VBBinaryLensing::BuildMagMap(double s, double q, double rho, double y1min, double y1max, double y2max, int nbase, int maxdepth) {
+	magmapbuild mb;
+	magmap *mm;
+	_sols *crit;
+	_curve *c;
+	std::vector<double> caus, corners;
+	int n1, n2, ncrit, nnodes;
+
+	FreeMagMap();
+	if (nbase < 1 || !(y1max > y1min) || !(y2max > 0)) {
+		printf("\nInvalid magnification map domain !");
+		return;
+	}
+
+	crit = PlotCrit(s, q);
+	ncrit = crit->length / 2;
+	c = crit->first;
+	for (int i = 0; i < ncrit; i++) c = c->next;
+	for (; c; c = c->next) {
+		for (_point *p = c->first; p; p = p->next) {
+			caus.push_back(p->x1);
+			caus.push_back(fabs(p->x2));
+		}
+	}
+	delete crit;
+
+	mm = new magmap;
+	mm->s = s;
+	mm->q = q;
+	mm->rho = rho;
+	mm->a1 = a1;
+	mm->a2 = a2;
+	mm->LD = curLDprofile;
+	mm->Tol = Tol;
+	mm->RelTol = RelTol;
+	mm->y1min = y1min;
+	mm->y2min = 0;
+	mm->size = (y1max - y1min) / nbase;
+	mm->n1 = n1 = nbase;
+	mm->n2 = n2 = (int)ceil(y2max / mm->size - 1.e-9);
+	mm->maxdepth = maxdepth;
+	mm->refs = 1;
+
+	mb.s = s;
+	mb.q = q;
+	mb.rho = rho;
+	mb.Tol = Tol;
+	mb.RelTol = RelTol;
+	mb.caus = caus.data();
+	mb.ncaus = caus.size() / 2;
+	mb.maxdepth = maxdepth;
+
+	// Magnifications at the corners of the base cells
+	corners.resize((n1 + 1) * (n2 + 1));
+	ParallelRun((n1 + 1) * (n2 + 1), 4, [&](VBBinaryLensing *VBBL, int i) {
+		corners[i] = VBBL->BinaryMag2(s, q, y1min + (i % (n1 + 1)) * mm->size, (i / (n1 + 1)) * mm->size, rho);
+	});
+
+	// Quadtrees are built independently in each base cell and then collected in a single array
+	std::vector< std::vector<magmapnode> > cells(n1 * n2);
+	ParallelRun(n1 * n2, 1, [&](VBBinaryLensing *VBBL, int i) {
+		int i1 = i % n1, i2 = i / n1;
+		magmapnode nc;
+		nc.child = 0;
+		nc.good = 0;
+		nc.mag[0] = corners[i1 + (n1 + 1) * i2];
+		nc.mag[1] = corners[i1 + 1 + (n1 + 1) * i2];
+		nc.mag[2] = corners[i1 + (n1 + 1) * (i2 + 1)];
+		nc.mag[3] = corners[i1 + 1 + (n1 + 1) * (i2 + 1)];
+		cells[i].push_back(nc);
+		RefineMagMapCell(VBBL, &mb, cells[i], 0, y1min + i1 * mm->size, i2 * mm->size, mm->size, 0);
+	});
+
+	nnodes = n1 * n2;
+	for (int i = 0; i < n1 * n2; i++) nnodes += cells[i].size() - 1;
+	mm->nnodes = nnodes;
+	mm->nodes = (magmapnode *)malloc(sizeof(magmapnode) * nnodes);
+	nnodes = n1 * n2;
+	for (int i = 0; i < n1 * n2; i++) {
+		// Base cells come first, their descendants are appended with shifted indices
+		int off = nnodes - 1;
+		for (int k = 0; k < (int)cells[i].size(); k++) {
+			magmapnode nc = cells[i][k];
+			if (nc.child) nc.child += off;
+			mm->nodes[(k == 0) ? i : off + k] = nc;
+		}
+		nnodes += cells[i].size() - 1;
+	}
+	curmap = mm;
+}
+
+bool VBBinaryLensing::MagMapServes(double s, double q, double rho) {
+	// Parameters are compared allowing for rounding, e.g. s = exp(log(s)).
+	// The map serves the same limb darkening and tolerances not tighter than those used to build it.
+	return curmap && !astrometry && fabs(s - curmap->s) < 1.e-12*s && fabs(q - curmap->q) < 1.e-12*q && fabs(rho - curmap->rho) < 1.e-12*rho
+		&& curLDprofile == curmap->LD && a1 == curmap->a1 && a2 == curmap->a2 && Tol >= curmap->Tol && RelTol >= curmap->RelTol;
+}
+
+double VBBinaryLensing::MagMap(double y1, double y2) {
+	magmapnode *n;
+	double x, y;
+	int i1, i2;
+
+	if (!curmap) return -1;
+	x = (y1 - curmap->y1min) / curmap->size;
+	y = (fabs(y2) - curmap->y2min) / curmap->size;
+	if (!(x >= 0 && y >= 0 && x < curmap->n1 && y < curmap->n2)) return -1;
+	i1 = (int)x;
+	i2 = (int)y;
+	x -= i1;
+	y -= i2;
+	n = curmap->nodes + i1 + curmap->n1 * i2;
+	while (n->child) {
+		x *= 2;
+		y *= 2;
+		i1 = (x >= 1) ? 1 : 0;
+		i2 = (y >= 1) ? 1 : 0;
+		x -= i1;
+		y -= i2;
+		n = curmap->nodes + n->child + i1 + 2 * i2;
+	}
+	if (!n->good) return -1;
+	return (n->mag[0] * (1 - x) + n->mag[1] * x) * (1 - y) + (n->mag[2] * (1 - x) + n->mag[3] * x) * y;
+}
+
+void VBBinaryLensing::FreeMagMap(void) {
+	if (curmap && --curmap->refs == 0) {
+		free(curmap->nodes);
+		delete curmap;
+	}
+	curmap = 0;
+}
+
+// Map files: 8 characters "VBBMAP2", s, q, rho, a1, a2, Tol, RelTol, y1min, y2min, size (doubles),
+// n1, n2, maxdepth, nnodes, LD profile (ints), then the nnodes nodes.
+const char magmapheader[8] = { 'V','B','B','M','A','P','2',0 };
+
+void VBBinaryLensing::SaveMagMap(char *filename) {
+	FILE *f;
+	int ints[5];
+
+	if (!curmap) {
+		printf("\nNo magnification map to save !");
+		return;
+	}
+	if ((f = fopen(filename, "wb")) != 0) {
+		double pars[10] = { curmap->s, curmap->q, curmap->rho, curmap->a1, curmap->a2, curmap->Tol, curmap->RelTol, curmap->y1min, curmap->y2min, curmap->size };
+		ints[0] = curmap->n1;
+		ints[1] = curmap->n2;
+		ints[2] = curmap->maxdepth;
+		ints[3] = curmap->nnodes;
+		ints[4] = curmap->LD;
+		fwrite(magmapheader, sizeof(char), 8, f);
+		fwrite(pars, sizeof(double), 10, f);
+		fwrite(ints, sizeof(int), 5, f);
+		fwrite(curmap->nodes, sizeof(magmapnode), curmap->nnodes, f);
+		fclose(f);
+	}
+	else {
+		printf("\nCannot write magnification map !");
+	}
+}
+
+void VBBinaryLensing::LoadMagMap(char *filename) {
+	FILE *f;
+	char header[8];
+	double pars[10];
+	int ints[5], nbase;
+	bool valid;
+	magmap *mm;
+
+	FreeMagMap();
+	if ((f = fopen(filename, "rb")) != 0) {
+		valid = fread(header, sizeof(char), 8, f) == 8 && !memcmp(header, magmapheader, 8) && fread(pars, sizeof(double), 10, f) == 10 && fread(ints, sizeof(int), 5, f) == 5;
+		valid = valid && ints[0] > 0 && ints[1] > 0 && ints[0] <= ints[3] / ints[1] && pars[9] > 0 && ints[4] >= LDlinear && ints[4] <= LDuser;
+		if (!valid) {
+			printf("\nInvalid magnification map file !");
+			fclose(f);
+			return;
+		}
+		mm = new magmap;
+		mm->s = pars[0];
+		mm->q = pars[1];
+		mm->rho = pars[2];
+		mm->a1 = pars[3];
+		mm->a2 = pars[4];
+		mm->Tol = pars[5];
+		mm->RelTol = pars[6];
+		mm->y1min = pars[7];
+		mm->y2min = pars[8];
+		mm->size = pars[9];
+		mm->n1 = ints[0];
+		mm->n2 = ints[1];
+		mm->maxdepth = ints[2];
+		mm->nnodes = ints[3];
+		mm->LD = ints[4];
+		mm->refs = 1;
+		mm->nodes = (magmapnode *)malloc(sizeof(magmapnode) * mm->nnodes);
+		valid = (int)fread(mm->nodes, sizeof(magmapnode), mm->nnodes, f) == mm->nnodes;
+		// Children always follow their parent, so that MagMap cannot leave the array or loop
+		nbase = mm->n1 * mm->n2;
+		for (int i = 0; i < mm->nnodes && valid; i++) {
+			int ch = mm->nodes[i].child;
+			valid = ch == 0 || (ch > i && ch >= nbase && ch <= mm->nnodes - 4);
+		}
+		if (!valid) {
+			printf("\nInvalid magnification map file !");
+			free(mm->nodes);
+			delete mm;
+			fclose(f);
+			return;
+		}
+		fclose(f);
+		curmap = mm;
+	}
+	else {
+		printf("\nMagnification map not found !");
+	}
+}
+
+//////////////////////////////
+//////////////////////////////
+////////Persistent result cache
+//////////////////////////////
+//////////////////////////////
+
+// The cache file is an open-addressing hash table of finite-source magnifications calculated by BinaryMagDark:
+// 8 characters "VBBMC2", the number of slots (64-bit integer) padded to 64 bytes, then the slots.
+// A slot holds the bit patterns of all inputs, including accuracy goals and limb darkening settings, and the results.
+// The file is memory-mapped as shared (read into memory on Windows), so that all processes opening it 
+// read and extend the same table. Slots are claimed by atomic compare-and-swap and results are only taken 
+// from complete slots whose checksum matches, so that slots being overwritten by other processes are ignored.
+// A slot claimed by a writer that died (e.g. a killed process) is taken over after MCSTALE seconds.
+
+static const char magcacheheader[8] = { 'V','B','B','M','C','2',0,0 };
+#define MCPROBES 8 // Slots examined for each key
+#define MCSTALE 60 // Seconds after which a slot still being written is considered abandoned
+
+// State of a slot claimed now, shared by processes through the system clock
+static inline unsigned int magcacheclaim(void) {
+	unsigned long long t = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	return (unsigned int)(2 * (t & 0x7fffffff) + 1);
+}
+
+static inline bool magcachestale(unsigned int st, unsigned int now) {
+	return (st & 1) && ((now >> 1) - (st >> 1)) % 0x80000000u > MCSTALE;
+}
+
+static inline unsigned long long magcachemix(unsigned long long x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static unsigned int magcachecheck(const unsigned long long *key, const double *res) {
+	unsigned long long h = 0, w;
+	for (int i = 0; i < MCKEY; i++) h = magcachemix(h ^ key[i]);
+	for (int i = 0; i < 5; i++) {
+		memcpy(&w, res + i, sizeof(w));
+		h = magcachemix(h ^ w);
+	}
+	return (unsigned int)(h ^ (h >> 32));
+}
+
+bool VBBinaryLensing::OpenMagCache(char *filename, int nslots) {
+	FILE *f;
+	char *map, head[64];
+	size_t size;
+	long long ns;
+	magcache *mc;
+
+	CloseMagCache();
+	// A new file is created exclusively, so that processes starting together do not overwrite each other;
+	// the others wait until it has been completed
+	if (nslots > 0 && (f = fopen(filename, "wbx")) != 0) {
+		ns = nslots;
+		memset(head, 0, 64);
+		memcpy(head + 8, &ns, sizeof(ns));
+		fseek(f, 64 + sizeof(magcacheentry) * ns - 1, SEEK_SET);
+		fputc(0, f);
+		fflush(f);
+		fseek(f, 0, SEEK_SET);
+		memcpy(head, magcacheheader, 8);
+		fwrite(head, 1, 64, f);
+		fclose(f);
+	}
+	for (int attempt = 0; ; attempt++) {
+		map = 0;
+		size = 0;
+		if ((f = fopen(filename, "r+b")) != 0) {
+			fseek(f, 0, SEEK_END);
+			size = ftell(f);
+			if (size >= 64) {
+#ifdef _WIN32
+				map = (char *)malloc(size);
+				fseek(f, 0, SEEK_SET);
+				if (map && fread(map, 1, size, f) != size) {
+					free(map);
+					map = 0;
+				}
+#else
+				map = (char *)::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(f), 0);
+				if (map == (char *)MAP_FAILED) map = 0;
+#endif
+			}
+			fclose(f);
+		}
+		if (map) {
+			memcpy(&ns, map + 8, sizeof(ns));
+			if (memcmp(map, magcacheheader, 8) == 0 && ns > 0 && size == 64 + sizeof(magcacheentry) * ns) break;
+#ifdef _WIN32
+			free(map);
+#else
+			munmap(map, size);
 #endif
+		}
+		if (!f || attempt == 100) {
+			printf("\nInvalid result cache %s !", filename);
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
 
-			Mag += (scan->bin*scan->bin*scan->Mag - cb*cb*scan->prev->Mag)*(scan->cum - scan->prev->cum) / (scan->bin*scan->bin - scan->prev->bin*scan->prev->bin);
-			Mag += (cb*cb*scan->prev->Mag - scan->prev->prev->bin*scan->prev->prev->bin*scan->prev->prev->Mag)*(scan->prev->cum - scan->prev->prev->cum) / (scan->prev->bin*scan->prev->bin - scan->prev->prev->bin*scan->prev->prev->bin);
-                        if(astrometry){
-				LDastrox1 += ( scan->bin*scan->bin*scan->LDastrox1 - cb*cb*scan->prev->LDastrox1)*(scan->cum - scan->prev->cum) / (scan->bin*scan->bin - scan->prev->bin*scan->prev->bin);
-				LDastrox1 += ( cb*cb*scan->prev->LDastrox1 - scan->prev->prev->bin*scan->prev->prev->bin*scan->prev->prev->LDastrox1)*(scan->prev->cum - scan->prev->prev->cum) / (scan->prev->bin*scan->prev->bin - scan->prev->prev->bin*scan->prev->prev->bin);
-				 
-			}
-			currerr += scan->err + scan->prev->err;
+	mc = new magcache;
+	mc->map = map;
+	mc->size = size;
+	mc->nslots = ns;
+	mc->entries = (magcacheentry *)(map + 64);
+	mc->filename = (char *)malloc(strlen(filename) + 1);
+	strcpy(mc->filename, filename);
+	mc->refs = 1;
+	mcache = mc;
+	magcachehits = magcachemisses = 0;
+	return true;
+}
 
-			if (fabs(Magold - Mag) * 2<Tolv) {
-				flag++;
-			}
-			else {
-				flag = 0;
-				nannold = nannuli;
+void VBBinaryLensing::CloseMagCache(void) {
+	FILE *f;
+
+	if (mcache && --mcache->refs == 0) {
+#ifdef _WIN32
+		// Without shared mappings, the table is written back on closing
+		if ((f = fopen(mcache->filename, "r+b")) != 0) {
+			fwrite(mcache->map, 1, mcache->size, f);
+			fclose(f);
+		}
+		free(mcache->map);
+#else
+		(void)f;
+		munmap(mcache->map, mcache->size);
+#endif
+		free(mcache->filename);
+		delete mcache;
+	}
+	mcache = 0;
+}
+
+void VBBinaryLensing::ClearMagCache(void) {
+	if (mcache) {
+		for (long long i = 0; i < mcache->nslots; i++) mcache->entries[i].state.store(0);
+	}
+	magcachehits = magcachemisses = 0;
+}
+
+void VBBinaryLensing::MagCacheKey(double s, double q, double y1, double y2, double rho, double accuracy, unsigned long long *key) {
+	// Tol is not included, since BinaryMagDark replaces it by accuracy
+	double in[MCKEY - 1] = { s, q, y1, y2, rho, accuracy, RelTol, a1, a2 };
+	unsigned long long set, w;
+
+	// Other settings changing the result
+	set = magcachemix(1 + curLDprofile + 8 * (astrometry + 2 * (unsigned long long)minannuli));
+	if (curLDprofile == LDuser) {
+		for (int i = 0; i <= npLD; i++) {
+			memcpy(&w, LDtab + i, sizeof(w));
+			set = magcachemix(set ^ w);
+		}
+	}
+	key[0] = set;
+	memcpy(key + 1, in, sizeof(in));
+}
+
+bool VBBinaryLensing::MagCacheGet(unsigned long long *key, double *Mag) {
+	magcacheentry *e;
+	unsigned long long h = 0, ekey[MCKEY];
+	double res[5];
+	unsigned int st;
+
+	for (int i = 0; i < MCKEY; i++) h = magcachemix(h ^ key[i]);
+	for (int ip = 0; ip < MCPROBES; ip++) {
+		e = mcache->entries + (h + ip) % mcache->nslots;
+		st = e->state.load(std::memory_order_acquire);
+		if (st == 0) break;
+		if (st == 2) {
+			memcpy(ekey, e->key, sizeof(ekey));
+			memcpy(res, e->res, sizeof(res));
+			if (memcmp(ekey, key, sizeof(ekey)) == 0 && magcachecheck(ekey, res) == e->check) {
+				*Mag = res[0];
+				astrox1 = res[1];
+				astrox2 = res[2];
+				therr = res[3];
+				NPS = (int)res[4];
+				magcachehits++;
+				return true;
 			}
+		}
+	}
+	magcachemisses++;
+	return false;
+}
 
+void VBBinaryLensing::MagCachePut(unsigned long long *key, double Mag) {
+	magcacheentry *e = 0;
+	unsigned long long h = 0;
+	double res[5] = { Mag, astrox1, astrox2, therr, (double)NPS };
+	unsigned int st, claim = magcacheclaim();
+
+	for (int i = 0; i < MCKEY; i++) h = magcachemix(h ^ key[i]);
+	for (int ip = 0; ip < MCPROBES && !e; ip++) {
+		e = mcache->entries + (h + ip) % mcache->nslots;
+		st = 0;
+		if (!e->state.compare_exchange_strong(st, claim)) {
+			if (st == 2 && memcmp(e->key, key, sizeof(e->key)) == 0) return;
+			// Abandoned slots are claimed as empty ones
+			if (!(magcachestale(st, claim) && e->state.compare_exchange_strong(st, claim))) e = 0;
 		}
+	}
+	if (!e) {
+		// All slots for this key are taken: the first one is replaced
+		e = mcache->entries + h % mcache->nslots;
+		st = 2;
+		if (!e->state.compare_exchange_strong(st, claim)) return;
+	}
+	memcpy(e->key, key, sizeof(e->key));
+	memcpy(e->res, res, sizeof(res));
+	e->check = magcachecheck(key, res);
+	e->state.store(2, std::memory_order_release);
+}
 
-		while (first) {
-			scan = first->next;
-			delete first;
-			first = scan;
+//////////////////////////////
+//////////////////////////////
+////////Orbit propagation kernels
+//////////////////////////////
+//////////////////////////////
+
+// Light curves with orbital motion propagate the orbit over the whole time array
+// before the magnification pass. Angles are reduced to |r|<=pi/4 in three parts (Cody-Waite)
+// and sin and cos are evaluated by the Cephes polynomials, which are accurate to 1.e-16.
+
+static const double sincof[] = { 1.58962301576546568060E-10, -2.50507477628578072866E-8, 2.75573136213857245213E-6,
+	-1.98412698295895385996E-4, 8.33333333332211858878E-3, -1.66666666666666307295E-1 };
+static const double coscof[] = { -1.13585365213876817300E-11, 2.08757008419747316778E-9, -2.75573141792967388112E-7,
+	2.48015872888517045348E-5, -1.38888888888730564116E-3, 4.16666666666665929218E-2 };
+static const double pio2dp1 = 1.57079625129699707031, pio2dp2 = 7.54978941586159635336E-8, pio2dp3 = 5.39030285815811905290E-15;
+
+static void KeplerSolve(double e, double *Ms, double *cosE, double *sinE, int i0, int np) {
+	double M, EE, dE, dM;
+	for (int i = i0; i < np; i++) {
+		M = Ms[i];
+		EE = M + e*sin(M);
+		dE = 1;
+		while (fabs(dE) > 1.e-8) {
+			dM = M - (EE - e*sin(EE));
+			dE = dM / (1 - e*cos(EE));
+			EE += dE;
 		}
+		cosE[i] = cos(EE);
+		sinE[i] = sin(EE);
+	}
+}
 
-		Tolv /= 10;
-		c++;
+static void SinCos(double *x, double *c, double *s, int i0, int np) {
+	for (int i = i0; i < np; i++) {
+		c[i] = cos(x[i]);
+		s[i] = sin(x[i]);
 	}
-	therr = currerr;
-        if(astrometry){
-		LDastrox1/=Mag;
-		astrox1=LDastrox1;
-		 
-    }
-	return Mag;
+}
+
+#ifdef _VBB_AVX2
+_VBB_AVX2 static inline void SinCosAVX2(__m256d x, __m256d *c, __m256d *s) {
+	const __m256d twoopi = _mm256_set1_pd(2 / M_PI), half = _mm256_set1_pd(0.5), one = _mm256_set1_pd(1.), quarter = _mm256_set1_pd(0.25);
+	const __m256d four = _mm256_set1_pd(4.), onehalf = _mm256_set1_pd(1.5), two = _mm256_set1_pd(2.), signbit = _mm256_set1_pd(-0.);
+	__m256d n, r, z, ps, pc, q, swap;
+	n = _mm256_round_pd(_mm256_mul_pd(x, twoopi), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	r = _mm256_sub_pd(x, _mm256_mul_pd(n, _mm256_set1_pd(pio2dp1)));
+	r = _mm256_sub_pd(r, _mm256_mul_pd(n, _mm256_set1_pd(pio2dp2)));
+	r = _mm256_sub_pd(r, _mm256_mul_pd(n, _mm256_set1_pd(pio2dp3)));
+	z = _mm256_mul_pd(r, r);
+	ps = _mm256_set1_pd(sincof[0]);
+	pc = _mm256_set1_pd(coscof[0]);
+	for (int k = 1; k < 6; k++) {
+		ps = _mm256_add_pd(_mm256_mul_pd(ps, z), _mm256_set1_pd(sincof[k]));
+		pc = _mm256_add_pd(_mm256_mul_pd(pc, z), _mm256_set1_pd(coscof[k]));
+	}
+	ps = _mm256_add_pd(r, _mm256_mul_pd(_mm256_mul_pd(r, z), ps));
+	pc = _mm256_add_pd(_mm256_sub_pd(one, _mm256_mul_pd(half, z)), _mm256_mul_pd(_mm256_mul_pd(z, z), pc));
+	// Quadrant q = n mod 4: odd quadrants swap sin and cos, sin is negative for q=2,3 and cos for q=1,2
+	q = _mm256_sub_pd(n, _mm256_mul_pd(four, _mm256_floor_pd(_mm256_mul_pd(n, quarter))));
+	swap = _mm256_cmp_pd(_mm256_sub_pd(q, _mm256_mul_pd(two, _mm256_floor_pd(_mm256_mul_pd(q, half)))), one, _CMP_EQ_OQ);
+	*s = _mm256_xor_pd(_mm256_blendv_pd(ps, pc, swap), _mm256_and_pd(_mm256_cmp_pd(q, onehalf, _CMP_GT_OQ), signbit));
+	*c = _mm256_xor_pd(_mm256_blendv_pd(pc, ps, swap), _mm256_and_pd(_mm256_cmp_pd(_mm256_andnot_pd(signbit, _mm256_sub_pd(q, onehalf)), one, _CMP_LT_OQ), signbit));
+}
+
+_VBB_AVX2 static int SinCosArrayAVX2(double *x, double *c, double *s, int np) {
+	__m256d vc, vs;
+	int i;
+	for (i = 0; i + 4 <= np; i += 4) {
+		SinCosAVX2(_mm256_loadu_pd(x + i), &vc, &vs);
+		_mm256_storeu_pd(c + i, vc);
+		_mm256_storeu_pd(s + i, vs);
+	}
+	return i;
+}
+
+// Kepler's equation E - e sin(E) = M is solved by three Halley steps from the starting guess
+// E0 = M + e sin(M)/(1 - sin(M+e) + sin(M)) (Danby 1988) and a final Newton correction.
+// Only orbits with e>0.99 close to the periastron need more steps,
+// which are left to the Newton iteration of KeplerSolve.
+static const int keplersteps = 3;
+static const double keplertol = 1.e-6;
+
+_VBB_AVX2 static int KeplerSolveAVX2(double e, double *Ms, double *cosE, double *sinE, int np) {
+	const __m256d ve = _mm256_set1_pd(e), one = _mm256_set1_pd(1.), half = _mm256_set1_pd(0.5), zero = _mm256_setzero_pd();
+	const __m256d twopi = _mm256_set1_pd(2 * M_PI), itwopi = _mm256_set1_pd(0.5 / M_PI), pi = _mm256_set1_pd(M_PI);
+	const __m256d signbit = _mm256_set1_pd(-0.), tol = _mm256_set1_pd(keplertol);
+	__m256d M, sgn, EE, c, s, c1, f, fp, dE;
+	int i, bad;
+	for (i = 0; i + 4 <= np; i += 4) {
+		M = _mm256_loadu_pd(Ms + i);
+		M = _mm256_sub_pd(M, _mm256_mul_pd(_mm256_floor_pd(_mm256_add_pd(_mm256_mul_pd(M, itwopi), half)), twopi));
+		sgn = _mm256_and_pd(M, signbit);
+		M = _mm256_andnot_pd(signbit, M);
+		SinCosAVX2(M, &c, &s);
+		SinCosAVX2(_mm256_add_pd(M, ve), &c1, &f);
+		EE = _mm256_add_pd(M, _mm256_div_pd(_mm256_mul_pd(ve, s), _mm256_add_pd(_mm256_sub_pd(one, f), s)));
+		for (int k = 0; k < keplersteps; k++) {
+			SinCosAVX2(EE, &c, &s);
+			f = _mm256_sub_pd(_mm256_sub_pd(EE, _mm256_mul_pd(ve, s)), M);
+			fp = _mm256_sub_pd(one, _mm256_mul_pd(ve, c));
+			EE = _mm256_sub_pd(EE, _mm256_div_pd(f, _mm256_sub_pd(fp, _mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(half, f), _mm256_mul_pd(ve, s)), fp))));
+			EE = _mm256_min_pd(_mm256_max_pd(EE, zero), pi);
+		}
+		SinCosAVX2(EE, &c, &s);
+		dE = _mm256_div_pd(_mm256_sub_pd(_mm256_sub_pd(EE, _mm256_mul_pd(ve, s)), M), _mm256_sub_pd(one, _mm256_mul_pd(ve, c)));
+		_mm256_storeu_pd(cosE + i, _mm256_add_pd(c, _mm256_mul_pd(s, dE)));
+		_mm256_storeu_pd(sinE + i, _mm256_xor_pd(_mm256_sub_pd(s, _mm256_mul_pd(c, dE)), sgn));
+		bad = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_andnot_pd(signbit, dE), tol, _CMP_NLT_UQ));
+		for (int l = 0; l < 4; l++) {
+			if (bad & (1 << l)) KeplerSolve(e, Ms, cosE, sinE, i + l, i + l + 1);
+		}
+	}
+	return i;
+}
+#endif
+
+static void SinCosArray(double *x, double *c, double *s, int np) {
+	int i0 = 0;
+#ifdef _VBB_AVX2
+	if (__builtin_cpu_supports("avx2")) i0 = SinCosArrayAVX2(x, c, s, np);
+#endif
+	SinCos(x, c, s, i0, np);
+}
+
+static void KeplerSolveArray(double e, double *Ms, double *cosE, double *sinE, int np) {
+	int i0 = 0;
+#ifdef _VBB_AVX2
+	if (__builtin_cpu_supports("avx2")) i0 = KeplerSolveAVX2(e, Ms, cosE, sinE, np);
+#endif
+	KeplerSolve(e, Ms, cosE, sinE, i0, np);
 }
 
 //////////////////////////////
@@ -1582,9 +4531,9 @@ void VBBinaryLensing::PSPLLightCurve(double *pr, double *ts, double *mags, doubl
 
 		y1s[i] = -tn;
 		y2s[i] = -u0;
-		mags[i]= (u + 2) / sqrt(u*(u + 4));
-
+		mags[i] = u;
 	}
+	PSPLMagU2Array(mags, mags, np);
 }
 
 
@@ -1601,41 +4550,45 @@ void VBBinaryLensing::PSPLLightCurveParallax(double *pr, double *ts, double *mag
 
 		y1s[i] = -tn;
 		y2s[i] = -u1;
-		mags[i] = (u + 2) / sqrt(u*(u + 4));
+		mags[i] = u;
 	}
+	PSPLMagU2Array(mags, mags, np);
 
 }
 
 
 void VBBinaryLensing::ESPLLightCurve(double *pr, double *ts, double *mags, double *y1s, double *y2s, int np) {
-	double u0 = exp(pr[0]), t0 = pr[2], tE_inv = exp(-pr[1]), tn, u,rho=exp(pr[3]);
+	double u0 = exp(pr[0]), t0 = pr[2], tE_inv = exp(-pr[1]), tn, *u,rho=exp(pr[3]);
 
+	u = (double *)malloc(sizeof(double)*np);
 	for (int i = 0; i < np; i++) {
 		tn = (ts[i] - t0) *tE_inv;
-		u = sqrt(tn*tn + u0*u0);
+		u[i] = sqrt(tn*tn + u0*u0);
 
 		y1s[i] = -tn;
 		y2s[i] = -u0;
-		mags[i] = ESPLMag2(u,rho);
-
 	}
+	ESPLMag2(u, rho, mags, np);
+	free(u);
 }
 
 void VBBinaryLensing::ESPLLightCurveParallax(double *pr, double *ts, double *mags, double *y1s, double *y2s, int np) {
-	double u0 = pr[0], t0 = pr[2], tE_inv = exp(-pr[1]), tn, u, u1, rho = exp(pr[3]), pai1 = pr[4], pai2 = pr[5];
+	double u0 = pr[0], t0 = pr[2], tE_inv = exp(-pr[1]), tn, *u, u1, rho = exp(pr[3]), pai1 = pr[4], pai2 = pr[5];
 	double Et[2];
 	t0old = 0;
 
+	u = (double *)malloc(sizeof(double)*np);
 	for (int i = 0; i < np; i++) {
 		ComputeParallax(ts[i], t0, Et);
 		tn = (ts[i] - t0) * tE_inv + pai1*Et[0] + pai2*Et[1];
 		u1 = u0 + pai1*Et[1] - pai2*Et[0];
-		u = sqrt( tn*tn + u1*u1);
+		u[i] = sqrt( tn*tn + u1*u1);
 
 		y1s[i] = -tn;
 		y2s[i] = -u1;
-		mags[i] = ESPLMag2(u, rho);
 	}
+	ESPLMag2(u, rho, mags, np);
+	free(u);
 
 }
 
@@ -1650,7 +4603,6 @@ void VBBinaryLensing::BinaryLightCurve(double *pr, double *ts, double *mags, dou
 		tn = (ts[i] - pr[6]) * tE_inv;
 		y1s[i] = pr[2] * salpha - tn*calpha;
 		y2s[i] = -pr[2] * calpha - tn*salpha;
-		mags[i] = BinaryMag2(s, q, y1s[i], y2s[i], rho);
 
 		//Mag=BinaryMag(s, q, y1s[i], y2s[i], rho, Tol,&Images); // For debugging
 		//delete Images;
@@ -1659,6 +4611,7 @@ void VBBinaryLensing::BinaryLightCurve(double *pr, double *ts, double *mags, dou
 		//	printf("\n%lf %lf %lf", y1s[i], y2s[i], mags[i]);
 		//}
 	}
+	BinaryMag2Parallel(s, 0, q, y1s, y2s, rho, mags, np, ts);
 }
 
 
@@ -1675,8 +4628,8 @@ void VBBinaryLensing::BinaryLightCurveW(double *pr, double *ts, double *mags, do
 		tn = (ts[i] - t0) * tE_inv;
 		y1s[i] = u0 * salpha - tn*calpha;
 		y2s[i] = -u0 * calpha - tn*salpha;
-		mags[i] = BinaryMag2(s, q, y1s[i], y2s[i], rho);
 	}
+	BinaryMag2Parallel(s, 0, q, y1s, y2s, rho, mags, np, ts);
 }
 
 
@@ -1692,16 +4645,16 @@ void VBBinaryLensing::BinaryLightCurveParallax(double *pr, double *ts, double *m
 		u = u0 + pai1*Et[1] - pai2*Et[0];
 		y1s[i] = u * salpha - tn*calpha;
 		y2s[i] = -u * calpha - tn*salpha;
-		mags[i] = BinaryMag2(s, q, y1s[i], y2s[i], rho);
 	}
+	BinaryMag2Parallel(s, 0, q, y1s, y2s, rho, mags, np, ts);
 }	
 
 
 void VBBinaryLensing::BinaryLightCurveOrbital(double *pr, double *ts, double *mags, double *y1s, double *y2s, double *seps, int np) {
 	double s = exp(pr[0]), q = exp(pr[1]), u0 = pr[2], rho = exp(pr[4]), tn, tE_inv = exp(-pr[5]), t0 = pr[6], pai1 = pr[7], pai2 = pr[8], w1 = pr[9], w2 = pr[10], w3 = pr[11];
 	double salpha = sin(pr[3]), calpha = cos(pr[3]);
-	double Et[2];
-	double w, phi0, inc, phi, Cinc, Sinc, Cphi, Sphi, Cphi0, Sphi0, COm, SOm,s_true;
+	double *Et, *Ets, *phis, *Cphis, *Sphis;
+	double w, phi0, inc, Cinc, Cphi, Sphi, Cphi0, Sphi0, COm, SOm,s_true;
 	double w13, w123, den, den0, u;
 	t0old = 0;
 
@@ -1722,18 +4675,25 @@ void VBBinaryLensing::BinaryLightCurveOrbital(double *pr, double *ts, double *ma
 	Cphi0 = cos(phi0);
 	Sphi0 = sin(phi0);
 	Cinc = cos(inc);
-	Sinc = sin(inc);
 	den0 = sqrt(Cphi0*Cphi0 + Cinc*Cinc*Sphi0*Sphi0);
 	s_true = s / den0; // orbital radius
 	COm = (Cphi0*calpha + Cinc*salpha*Sphi0) / den0;
 	SOm = (Cphi0*salpha - Cinc*calpha*Sphi0) / den0;
 
+	// The orbit is propagated over the whole time array before the magnification pass
+	Ets = (double *)malloc(sizeof(double) * 5 * np);
+	phis = Ets + 2 * np;
+	Cphis = phis + np;
+	Sphis = Cphis + np;
 	for (int i = 0; i < np; i++) {
-		ComputeParallax(ts[i], t0, Et);
-
-		phi = (ts[i] - t0_par)*w + phi0;
-		Cphi = cos(phi);
-		Sphi = sin(phi);
+		ComputeParallax(ts[i], t0, Ets + 2 * i);
+		phis[i] = (ts[i] - t0_par)*w + phi0;
+	}
+	SinCosArray(phis, Cphis, Sphis, np);
+	for (int i = 0; i < np; i++) {
+		Et = Ets + 2 * i;
+		Cphi = Cphis[i];
+		Sphi = Sphis[i];
 		den = sqrt(Cphi*Cphi + Cinc*Cinc*Sphi*Sphi);
 		seps[i] = s_true*den; // projected separation at time ts[i]
 
@@ -1741,16 +4701,17 @@ void VBBinaryLensing::BinaryLightCurveOrbital(double *pr, double *ts, double *ma
 		tn = (ts[i] - t0) * tE_inv + pai1*Et[0] + pai2*Et[1];
 		y1s[i] = (Cphi*(u*SOm - tn*COm) + Cinc*Sphi*(u*COm + tn*SOm)) / den;
 		y2s[i] = (-Cphi*(u*COm + tn*SOm) - Cinc*Sphi*(tn*COm - u*SOm)) / den;
-		mags[i] = BinaryMag2(seps[i], q, y1s[i], y2s[i], rho);
 	}
+	free(Ets);
+	BinaryMag2Parallel(s, seps, q, y1s, y2s, rho, mags, np, ts);
 }
 
 
 void VBBinaryLensing::BinaryLightCurveKepler(double *pr, double *ts, double *mags, double *y1s, double *y2s, double *seps, int np) {
 	double s = exp(pr[0]), q = exp(pr[1]), u0 = pr[2], alpha = pr[3], rho = exp(pr[4]), tn, tE_inv = exp(-pr[5]), t0 = pr[6], pai1 = pr[7], pai2 = pr[8], w1 = pr[9], w2 = pr[10], w3 = pr[11], szs = pr[12], ar = pr[13]+1.e-8;
-	double Et[2];
-	double u, w22, w11, w33, w12, w23, szs2, ar2, EE, dE;
-	double wt2, smix, sqsmix, e, h, snu, co1EE0, co2EE0,cosE,sinE, co1tperi, tperi, EE0, M, a, St, psi, dM, conu, n;
+	double Et[2], *Ms, *cosEs, *sinEs;
+	double u, w22, w11, w33, w12, w23, szs2, ar2;
+	double wt2, smix, sqsmix, e, h, snu, co1EE0, co2EE0,cosE,sinE, co1tperi, tperi, EE0, a, St, conu, n, sqe, calpha, salpha, ca, sa;
 	double arm1, arm2;
 	double X[3], Y[3], Z[3],r[2],x[2];
 	t0old = 0;
@@ -1808,34 +4769,40 @@ void VBBinaryLensing::BinaryLightCurveKepler(double *pr, double *ts, double *mag
 	//coX2 = (-1 + 2 * ar)*w1*w23 + szs2 * w1*((-1 + ar)*w12 - ar * w33) + szs * w3*((2 - 3 * ar)*w11 + ar * w23);
 	//coY1 = -(-1 + 2 * ar)*w2*(w1 + szs * w3);
 	//coY2 = w2 * (-szs2 * w12 + 2 * szs*w1*w3 - w23 + ar * (-4 * szs*w1*w3 + szs2 * (w12 - w33) + (-w11 + w23)));
+	a = ar * s*sqrt(smix);
+	sqe = sqrt(1 - e * e);
+	calpha = cos(alpha);
+	salpha = sin(alpha);
+
+	// The orbit is propagated over the whole time array before the magnification pass:
+	// y1s and y2s hold tn and u until the source positions are computed
+	Ms = (double *)malloc(sizeof(double) * 3 * np);
+	cosEs = Ms + np;
+	sinEs = cosEs + np;
 	for (int i = 0; i < np; i++) {
 		ComputeParallax(ts[i], t0, Et);
-		M = n * (ts[i] - tperi);
-		EE = M + e * sin(M);
-		dE = 1;
-		while (fabs(dE) > 1.e-8) {
-			dM = M - (EE - e * sin(EE));
-			dE = dM / (1 - e * cos(EE));
-			EE += dE;
-		}
-
-		a = ar * s*sqrt(smix);
-
-		r[0] = a * (cos(EE) - e);
-		r[1] = a * sqrt(1 - e * e)*sin(EE);
+		Ms[i] = n * (ts[i] - tperi);
+		y1s[i] = (ts[i] - t0) * tE_inv + pai1 * Et[0] + pai2 * Et[1];
+		y2s[i] = u0 + pai1 * Et[1] - pai2 * Et[0];
+	}
+	KeplerSolveArray(e, Ms, cosEs, sinEs, np);
+	for (int i = 0; i < np; i++) {
+		r[0] = a * (cosEs[i] - e);
+		r[1] = a * sqe * sinEs[i];
 		x[0] = r[0] * X[0] + r[1] * Y[0];  // (coX1*x[1] + coX2 * y[1] / h) / coX;
 		x[1] = r[0] * X[1] + r[1] * Y[1];   //(coY1*x[1] + y[1] * coY2 / h) / coX;
 		St = sqrt(x[0] * x[0] + x[1] * x[1]);
-		psi = atan2(x[1], x[0]);// +((ar > 1) ? 0 : M_PI);
-		u = u0 + pai1 * Et[1] - pai2 * Et[0];
-		tn = (ts[i] - t0) * tE_inv + pai1 * Et[0] + pai2 * Et[1];
-		y1s[i] = -tn * cos(alpha + psi) + u * sin(alpha + psi);
-		y2s[i] = -u * cos(alpha + psi) - tn * sin(alpha + psi);
+		// cos and sin of alpha + psi, where psi = atan2(x[1], x[0]) is the position angle of the lens axis
+		ca = (x[0] * calpha - x[1] * salpha) / St;
+		sa = (x[1] * calpha + x[0] * salpha) / St;
+		tn = y1s[i];
+		u = y2s[i];
+		y1s[i] = -tn * ca + u * sa;
+		y2s[i] = -u * ca - tn * sa;
 		seps[i] = St;
-
-		mags[i] = BinaryMag2(seps[i], q, y1s[i], y2s[i], rho);
-
 	}
+	free(Ms);
+	BinaryMag2Parallel(s, seps, q, y1s, y2s, rho, mags, np, ts);
 }
 
 void VBBinaryLensing::BinSourceLightCurve(double *pr, double *ts, double *mags, double *y1s, double *y2s, int np) {
@@ -1861,7 +4828,7 @@ void VBBinaryLensing::BinSourceLightCurve(double *pr, double *ts, double *mags,
 
 
 void VBBinaryLensing::BinSourceLightCurveParallax(double *pr, double *ts, double *mags, double *y1s, double *y2s, int np) {
-	double u1 = pr[2], u2 = pr[3], t01 = pr[4], t02 = pr[5], tE_inv = exp(-pr[0]), FR = exp(pr[1]), tn, u, u0, pai1 = pr[6], pai2 = pr[7], w1 = pr[8], w2 = pr[9], w3 = pr[10];
+	double u1 = pr[2], u2 = pr[3], t01 = pr[4], t02 = pr[5], tE_inv = exp(-pr[0]), FR = exp(pr[1]), tn, u, u0, pai1 = pr[6], pai2 = pr[7];
 	double Et[2];
 	t0old = 0;
 
@@ -1889,8 +4856,8 @@ void VBBinaryLensing::BinSourceLightCurveParallax(double *pr, double *ts, double
 void VBBinaryLensing::BinSourceLightCurveXallarap(double *pr, double *ts, double *mags, double *y1s, double *y2s,double *seps, int np) {
 	double u1 = pr[2], u2 = pr[3], t01 = pr[4], t02 = pr[5], tE_inv = exp(-pr[0]), FR = exp(pr[1]), tn, u, u0, pai1 = pr[6], pai2 = pr[7], q = pr[8], w1 = pr[9], w2 = pr[10], w3 = pr[11];
 	double th,Cth,Sth;
-	double Et[2];
-	double s,s_true,w, phi0, inc, phi, Cinc, Sinc, Cphi, Sphi, Cphi0, Sphi0, COm, SOm;
+	double *Et, *Ets, *phis, *Cphis, *Sphis;
+	double s,s_true,w, phi0, inc, Cinc, Cphi, Sphi, Cphi0, Sphi0, COm, SOm;
 	double w13, w123, den, den0,du0,dt0;
 	t0old = 0;
 
@@ -1918,19 +4885,26 @@ void VBBinaryLensing::BinSourceLightCurveXallarap(double *pr, double *ts, double
 	Cphi0 = cos(phi0);
 	Sphi0 = sin(phi0);
 	Cinc = cos(inc);
-	Sinc = sin(inc);
 	den0 = sqrt(Cphi0*Cphi0 + Cinc*Cinc*Sphi0*Sphi0);
 	s_true = s / den0;
 	COm = (Cphi0*Cth + Cinc*Sth*Sphi0) / den0;
 	SOm = (Cphi0*Sth - Cinc*Cth*Sphi0) / den0;
 
 
+	// The orbit is propagated over the whole time array before the magnification pass
+	Ets = (double *)malloc(sizeof(double) * 5 * np);
+	phis = Ets + 2 * np;
+	Cphis = phis + np;
+	Sphis = Cphis + np;
 	for (int i = 0; i < np; i++) {
-		ComputeParallax(ts[i], t0, Et);
-
-		phi = (ts[i] - t0_par)*w + phi0;
-		Cphi = cos(phi);
-		Sphi = sin(phi);
+		ComputeParallax(ts[i], t0, Ets + 2 * i);
+		phis[i] = (ts[i] - t0_par)*w + phi0;
+	}
+	SinCosArray(phis, Cphis, Sphis, np);
+	for (int i = 0; i < np; i++) {
+		Et = Ets + 2 * i;
+		Cphi = Cphis[i];
+		Sphi = Sphis[i];
 		den = sqrt(Cphi*Cphi + Cinc*Cinc*Sphi*Sphi);
 		seps[i] = s_true*den;
 
@@ -1952,6 +4926,7 @@ void VBBinaryLensing::BinSourceLightCurveXallarap(double *pr, double *ts, double
 		mags[i] += FR*(u + 2) / sqrt(u*(u + 4));
 		mags[i] /= (1 + FR);
 	}
+	free(Ets);
 }
 
 
@@ -2022,7 +4997,7 @@ void VBBinaryLensing::BinSourceBinLensXallarap(double* pr, double* ts, double* m
 }
 
 void VBBinaryLensing::BinSourceSingleLensXallarap(double* pr, double* ts, double* mags, double* y1s, double* y2s, double* y1s2, double* y2s2, int np) {
-	double  t0 = pr[1], rho = exp(pr[3]), tn, tE_inv = exp(-pr[2]), u0;
+	double rho = exp(pr[3]), tn, tE_inv = exp(-pr[2]), u0;
 	double  xi1 = pr[4], xi2 = pr[5], omega = pr[6], inc = pr[7], phi = pr[8], qs = exp(pr[9]);
 
 	double Xal[2], phit, disp[2], Xal2[2], disp2[2];
@@ -2184,7 +5159,7 @@ double VBBinaryLensing::BinaryLightCurveOrbital(double *pr, double t) {
 	double s = exp(pr[0]), q = exp(pr[1]), u0 = pr[2], rho = exp(pr[4]), tn, tE_inv = exp(-pr[5]), t0 = pr[6], pai1 = pr[7], pai2 = pr[8], w1 = pr[9], w2 = pr[10], w3 = pr[11];
 	double salpha = sin(pr[3]), calpha = cos(pr[3]);
 	double Et[2];
-	double w, phi0, inc, phi, Cinc, Sinc, Cphi, Sphi, Cphi0, Sphi0, COm, SOm, s_true;
+	double w, phi0, inc, phi, Cinc, Cphi, Sphi, Cphi0, Sphi0, COm, SOm, s_true;
 	double w13, w123, den, den0, u;
 
 	w13 = w1*w1 + w3*w3;
@@ -2205,7 +5180,6 @@ double VBBinaryLensing::BinaryLightCurveOrbital(double *pr, double t) {
 	Cphi0 = cos(phi0);
 	Sphi0 = sin(phi0);
 	Cinc = cos(inc);
-	Sinc = sin(inc);
 	den0 = sqrt(Cphi0*Cphi0 + Cinc*Cinc*Sphi0*Sphi0);
 	s_true = s / den0;
 	COm = (Cphi0*calpha + Cinc*salpha*Sphi0) / den0;
@@ -2389,7 +5363,7 @@ double VBBinaryLensing::BinSourceLightCurve(double *pr, double t) {
 }
 
 double VBBinaryLensing::BinSourceLightCurveParallax(double *pr, double t) {
-	double u1 = pr[2], u2 = pr[3], t01 = pr[4], t02 = pr[5], tE_inv = exp(-pr[0]), FR = exp(pr[1]), tn, u, u0, pai1 = pr[6], pai2 = pr[7], w1 = pr[8], w2 = pr[9], w3 = pr[10];
+	double u1 = pr[2], u2 = pr[3], t01 = pr[4], t02 = pr[5], tE_inv = exp(-pr[0]), FR = exp(pr[1]), tn, u, u0, pai1 = pr[6], pai2 = pr[7];
 	double Et[2],mag;
 
 	ComputeParallax(t, t0, Et);
@@ -2417,7 +5391,7 @@ double VBBinaryLensing::BinSourceLightCurveXallarap(double *pr, double t) {
 	double u1 = pr[2], u2 = pr[3], t01 = pr[4], t02 = pr[5], tE_inv = exp(-pr[0]), FR = exp(pr[1]), tn, u, u0, pai1 = pr[6], pai2 = pr[7], q = pr[8], w1 = pr[9], w2 = pr[10], w3 = pr[11];
 	double th, Cth, Sth;
 	double Et[2],mag;
-	double s, s_true, w, phi0, inc, phi, Cinc, Sinc, Cphi, Sphi, Cphi0, Sphi0, COm, SOm;
+	double s, s_true, w, phi0, inc, phi, Cinc, Cphi, Sphi, Cphi0, Sphi0, COm, SOm;
 	double w13, w123, den, den0, du0, dt0;
 
 	s = sqrt((u1 - u2)*(u1 - u2) + (t01 - t02)*(t01 - t02) * (tE_inv*tE_inv));
@@ -2444,7 +5418,6 @@ double VBBinaryLensing::BinSourceLightCurveXallarap(double *pr, double t) {
 	Cphi0 = cos(phi0);
 	Sphi0 = sin(phi0);
 	Cinc = cos(inc);
-	Sinc = sin(inc);
 	den0 = sqrt(Cphi0*Cphi0 + Cinc*Cinc*Sphi0*Sphi0);
 	s_true = s / den0;
 	COm = (Cphi0*Cth + Cinc*Sth*Sphi0) / den0;
@@ -2554,7 +5527,7 @@ double VBBinaryLensing::BinSourceBinLensXallarap(double* pr, double t) {
 
 double VBBinaryLensing::BinSourceSingleLensXallarap(double* pr, double t) {
 
-	double  t0 = pr[1], rho = exp(pr[3]), tn, tE_inv = exp(-pr[2]), u0;
+	double rho = exp(pr[3]), tn, tE_inv = exp(-pr[2]), u0;
 	double  xi1 = pr[4], xi2 = pr[5], omega = pr[6], inc = pr[7], phi = pr[8], qs = exp(pr[9]);
 
 	double Xal[2], phit, disp[2], Xal2[2], disp2[2];
@@ -2604,7 +5577,7 @@ double VBBinaryLensing::BinSourceBinLensPOX(double* pr, double t) {
 	double pai1 = pr[7], pai2 = pr[8], w1 = pr[9], w2 = pr[10], w3 = pr[11];
 	double salpha = sin(pr[3]), calpha = cos(pr[3]);
 	double Et[2];
-	double tn, w, phi0, phil, incl, Cinc, Sinc, Cphi, Sphi, Cphi0, Sphi0, COm, SOm, s_true;
+	double tn, w, phi0, phil, incl, Cinc, Cphi, Sphi, Cphi0, Sphi0, COm, SOm, s_true;
 	double w13, w123, den, den0, u;
 
 	double xi1 = pr[12], xi2 = pr[13], omega = pr[14], inc = pr[15], phi = pr[16], qs = exp(pr[17]);
@@ -2629,7 +5602,6 @@ double VBBinaryLensing::BinSourceBinLensPOX(double* pr, double t) {
 	Cphi0 = cos(phi0);
 	Sphi0 = sin(phi0);
 	Cinc = cos(incl);
-	Sinc = sin(incl);
 	den0 = sqrt(Cphi0 * Cphi0 + Cinc * Cinc * Sphi0 * Sphi0);
 	s_true = s / den0;
 	COm = (Cphi0 * calpha + Cinc * salpha * Sphi0) / den0;
@@ -2731,44 +5703,26 @@ double VBBinaryLensing::BinSourceBinLensPOX(double* pr, double t) {
 	
 
 _curve* VBBinaryLensing::NewImages(complex yi, complex* coefs, _theta* theta) {
-	static complex  y, yc, z, zc, J1, J1c, dy, dz, dJ, J2, J3, dza, za2, zb2, zaltc, Jalt, Jaltc, JJalt2;
-	static complex zr[5] = { 0.,0.,0.,0.,0. };
-	static double dlmin = 1.0e-4, dlmax = 1.0e-3, good[5], dJ2, ob2, cq;
-	static int worst1, worst2, worst3, bad, f1, checkJac;
-	static double av = 0.0, m1v = 0.0, disim, disisso;
-	static _curve* Prov;
-	static _point* scan, * prin, * fifth, * left, * right, * center;
-
-#ifdef _PRINT_TIMES
-	static double tim0, tim1;
-#endif
-
+	complex  y, yc, z, zc, J1, J1c, dy, dz, dJ, J2, J3, dza, za2, zb2, zaltc, Jalt, Jaltc, JJalt2;
+	const double dlmin = 1.0e-4, dlmax = 1.0e-3;
+	double good[5], dJ2, ob2, cq;
+	int worst1, worst2, worst3, bad, f1, checkJac;
+	_curve* Prov;
+	_point* scan, * prin, * fifth, * left, * right, * center;
+
+	stats.newimages++;
 	y = yi + coefs[11];
 	yc = conj(y);
 
 	// coefs[6]=a*a; coefs[7]=a*a*a; coefs[8]=m2*m2; coefs[9]=a*a*m2*m2; coefs[10]=a*m2; coefs[11]=a*m1; coefs[20]=a; coefs[21]=m1; coefs[22]=m2;
 
-	coefs[0] = coefs[9] * y;
-	coefs[1] = coefs[10] * (coefs[20] * (coefs[21] + y * (2 * yc - coefs[20])) - 2 * y);
-	coefs[2] = y * (1 - coefs[7] * yc) - coefs[20] * (coefs[21] + 2 * y * yc * (1 + coefs[22])) + coefs[6] * (yc * (coefs[21] - coefs[22]) + y * (1 + coefs[22] + yc * yc));
-	coefs[3] = 2 * y * yc + coefs[7] * yc + coefs[6] * (yc * (2 * y - yc) - coefs[21]) - coefs[20] * (y + 2 * yc * (yc * y - coefs[22]));
-	coefs[4] = yc * (2 * coefs[20] + y);
-	coefs[4] = yc * (coefs[4] - 1) - coefs[20] * (coefs[4] - coefs[21]);
-	coefs[5] = yc * (coefs[20] - yc);
+	_LensPolynomial(coefs)
 
 	bad = 1;
-	disim = -1.;
 	f1 = 0;
 
-#ifdef _PRINT_TIMES
-	tim0 = Environment::TickCount;
-#endif
 	cmplx_roots_gen(zr, coefs, 5, true, true);
 
-#ifdef _PRINT_TIMES
-	tim1 = Environment::TickCount;
-	inc += tim1 - tim0;
-#endif
 	// apply lens equation to check if it is really solved
 	for (int i = 0; i < 5; i++) {
 		z = zr[i];
@@ -2955,17 +5909,17 @@ _curve* VBBinaryLensing::NewImages(complex yi, complex* coefs, _theta* theta) {
 }
 
 void VBBinaryLensing::OrderImages(_sols *Sols, _curve *Newpts) {
-	static double A[5][5];
-	static _curve *cprec[5];
-	static _curve *cpres[5];
-	static _curve *cfoll[5];
-	static _point *scan, *scan2, *scan3, *isso[2];
-	static _curve *scurve, *scurve2;
+	double A[5][5];
+	_curve *cprec[5];
+	_curve *cpres[5];
+	_curve *cfoll[5];
+	_point *scan, *scan2, *isso[2] = { 0, 0 };
+	_curve *scurve, *scurve2;
 
 	_theta *theta;
-	static double th, mi, cmp, cmp2,cmp_2,dx2,avgx2,avgx1,avg2x1,pref,d2x2,dx1,d2x1,avgwedgex1,avgwedgex2,parab1,parab2;
+	double th, mi, cmp, cmp2,cmp_2,dx2,avgx2,avgx1,avg2x1,pref,d2x2,dx1,d2x1,avgwedgex1,avgwedgex2,parab1,parab2;
         
-	int nprec = 0, npres, nfoll = 0, issoc[2], ij;
+	int nprec = 0, npres, nfoll = 0, issoc[2] = { 0, 0 }, ij;
 
 	theta = Newpts->first->theta;
 	th = theta->th;
@@ -3007,11 +5961,24 @@ void VBBinaryLensing::OrderImages(_sols *Sols, _curve *Newpts) {
 			}
 			else {
 				// immagine coinvolta al centro   
-				scan = scurve->last;
-				while (scan->theta->th>th) {
-					scan = scan->prev;
+				// Points are ordered in theta: we walk from the closest end and keep count of the position
+				if (th - scurve->first->theta->th < scurve->last->theta->th - th) {
+					scan = scurve->first;
+					ij = 1;
+					while (scan->next && scan->next->theta->th <= th) {
+						scan = scan->next;
+						ij++;
+					}
+				}
+				else {
+					scan = scurve->last;
+					ij = scurve->length;
+					while (scan->theta->th>th) {
+						scan = scan->prev;
+						ij--;
+					}
 				}
-				cfoll[nfoll] = scurve->divide(scan);
+				cfoll[nfoll] = scurve->divide(scan, ij);
 				nfoll++;
 				cprec[nprec] = scurve;
 				nprec++;
@@ -3563,7 +6530,7 @@ void VBBinaryLensing::OrderImages(_sols *Sols, _curve *Newpts) {
 					A[i][j] = A[i + 1][j];
 				}
 			}
-			for (int j = issoc[1]; j<npres; j++) {
+			for (int j = issoc[1]; j<npres && j<4; j++) { // npres<5, made explicit for the compiler
 				cfoll[j] = cfoll[j + 1];
 				for (int i = 0; i<npres; i++) {
 					A[i][j] = A[i][j + 1];
@@ -3584,6 +6551,84 @@ void VBBinaryLensing::OrderImages(_sols *Sols, _curve *Newpts) {
 
 }
 
+//////////////////////////////
+//////////////////////////////
+////////Node pools for _point, _curve, _theta and _sols
+//////////////////////////////
+//////////////////////////////
+
+// The contour integration creates and destroys a huge number of small list nodes.
+// Freed nodes are kept in a free list owned by the current thread and recycled by the next allocations.
+// Memory is taken from the system in chunks and never returned: when a thread terminates,
+// its free list is passed to a shared spare list from which new threads start.
+
+#define _poolchunk 256
+#define _poolalign 64
+
+template <class T> class _nodepool {
+	union _node {
+		_node *next;
+		alignas(_poolalign) char data[(sizeof(T) + _poolalign - 1) / _poolalign * _poolalign];
+	};
+	static std::atomic_flag sparelock;
+	static _node *spare;
+	_node *free;
+	static void lock(void) { while (sparelock.test_and_set(std::memory_order_acquire)); }
+	static void unlock(void) { sparelock.clear(std::memory_order_release); }
+public:
+	_nodepool(void) { free = 0; }
+	~_nodepool(void) {
+		_node *last;
+		if (!free) return;
+		for (last = free; last->next; last = last->next);
+		lock();
+		last->next = spare;
+		spare = free;
+		unlock();
+	}
+	void *get(void) {
+		_node *n;
+		if (!free) {
+			lock();
+			free = spare;
+			spare = 0;
+			unlock();
+			if (!free) {
+				char *chunk = (char *)malloc(sizeof(_node)*_poolchunk + _poolalign);
+				if (!chunk) throw std::bad_alloc();
+				free = (_node *)(chunk + _poolalign - (size_t)chunk % _poolalign);
+				for (int i = 0; i < _poolchunk - 1; i++) free[i].next = free + i + 1;
+				free[_poolchunk - 1].next = 0;
+			}
+		}
+		n = free;
+		free = n->next;
+		return n;
+	}
+	void put(void *p) {
+		_node *n = (_node *)p;
+		n->next = free;
+		free = n;
+	}
+};
+
+template <class T> std::atomic_flag _nodepool<T>::sparelock = ATOMIC_FLAG_INIT;
+template <class T> typename _nodepool<T>::_node *_nodepool<T>::spare = 0;
+
+template <class T> static _nodepool<T> &nodepool(void) {
+	static thread_local _nodepool<T> pool;
+	return pool;
+}
+
+void *_point::operator new(size_t) { return nodepool<_point>().get(); }
+void _point::operator delete(void *p) { if (p) nodepool<_point>().put(p); }
+void *_curve::operator new(size_t) { return nodepool<_curve>().get(); }
+void _curve::operator delete(void *p) { if (p) nodepool<_curve>().put(p); }
+void *_theta::operator new(size_t) { return nodepool<_theta>().get(); }
+void _theta::operator delete(void *p) { if (p) nodepool<_theta>().put(p); }
+void *_sols::operator new(size_t) { return nodepool<_sols>().get(); }
+void _sols::operator delete(void *p) { if (p) nodepool<_sols>().put(p); }
+
 //////////////////////////////
 //////////////////////////////
 ////////_point methods
@@ -3632,11 +6677,17 @@ _curve::~_curve(void) {
 
 _curve *_curve::divide(_point *ref) {
 	_point *scan;
-	_curve *nc;
 	int l1;
 
 	l1 = 1;
 	for (scan = first; scan != ref; scan = scan->next) l1++;
+	return divide(ref, l1);
+}
+
+// Same as above when the position l1 of ref in the curve is already known
+_curve *_curve::divide(_point *ref, int l1) {
+	_curve *nc;
+
 	nc = new _curve();
 	nc->first = ref->next;
 	nc->first->prev = 0;
@@ -4018,140 +7069,13 @@ void _thetas::remove(_theta* stheta) {
 //////////////////////////////
 
 
-complex::complex(double a, double b) {
-	re = a;
-	im = b;
-}
-
-complex::complex(double a) {
-	re = a;
-	im = 0;
-}
-
-complex::complex(void) {
-	re = 0;
-	im = 0;
-}
-
-double abs(complex z) {
-	return sqrt(z.re*z.re + z.im*z.im);
-}
-
-complex conj(complex z) {
-	return complex(z.re, -z.im);
-}
+// Elementary operations are defined inline in the header
 
 complex sqrt(complex z) {
 	double md = sqrt(z.re*z.re + z.im*z.im);
 	return (md>0) ? complex((sqrt((md + z.re) / 2)*((z.im>0) ? 1 : -1)), sqrt((md - z.re) / 2)) : 0.0;
 }
 
-double real(complex z) {
-	return z.re;
-}
-
-double imag(complex z) {
-	return z.im;
-}
-
-complex operator+(complex p1, complex p2) {
-	return complex(p1.re + p2.re, p1.im + p2.im);
-}
-
-complex operator-(complex p1, complex p2) {
-	return complex(p1.re - p2.re, p1.im - p2.im);
-}
-
-complex operator*(complex p1, complex p2) {
-	return complex(p1.re*p2.re - p1.im*p2.im, p1.re*p2.im + p1.im*p2.re);
-}
-
-complex operator/(complex p1, complex p2) {
-	double md = p2.re*p2.re + p2.im*p2.im;
-	return complex((p1.re*p2.re + p1.im*p2.im) / md, (p1.im*p2.re - p1.re*p2.im) / md);
-}
-
-complex operator+(complex z, double a) {
-	return complex(z.re + a, z.im);
-}
-
-complex operator-(complex z, double a) {
-	return complex(z.re - a, z.im);
-}
-
-complex operator*(complex z, double a) {
-	return complex(z.re*a, z.im*a);
-}
-
-complex operator/(complex z, double a) {
-	return complex(z.re / a, z.im / a);
-}
-
-complex operator+(double a, complex z) {
-	return complex(z.re + a, z.im);
-}
-
-complex operator-(double a, complex z) {
-	return complex(a - z.re, -z.im);
-}
-
-complex operator*(double a, complex z) {
-	return complex(a*z.re, a*z.im);
-}
-
-complex operator/(double a, complex z) {
-	double md = z.re*z.re + z.im*z.im;
-	return complex(a*z.re / md, -a*z.im / md);
-}
-
-
-complex operator+(complex z, int a) {
-	return complex(z.re + a, z.im);
-}
-
-complex operator-(complex z, int a) {
-	return complex(z.re - a, z.im);
-}
-
-complex operator*(complex z, int a) {
-	return complex(z.re*a, z.im*a);
-}
-
-complex operator/(complex z, int a) {
-	return complex(z.re / a, z.im / a);
-}
-
-complex operator+(int a, complex z) {
-	return complex(z.re + a, z.im);
-}
-
-complex operator-(int a, complex z) {
-	return complex(a - z.re, -z.im);
-}
-
-complex operator*(int a, complex z) {
-	return complex(a*z.re, a*z.im);
-}
-
-complex operator/(int a, complex z) {
-	double md = z.re*z.re + z.im*z.im;
-	return complex(a*z.re / md, -a*z.im / md);
-}
-
-complex operator-(complex z) {
-	return complex(-z.re, -z.im);
-}
-
-bool operator==(complex p1, complex p2) {
-	if (p1.re == p2.re && p1.im == p2.im) return true;
-	return false;
-}
-
-bool operator!=(complex p1, complex p2) {
-	if (p1.re == p2.re && p1.im == p2.im) return false;
-	return true;
-}
-
 complex expcmplx(complex p1) {
 	double r = exp(p1.re);
 	double theta = atan2(p1.im, p1.re);
@@ -4200,7 +7124,7 @@ void VBBinaryLensing::cmplx_roots_gen(complex *roots, complex *poly, int degree,
 	//
 
 	complex poly2[MAXM];
-	static int i, j, n, iter;
+	int i, j, n, iter = 0;
 	bool success;
 	complex coef, prev;
 
@@ -4220,9 +7144,11 @@ void VBBinaryLensing::cmplx_roots_gen(complex *roots, complex *poly, int degree,
 
 	for (n = degree; n >= 3; n--) {
 		cmplx_laguerre2newton(poly2, n, &roots[n - 1], iter, success, 2);
+		stats.rootiterations += iter;
 		if (!success) {
 			roots[n - 1] = complex(0, 0);
 			cmplx_laguerre(poly2, n, &roots[n - 1], iter, success);
+			stats.rootiterations += iter;
 		}
 
 		// Divide by root
@@ -4250,6 +7176,7 @@ void VBBinaryLensing::cmplx_roots_gen(complex *roots, complex *poly, int degree,
 	if (polish_roots_after) {
 		for (n = 0; n < degree; n++) {
 			cmplx_newton_spec(poly, degree, &roots[n], iter, success); // Polish roots with full polynomial
+			stats.rootiterations += iter;
 		}
 	}
 
@@ -4357,7 +7284,7 @@ void VBBinaryLensing::cmplx_laguerre(complex *poly, int degree, complex *root, i
 	//For a summary of the method go to :
 	//http://en.wikipedia.org/wiki/Laguerre's_method
 	//
-	static int FRAC_JUMP_EVERY = 10;
+	const int FRAC_JUMP_EVERY = 10;
 	const int FRAC_JUMP_LEN = 10;
 	double FRAC_JUMPS[FRAC_JUMP_LEN] = { 0.64109297,
 		0.91577881, 0.25921289, 0.50487203,
@@ -4367,7 +7294,7 @@ void VBBinaryLensing::cmplx_laguerre(complex *poly, int degree, complex *root, i
 	double faq; //jump length
 	double FRAC_ERR = 2.0e-15; //Fractional Error for double precision
 	complex p, dp, d2p_half; //value of polynomial, 1st derivative, and 2nd derivative
-	static int i, j, k;
+	int i, j, k;
 	bool good_to_go;
 	complex denom, denom_sqrt, dx, newroot;
 	double ek, absroot, abs2p;
@@ -4984,3 +7911,108 @@ void VBBinaryLensing::cmplx_laguerre2newton(complex *poly, int degree, complex *
 	}/// end of infinite loop
 }
 
+
+//////////////////////////////
+//////////////////////////////
+////////Batched root finder
+//////////////////////////////
+//////////////////////////////
+
+void VBBinaryLensing::cmplx_roots_batch(double *rre, double *rim, double *pre, double *pim, int degree, int n) {
+	// Finds all roots of n <= MB polynomials at once.
+	// Layout is one lane per polynomial: coefficient k of polynomial l is (pre[k*MB+l], pim[k*MB+l]),
+	// root k of polynomial l is (rre[k*MB+l], rim[k*MB+l]), which on input contains the starting point.
+	// All roots are refined simultaneously by the Aberth-Ehrlich method, i.e. Newton's method 
+	// with implicit deflation: the contributions of the other roots are subtracted from p'/p
+	// instead of dividing the polynomial. No square roots are needed and all loops run over 
+	// the MB lanes, so that the compiler can vectorize them.
+	// Lanes that do not converge are solved again by cmplx_roots_gen.
+	double r0re[MAXM * MB], r0im[MAXM * MB];
+	double pr[MB], pi[MB], dr[MB], di[MB], sr[MB], si[MB], err[MB];
+	int conv[MB], nconv, iter, k, j, m, l;
+	complex roots[MAXM], poly[MAXM];
+
+	// Unused lanes repeat the last polynomial
+	for (l = n; l < MB; l++) {
+		for (k = 0; k <= degree; k++) {
+			pre[k * MB + l] = pre[k * MB + n - 1];
+			pim[k * MB + l] = pim[k * MB + n - 1];
+		}
+		for (k = 0; k < degree; k++) {
+			rre[k * MB + l] = rre[k * MB + n - 1];
+			rim[k * MB + l] = rim[k * MB + n - 1];
+		}
+	}
+	memcpy(r0re, rre, sizeof(double) * degree * MB);
+	memcpy(r0im, rim, sizeof(double) * degree * MB);
+	for (l = 0; l < MB; l++) conv[l] = (l >= n);
+	nconv = 0;
+	for (iter = 0; iter < MAXIT && nconv < n; iter++) {
+		for (l = 0; l < MB; l++) err[l] = 0;
+		for (k = 0; k < degree; k++) {
+			double *zkr = rre + k * MB, *zki = rim + k * MB;
+			// p and p' by Horner's scheme
+			for (l = 0; l < MB; l++) {
+				pr[l] = pre[degree * MB + l];
+				pi[l] = pim[degree * MB + l];
+				dr[l] = di[l] = 0;
+			}
+			for (m = degree - 1; m >= 0; m--) {
+				for (l = 0; l < MB; l++) {
+					double x = zkr[l], y = zki[l], t;
+					t = dr[l] * x - di[l] * y + pr[l];
+					di[l] = dr[l] * y + di[l] * x + pi[l];
+					dr[l] = t;
+					t = pr[l] * x - pi[l] * y + pre[m * MB + l];
+					pi[l] = pr[l] * y + pi[l] * x + pim[m * MB + l];
+					pr[l] = t;
+				}
+			}
+			// Sum of 1/(z_k-z_j) over the other roots
+			for (l = 0; l < MB; l++) sr[l] = si[l] = 0;
+			for (j = 0; j < degree; j++) {
+				if (j == k) continue;
+				for (l = 0; l < MB; l++) {
+					double wr = zkr[l] - rre[j * MB + l], wi = zki[l] - rim[j * MB + l], w2 = 1 / (wr * wr + wi * wi);
+					sr[l] += wr * w2;
+					si[l] -= wi * w2;
+				}
+			}
+			// Step 1/(p'/p - sum), roots of converged lanes stay where they are
+			for (l = 0; l < MB; l++) {
+				double p2 = 1 / (pr[l] * pr[l] + pi[l] * pi[l]);
+				double gr = (dr[l] * pr[l] + di[l] * pi[l]) * p2 - sr[l], gi = (di[l] * pr[l] - dr[l] * pi[l]) * p2 - si[l];
+				double g2 = 1 / (gr * gr + gi * gi);
+				bool move = (conv[l] == 0) && (pr[l] != 0 || pi[l] != 0);
+				double stepr = move ? gr * g2 : 0., stepi = move ? -gi * g2 : 0.;
+				zkr[l] -= stepr;
+				zki[l] -= stepi;
+				double e = (stepr * stepr + stepi * stepi) / (zkr[l] * zkr[l] + zki[l] * zki[l] + 1.e-100);
+				err[l] = (e > err[l] || e != e) ? e : err[l];
+			}
+		}
+		// The convergence is of third order: after a relative step below 1.e-6 the error is at the level of round-off
+		for (l = 0; l < n; l++) {
+			if (conv[l] == 0 && err[l] < 1.e-12) {
+				conv[l] = 1;
+				nconv++;
+			}
+		}
+	}
+
+	stats.rootiterations += iter * n;
+
+	// Fallback for the lanes that did not converge
+	if (nconv < n) {
+		for (l = 0; l < n; l++) {
+			if (conv[l]) continue;
+			for (k = 0; k <= degree; k++) poly[k] = complex(pre[k * MB + l], pim[k * MB + l]);
+			for (k = 0; k < degree; k++) roots[k] = complex(r0re[k * MB + l], r0im[k * MB + l]);
+			cmplx_roots_gen(roots, poly, degree, true, true);
+			for (k = 0; k < degree; k++) {
+				rre[k * MB + l] = roots[k].re;
+				rim[k * MB + l] = roots[k].im;
+			}
+		}
+	}
+}
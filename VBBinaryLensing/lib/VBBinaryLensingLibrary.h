@@ -27,6 +27,14 @@
 #define _L1 x1-((x1+a/2.0)/((x1+a/2.0)*(x1+a/2.0)+x2*x2)+q*(x1-a/2.0)/((x1-a/2.0)*(x1-a/2.0)+x2*x2))/(1.0+q) // Used in PlotCrits
 #define _L2 x2-(x2/((x1+a/2.0)*(x1+a/2.0)+x2*x2)+q*x2/((x1-a/2.0)*(x1-a/2.0)+x2*x2))/(1.0+q)
 #define _LL (y-z)+coefs[21]/(zc-coefs[20])+coefs[22]/zc //Lens equation test
+#define _LensPolynomial(p) \
+	p[0] = coefs[9] * y;\
+	p[1] = coefs[10] * (coefs[20] * (coefs[21] + y * (2 * yc - coefs[20])) - 2 * y);\
+	p[2] = y * (1 - coefs[7] * yc) - coefs[20] * (coefs[21] + 2 * y * yc * (1 + coefs[22])) + coefs[6] * (yc * (coefs[21] - coefs[22]) + y * (1 + coefs[22] + yc * yc));\
+	p[3] = 2 * y * yc + coefs[7] * yc + coefs[6] * (yc * (2 * y - yc) - coefs[21]) - coefs[20] * (y + 2 * yc * (yc * y - coefs[22]));\
+	p[4] = yc * (2 * coefs[20] + y);\
+	p[4] = yc * (p[4] - 1) - coefs[20] * (p[4] - coefs[21]);\
+	p[5] = yc * (coefs[20] - yc); // Coefficients of the fifth-order polynomial for the source position y
 #define _J1c coefs[21]/((zc-coefs[20])*(zc-coefs[20]))+coefs[22]/(zc*zc) //#define _J1 m1/((zc-0.5*a)*(zc-0.5*a))+m2/((zc+0.5*a)*(zc+0.5*a))
 #define _J2 -2.0*(coefs[21]/((z-coefs[20])*(z-coefs[20])*(z-coefs[20]))+coefs[22]/(z*z*z))
 #define _J3 6.0*(coefs[21]/((z-coefs[20])*(z-coefs[20])*(z-coefs[20])*(z-coefs[20]))+coefs[22]/(z*z*z*z))
@@ -38,12 +46,156 @@
 #define _sign(x) ((x>0)? +1 : -1)
 
 #include<stdio.h>
+#include<math.h>
 
 class _curve;
 class _sols;
 class _theta;
-class complex;
 struct annulus;
+struct lensentry;
+struct causticboxes;
+struct magmap;
+struct magcache;
+struct espltable;
+struct gpubackend;
+struct lcstream;
+
+class complex{
+public:
+	double re;
+	double im;
+	constexpr complex(double a, double b) : re(a), im(b) {}
+	constexpr complex(double a) : re(a), im(0) {}
+	constexpr complex(void) : re(0), im(0) {}
+};
+
+// Elementary complex operations are inline, so that they cost no function calls in the hot loops
+
+inline double abs(complex z) {
+	return sqrt(z.re*z.re + z.im*z.im);
+}
+
+inline complex conj(complex z) {
+	return complex(z.re, -z.im);
+}
+
+inline double real(complex z) {
+	return z.re;
+}
+
+inline double imag(complex z) {
+	return z.im;
+}
+
+inline complex operator+(complex p1, complex p2) {
+	return complex(p1.re + p2.re, p1.im + p2.im);
+}
+
+inline complex operator-(complex p1, complex p2) {
+	return complex(p1.re - p2.re, p1.im - p2.im);
+}
+
+inline complex operator*(complex p1, complex p2) {
+	return complex(p1.re*p2.re - p1.im*p2.im, p1.re*p2.im + p1.im*p2.re);
+}
+
+inline complex operator/(complex p1, complex p2) {
+	double md = p2.re*p2.re + p2.im*p2.im;
+	return complex((p1.re*p2.re + p1.im*p2.im) / md, (p1.im*p2.re - p1.re*p2.im) / md);
+}
+
+inline complex operator+(complex z, double a) {
+	return complex(z.re + a, z.im);
+}
+
+inline complex operator-(complex z, double a) {
+	return complex(z.re - a, z.im);
+}
+
+inline complex operator*(complex z, double a) {
+	return complex(z.re*a, z.im*a);
+}
+
+inline complex operator/(complex z, double a) {
+	return complex(z.re / a, z.im / a);
+}
+
+inline complex operator+(double a, complex z) {
+	return complex(z.re + a, z.im);
+}
+
+inline complex operator-(double a, complex z) {
+	return complex(a - z.re, -z.im);
+}
+
+inline complex operator*(double a, complex z) {
+	return complex(a*z.re, a*z.im);
+}
+
+inline complex operator/(double a, complex z) {
+	double md = z.re*z.re + z.im*z.im;
+	return complex(a*z.re / md, -a*z.im / md);
+}
+
+inline complex operator+(complex z, int a) {
+	return complex(z.re + a, z.im);
+}
+
+inline complex operator-(complex z, int a) {
+	return complex(z.re - a, z.im);
+}
+
+inline complex operator*(complex z, int a) {
+	return complex(z.re*a, z.im*a);
+}
+
+inline complex operator/(complex z, int a) {
+	return complex(z.re / a, z.im / a);
+}
+
+inline complex operator+(int a, complex z) {
+	return complex(z.re + a, z.im);
+}
+
+inline complex operator-(int a, complex z) {
+	return complex(a - z.re, -z.im);
+}
+
+inline complex operator*(int a, complex z) {
+	return complex(a*z.re, a*z.im);
+}
+
+inline complex operator/(int a, complex z) {
+	double md = z.re*z.re + z.im*z.im;
+	return complex(a*z.re / md, -a*z.im / md);
+}
+
+inline complex operator-(complex z) {
+	return complex(-z.re, -z.im);
+}
+
+inline bool operator==(complex p1, complex p2) {
+	return p1.re == p2.re && p1.im == p2.im;
+}
+
+inline bool operator!=(complex p1, complex p2) {
+	return p1.re != p2.re || p1.im != p2.im;
+}
+
+// Cost counters of the magnification calculations, accumulated until ResetStats
+struct _stats {
+	long long newimages; // Calls to NewImages (one lens equation solution each)
+	long long rootiterations; // Iterations of the polynomial root finders
+	long long thetas; // Points inserted on source boundaries by BinaryMag
+	long long annuli; // Annuli calculated by BinaryMagDark and ESPLMagDark
+	long long fallbacks; // Failed contour integrations repeated by BinaryMagSafe with slightly different radii
+	long long shortcuts; // Point-source calculations in BinaryMag2
+	long long finitesource; // Finite-source calculations in BinaryMag2
+	long long budgetstops; // Calculations of BinaryMag and BinaryMagDark stopped by maxNPS, maxannuli or maxtime
+	double tcontour; // Time in BinaryMag (seconds)
+	double tdark; // Time in BinaryMagDark, including contours (seconds)
+	double tlightcurve; // Time in binary lens light curves and array versions of BinaryMag2 (seconds)
+};
 
 #ifndef __unmanaged
 namespace VBBinaryLensingLibrary {
@@ -55,59 +207,152 @@ namespace VBBinaryLensingLibrary {
 	{
 	protected:
 		int *ndatasat;
-		double **tsat,***possat;
+		double **tsat,**possat;
+		char *satmap;
+		size_t satmapsize;
 		double Mag0, corrquad, corrquad2, safedist;
 		int nim0;
-		double e,phi,phip,phi0,Om,inc,t0,d3,v3,GM,flagits;
+		double e,phi,phip,phi0,Om,inc,t0,d3,v3,flagits;
 		double Obj[3],rad[3],tang[3],t0old;
 		double Eq2000[3],Quad2000[3],North2000[3];
-		double ESPLout[__rsize][__zsize], ESPLin[__rsize][__zsize],ESPLoutastro[__rsize][__zsize], ESPLinastro[__rsize][__zsize];
+		espltable *espl;
 		double *LDtab,*rCLDtab,*CLDtab;
 		double scr2, sscr2;
 		int npLD;
-		bool ESPLoff, multidark;
+		bool multidark;
 		annulus *annlist;
+		complex coefs0[24], coefs[24], zr[5];
+		double sv0, qv0, sv, qv;
+		double Et0[2], vt0[2];
+		double *tposcache, *poscache;
+		int nposcache, iposcache, satposcache;
+		lensentry *lenscache;
+		int nlenscache, lenscachesize;
+		unsigned long lensclock;
+		magmap *curmap;
+		magcache *mcache;
+		gpubackend *gpu;
+		lcstream *stream;
+		double budgetend;
+		int budgetNPS;
+		bool budgetopen, budgetout;
 
 		void ComputeParallax(double, double, double *);
+		void ReadSatelliteTables(char *Directory_for_satellite_tables);
+		bool LoadSatelliteTables(char *filename);
+		void FreeSatelliteTables(void);
+		void FreeESPLTable(void);
+		void ObserverPosition(double t, double *Ear, double *Sat);
+		bool ParallaxPrepared(double *ts, int np);
+		lensentry *LensEntry(double s, double q);
+		_sols *ComputeCrit(double a, double q);
+		causticboxes *CausticBoxes(double s, double q);
+		void FreeCausticBoxes(causticboxes *cb);
+		bool FarFromCaustics(causticboxes *cb, double y1, double y2, double dist);
+		double CausticSafeDistance(double rho);
+		bool BinaryMag2Indexed(double s, double q, double *y1s, double *y2s, double rho, double *mags, int np);
+		bool MagMapServes(double s, double q, double rho);
+		void MagCacheKey(double s, double q, double y1, double y2, double rho, double accuracy, unsigned long long *key);
+		bool MagCacheGet(unsigned long long *key, double *Mag);
+		void MagCachePut(unsigned long long *key, double Mag);
 		double LDprofile(double r);
+		double CLDprofile(double r);
 		double rCLDprofile(double tc,annulus *,annulus *);
 		double BinaryMagSafe(double s, double q, double y1, double y2, double rho, _sols **images);
+		int ParallelAnnuli(double s, double q, double rho, annulus *first, int nsplit, int *totNPS);
 		_curve *NewImages(complex,complex  *,_theta *);
 		void OrderImages(_sols *,_curve *);
 		void cmplx_laguerre(complex *, int, complex *, int &, bool &);
 		void cmplx_newton_spec(complex *, int, complex *, int &, bool &);
 		void cmplx_laguerre2newton(complex *, int, complex *, int &, bool &, int);
+		void cmplx_roots_batch(double *, double *, double *, double *, int, int);
 		void solve_quadratic_eq(complex &, complex &, complex *);
 		void solve_cubic_eq(complex &, complex &, complex &, complex *);
+		template <class Job> void ParallelRun(int n, int chunk, Job job);
+		void AddStats(_stats &worker, _stats &start);
+		bool BudgetOpen(double tim0);
+		bool BudgetExhausted(int nps, int nann);
+		void BudgetClose(bool own);
+		bool LightCurveBatchGPU(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, int), double *parameters_matrix, int nparameters, int nmodels, double *t_array, double *mag_matrix, int np);
+		void StreamRun(double *parameters, int i0, int np, double *mag_array);
+		void BinaryMag2Parallel(double s, double *seps, double q, double *y1s, double *y2s, double rho, double *mags, int np, double *ts);
+		bool BinaryMag2Adaptive(double s, double *seps, double q, double *y1s, double *y2s, double rho, double *mags, int np, double *ts);
+		void BinaryMag2MultiBand(double s, double q, double y1, double y2, double rho, double *mags, int stride);
+		double BinaryMag0Grad(double s, double q, double y1, double y2, double *grad);
+		double BinaryMag2Grad(double s, double q, double y1, double y2, double rho, double *grad);
+		double ESPLMag2Grad(double u, double rho, double *grad);
+		template <class Curve> void LightCurveGradientRun(int kind, bool parallax, int npr, Curve curve, double *pr, double *ts, double *mags, double *grads, double *y1s, double *y2s, double *seps, int np);
 
 	public: 
 
-		double Tol, RelTol, a1,a2, t0_par;
+		double Tol, RelTol, a1,a2, t0_par, InterpolationTol;
 		double mass_radius_exponent, mass_luminosity_exponent;
-		bool astrometry;
+		bool astrometry, causticindex;
+		bool parallelannuli; // Annuli of BinaryMagDark calculated nthreads at a time
 		int satellite,parallaxsystem,t0_par_fixed,nsat;
-		int minannuli,nannuli,NPS,NPcrit;
+		int minannuli,nannuli,NPS,NPcrit,nthreads;
+		int maxNPS, maxannuli; // Budget of a finite-source magnification in points on the contours and annuli (0 for no limit)
+		double maxtime; // Budget in seconds (0 for no limit)
 		double y_1,y_2,av, therr,astrox1,astrox2;
+		int lenscachehits, lenscachemisses;
+		long long magcachehits, magcachemisses;
+		_stats stats;
 
 
+	// Resets the cost counters in stats
+		void ResetStats(void);
+
 	// Critical curves and caustic calculation
 		_sols *PlotCrit(double a,double q);
+	// Same curves in flat arrays, with curve k made of the points offsets[k] ... offsets[k+1]-1. Critical curves come first, followed by their caustics 
+	// in the same order. Returns the number of curves (at most 6, so that offsets needs 7 elements). The arrays need room for at least 8*NPcrit points,
+	// further points up to maxpoints are added around the cusps.
+		int PlotCrit(double s, double q, double *x1_array, double *x2_array, int *offsets, int maxpoints);
 		void PrintCau(double a,double q,double y1, double y2, double rho);
 
+	// Cache of lens-dependent quantities (critical curves and caustic boxes) for the last (s,q) pairs
+		void SetLensCacheSize(int size);
+		int LensCacheLength(void);
+		void ClearLensCache(void);
+
 	// Initialization for calculations including parallax
 		void SetObjectCoordinates(char *Coordinates_file, char *Directory_for_satellite_tables);
 		void SetObjectCoordinates(char *CoordinateString);
+		void ConvertSatelliteTables(char *Directory_for_satellite_tables);
+	// Precalculation of the observer positions for a given array of times, used by all parallax calculations at these times
+		void PrepareParallax(double *t_array, int np);
 
 	// Magnification calculation functions.
 
 		double BinaryMag0(double s,double q,double y1,double y2, _sols **Images);
 		double BinaryMag0(double s, double q, double y1, double y2);
+		void BinaryMag0(double s, double q, double *y1_array, double *y2_array, double *mag_array, int np);
+		void BinaryMag0(double s, double q, double *y1_array, double *y2_array, double *mag_array, double *astrox1_array, double *astrox2_array, int np);
 		double BinaryMag(double s,double q,double y1,double y2,double rho,double accuracy, _sols **Images);
 		double BinaryMag(double s,double q ,double y1,double y2,double rho,double accuracy);
 		double BinaryMag2(double s, double q, double y1, double y2, double rho);
+	// Same for arrays of source positions, calculated on nthreads threads. The versions with astrox1_array and astrox2_array also return the centroids.
+		void BinaryMag2(double s, double q, double *y1_array, double *y2_array, double rho, double *mag_array, int np);
+		void BinaryMag2(double s, double q, double *y1_array, double *y2_array, double rho, double *mag_array, double *astrox1_array, double *astrox2_array, int np);
 		double BinaryMagDark(double s, double q, double y1, double y2, double rho,double accuracy);
 		void BinaryMagMultiDark(double s, double q, double y1, double y2, double rho, double *a1_list, int n_filters, double *mag_list, double accuracy);
 
+	// Magnification maps for a fixed binary lens and source radius, used by BinaryMag2 wherever they are accurate enough
+		void BuildMagMap(double s, double q, double rho, double y1min, double y1max, double y2max, int nbase, int maxdepth);
+		double MagMap(double y1, double y2);
+		void SaveMagMap(char *filename);
+		void LoadMagMap(char *filename);
+		void FreeMagMap(void);
+
+	// Optional GPU backend (library built by "make gpu") for point-lens light curve batches and point-source binary magnifications.
+	// Returns false, leaving all calculations on the CPU, if the device cannot be used. A negative device switches the backend off.
+		bool UseGPU(int device);
+
+	// Persistent cache of finite-source magnifications, shared by all processes opening the same file
+		bool OpenMagCache(char *filename, int nslots);
+		void CloseMagCache(void);
+		void ClearMagCache(void);
+
 	// Limb Darkening control
 		enum LDprofiles { LDlinear, LDquadratic, LDsquareroot, LDlog, LDuser};
 		void SetLDprofile(double(*UserLDprofile)(double), int tablesampling);
@@ -115,10 +360,16 @@ namespace VBBinaryLensingLibrary {
 
 	// ESPL functions
 		void LoadESPLTable(char *tablefilename);
+		void BuildESPLTable(char *tablefilename, int nrho, int nz, double rhomin, double rhomax);
 		double ESPLMag(double u, double rho);
 		double ESPLMag2(double u, double rho);
 		double ESPLMagDark(double u, double rho);
 		double PSPLMag(double u);
+	// Same functions operating on arrays of u. Astrometric centroids are not calculated.
+	// ESPLMag interpolates the table in rho once for all points and differs from the single-point version by rounding errors.
+		void PSPLMag(double *u_array, double *mag_array, int np);
+		void ESPLMag(double *u_array, double rho, double *mag_array, int np);
+		void ESPLMag2(double *u_array, double rho, double *mag_array, int np);
 
 
 	// New (v2) light curve functions, operating on arrays
@@ -141,6 +392,27 @@ namespace VBBinaryLensingLibrary {
 		void BinSourceSingleLensXallarap(double *parameters, double *t_array, double *mag_array, double *y1_array, double *y2_array, double *y1_array2, double *y2_array2, int np);
 		void BinSourceBinLensXallarap(double *parameters, double *t_array, double *mag_array, double *y1_array, double *y2_array, int np);
 
+	// Batch evaluation of many parameter sets on the same time array
+		void LightCurveBatch(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, int), double *parameters_matrix, int nparameters, int nmodels, double *t_array, double *mag_matrix, int np);
+		void LightCurveBatch(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, double *, int), double *parameters_matrix, int nparameters, int nmodels, double *t_array, double *mag_matrix, int np);
+
+	// Streaming evaluation of a fixed model on epochs arriving over time. StreamAdd only calculates the new epochs and returns the number of epochs in the stream.
+	// StreamReevaluate calculates the last nlast epochs for different parameters, leaving the stream unchanged, and returns the number of epochs calculated.
+		void StreamOpen(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, int), double *parameters, int nparameters);
+		int StreamAdd(double *t_array, double *mag_array, int np);
+		int StreamReevaluate(double *parameters, int nlast, double *mag_array);
+		void StreamClose(void);
+
+	// Light curves in several bands with different limb darkening profiles, sharing the contour integration for binary lenses.
+	// mag_matrix has one row of np magnifications per band.
+		void LightCurveMultiBand(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, int), double *parameters, double *t_array, double *mag_matrix, double *y1_array, double *y2_array, int np, LDprofiles *LD_list, double *a1_list, double *a2_list, int nbands);
+		void LightCurveMultiBand(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, double *, int), double *parameters, double *t_array, double *mag_matrix, double *y1_array, double *y2_array, double *sep_array, int np, LDprofiles *LD_list, double *a1_list, double *a2_list, int nbands);
+
+	// Light curves with their derivatives with respect to all the parameters of PSPL, ESPL and binary lens models.
+	// grad_matrix has one row of np derivatives per parameter.
+		void LightCurveGradient(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, int), double *parameters, double *t_array, double *mag_array, double *grad_matrix, double *y1_array, double *y2_array, int np);
+		void LightCurveGradient(void (VBBinaryLensing::*LightCurve)(double *, double *, double *, double *, double *, double *, int), double *parameters, double *t_array, double *mag_array, double *grad_matrix, double *y1_array, double *y2_array, double *sep_array, int np);
+
 	// Old (v1) light curve functions, for a single calculation
 		double PSPLLightCurve(double *parameters, double t);
 		double PSPLLightCurveParallax(double *parameters, double t);
@@ -167,10 +439,17 @@ namespace VBBinaryLensingLibrary {
 	// Constructor and destructor
 
 		VBBinaryLensing();
+		VBBinaryLensing(const VBBinaryLensing &);
 		~VBBinaryLensing();
 
 		private:
 			LDprofiles curLDprofile;
+			LDprofiles *bandLD;
+			double *banda1, *banda2;
+			int nbands;
+			bool bandsdone;
+			double *gradgeom;
+			void SetBands(LDprofiles *LDs, double *a1s, double *a2s, int nb);
 	};
 
 	struct annulus{
@@ -178,12 +457,21 @@ namespace VBBinaryLensingLibrary {
 		double cum;
 		double Mag;
 		double err;
+		double cerr; // Error of the contour, relevant when cut by the budget
 		double f;
 		int nim;
         double LDastrox1,LDastrox2;
 		annulus *prev,*next;
 	};
 
+	struct lensentry{
+		double s, q;
+		_sols *crit;
+		int NPcrit;
+		causticboxes *cboxes;
+		unsigned long lastuse;
+	};
+
 
 #ifndef __unmanaged
 }
@@ -193,9 +481,12 @@ namespace VBBinaryLensingLibrary {
 class _theta{
 public: 
 	double th,maxerr,Mag,errworst,astrox1,astrox2;
+	complex zr[5]; // Roots of the lens equation, used as starting points for neighbouring thetas
 	_theta *prev,*next;
 
 	_theta(double);
+	void *operator new(size_t);
+	void operator delete(void *);
 
 };
 
@@ -212,25 +503,18 @@ public:
 
 };
 
-class complex{
-public:
-	double re;
-	double im;
-	complex(double,double);
-	complex(double);
-	complex(void);
-};
-
 class _point{
 public:
 	double x1;
 	double x2;
+	_theta *theta;
+	_point *next,*prev;
 	double parab,ds,dJ,parabastrox1,parabastrox2;
 	complex d,J2;
-	_theta *theta;
 	_point(double ,double,_theta *);
-	_point *next,*prev;
 	double operator-(_point);
+	void *operator new(size_t);
+	void operator delete(void *);
 };
 
 class _curve{
@@ -244,8 +528,11 @@ public:
 	_curve(_point *);
 	_curve(void);
 	~_curve(void);
+	void *operator new(size_t);
+	void operator delete(void *);
 
 	_curve *divide(_point *);
+	_curve *divide(_point *,int);
 	void drop(_point *);
 	void append(double,double);
 	void append(_point *);
@@ -266,6 +553,8 @@ public:
 
 	_sols(void);
 	~_sols(void);
+	void *operator new(size_t);
+	void operator delete(void *);
 	void drop(_curve *);
 	void append(_curve *);
 	void prepend(_curve *);
@@ -277,36 +566,10 @@ public:
 #define MT 10
 #define MAXIT (MT*MR)
 #define MAXM 30
+#define MB 8 // Lanes of the batched root finder
 
 #endif
 
-double abs(complex);
-complex conj(complex);
 complex sqrt(complex);
-double real(complex);
-double imag(complex);
 complex expcmplx(complex);
 complex cbrt(complex);
-complex operator+(complex, complex);
-complex operator-(complex, complex);
-complex operator*(complex, complex);
-complex operator/(complex, complex);
-complex operator+(complex, double);
-complex operator-(complex, double);
-complex operator*(complex, double);
-complex operator/(complex, double);
-complex operator+(double, complex);
-complex operator-(double, complex);
-complex operator*(double, complex);
-complex operator/(double, complex);
-complex operator+(int, complex);
-complex operator-(int, complex);
-complex operator*(int, complex);
-complex operator/(int, complex);
-complex operator+(complex, int);
-complex operator-(complex, int);
-complex operator*(complex, int);
-complex operator/(complex, int);
-complex operator-(complex);
-bool operator==(complex, complex);
-bool operator!=(complex, complex);
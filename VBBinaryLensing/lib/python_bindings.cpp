@@ -1,7 +1,9 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <pybind11/numpy.h>
 #include "VBBinaryLensingLibrary.h"
 #include <string>
+#include <map>
 #include <pybind11/functional.h>
 
 
@@ -9,8 +11,178 @@
 
 namespace py = pybind11;
 
-// Declaration of an instance to VBBinaryLensing class. 
-VBBinaryLensing VBBL;
+// Light curve functions with three, four or five output arrays
+typedef void (VBBinaryLensing::*LightCurve3)(double *, double *, double *, double *, double *, int);
+typedef void (VBBinaryLensing::*LightCurve4)(double *, double *, double *, double *, double *, double *, int);
+typedef void (VBBinaryLensing::*LightCurve5)(double *, double *, double *, double *, double *, double *, double *, int);
+
+static int LightCurveOutputs(LightCurve3) { return 3; }
+static int LightCurveOutputs(LightCurve4) { return 4; }
+static int LightCurveOutputs(LightCurve5) { return 5; }
+
+static void CallLightCurve(VBBinaryLensing &self, LightCurve3 lc, double *params, double *times, double **outs, int np) {
+    (self.*lc)(params, times, outs[0], outs[1], outs[2], np);
+}
+static void CallLightCurve(VBBinaryLensing &self, LightCurve4 lc, double *params, double *times, double **outs, int np) {
+    (self.*lc)(params, times, outs[0], outs[1], outs[2], outs[3], np);
+}
+static void CallLightCurve(VBBinaryLensing &self, LightCurve5 lc, double *params, double *times, double **outs, int np) {
+    (self.*lc)(params, times, outs[0], outs[1], outs[2], outs[3], outs[4], np);
+}
+
+static void LightCurveBatch(VBBinaryLensing &self, const std::string &model, double *params, int npr, int nmodels, double *times, double *mags, int np) {
+    static const std::map<std::string, LightCurve3> curves{
+        { "PSPLLightCurve", &VBBinaryLensing::PSPLLightCurve },
+        { "PSPLLightCurveParallax", &VBBinaryLensing::PSPLLightCurveParallax },
+        { "ESPLLightCurve", &VBBinaryLensing::ESPLLightCurve },
+        { "ESPLLightCurveParallax", &VBBinaryLensing::ESPLLightCurveParallax },
+        { "BinaryLightCurve", &VBBinaryLensing::BinaryLightCurve },
+        { "BinaryLightCurveW", &VBBinaryLensing::BinaryLightCurveW },
+        { "BinaryLightCurveParallax", &VBBinaryLensing::BinaryLightCurveParallax },
+        { "BinSourceLightCurve", &VBBinaryLensing::BinSourceLightCurve },
+        { "BinSourceLightCurveParallax", &VBBinaryLensing::BinSourceLightCurveParallax },
+        { "BinSourceExtLightCurve", &VBBinaryLensing::BinSourceExtLightCurve },
+        { "BinSourceBinLensXallarap", &VBBinaryLensing::BinSourceBinLensXallarap } };
+    static const std::map<std::string, LightCurve4> curvessep{
+        { "BinaryLightCurveOrbital", &VBBinaryLensing::BinaryLightCurveOrbital },
+        { "BinaryLightCurveKepler", &VBBinaryLensing::BinaryLightCurveKepler },
+        { "BinSourceLightCurveXallarap", &VBBinaryLensing::BinSourceLightCurveXallarap } };
+
+    if (curves.count(model)) {
+        self.LightCurveBatch(curves.at(model), params, npr, nmodels, times, mags, np);
+    }
+    else if (curvessep.count(model)) {
+        self.LightCurveBatch(curvessep.at(model), params, npr, nmodels, times, mags, np);
+    }
+    else {
+        throw py::value_error("Unknown light curve function: " + model);
+    }
+}
+
+// Light curve functions supported by the streaming evaluator
+static LightCurve3 StreamLightCurve(const std::string &model) {
+    static const std::map<std::string, LightCurve3> curves{
+        { "PSPLLightCurve", &VBBinaryLensing::PSPLLightCurve },
+        { "PSPLLightCurveParallax", &VBBinaryLensing::PSPLLightCurveParallax },
+        { "ESPLLightCurve", &VBBinaryLensing::ESPLLightCurve },
+        { "ESPLLightCurveParallax", &VBBinaryLensing::ESPLLightCurveParallax },
+        { "BinaryLightCurve", &VBBinaryLensing::BinaryLightCurve },
+        { "BinaryLightCurveW", &VBBinaryLensing::BinaryLightCurveW },
+        { "BinaryLightCurveParallax", &VBBinaryLensing::BinaryLightCurveParallax },
+        { "BinSourceLightCurve", &VBBinaryLensing::BinSourceLightCurve },
+        { "BinSourceLightCurveParallax", &VBBinaryLensing::BinSourceLightCurveParallax },
+        { "BinSourceExtLightCurve", &VBBinaryLensing::BinSourceExtLightCurve },
+        { "BinSourceBinLensXallarap", &VBBinaryLensing::BinSourceBinLensXallarap } };
+    if (!curves.count(model)) throw py::value_error("Unknown light curve function: " + model);
+    return curves.at(model);
+}
+
+static void LightCurveMultiBand(VBBinaryLensing &self, const std::string &model, double *params, double *times, double *mags, int np, VBBinaryLensing::LDprofiles *LDs, double *a1s, double *a2s, int nbands) {
+    static const std::map<std::string, LightCurve3> curves{
+        { "PSPLLightCurve", &VBBinaryLensing::PSPLLightCurve },
+        { "PSPLLightCurveParallax", &VBBinaryLensing::PSPLLightCurveParallax },
+        { "ESPLLightCurve", &VBBinaryLensing::ESPLLightCurve },
+        { "ESPLLightCurveParallax", &VBBinaryLensing::ESPLLightCurveParallax },
+        { "BinaryLightCurve", &VBBinaryLensing::BinaryLightCurve },
+        { "BinaryLightCurveW", &VBBinaryLensing::BinaryLightCurveW },
+        { "BinaryLightCurveParallax", &VBBinaryLensing::BinaryLightCurveParallax } };
+    static const std::map<std::string, LightCurve4> curvessep{
+        { "BinaryLightCurveOrbital", &VBBinaryLensing::BinaryLightCurveOrbital },
+        { "BinaryLightCurveKepler", &VBBinaryLensing::BinaryLightCurveKepler } };
+    std::vector<double> y1s(np), y2s(np), seps(np);
+
+    if (curves.count(model)) {
+        self.LightCurveMultiBand(curves.at(model), params, times, mags, y1s.data(), y2s.data(), np, LDs, a1s, a2s, nbands);
+    }
+    else if (curvessep.count(model)) {
+        self.LightCurveMultiBand(curvessep.at(model), params, times, mags, y1s.data(), y2s.data(), seps.data(), np, LDs, a1s, a2s, nbands);
+    }
+    else {
+        throw py::value_error("Unknown light curve function: " + model);
+    }
+}
+
+static void LightCurveGradient(VBBinaryLensing &self, const std::string &model, double *params, double *times, double *mags, double *grads, int np) {
+    static const std::map<std::string, LightCurve3> curves{
+        { "PSPLLightCurve", &VBBinaryLensing::PSPLLightCurve },
+        { "PSPLLightCurveParallax", &VBBinaryLensing::PSPLLightCurveParallax },
+        { "ESPLLightCurve", &VBBinaryLensing::ESPLLightCurve },
+        { "ESPLLightCurveParallax", &VBBinaryLensing::ESPLLightCurveParallax },
+        { "BinaryLightCurve", &VBBinaryLensing::BinaryLightCurve },
+        { "BinaryLightCurveW", &VBBinaryLensing::BinaryLightCurveW },
+        { "BinaryLightCurveParallax", &VBBinaryLensing::BinaryLightCurveParallax } };
+    static const std::map<std::string, LightCurve4> curvessep{
+        { "BinaryLightCurveOrbital", &VBBinaryLensing::BinaryLightCurveOrbital },
+        { "BinaryLightCurveKepler", &VBBinaryLensing::BinaryLightCurveKepler } };
+    std::vector<double> y1s(np), y2s(np), seps(np);
+
+    if (curves.count(model)) {
+        self.LightCurveGradient(curves.at(model), params, times, mags, grads, y1s.data(), y2s.data(), np);
+    }
+    else if (curvessep.count(model)) {
+        self.LightCurveGradient(curvessep.at(model), params, times, mags, grads, y1s.data(), y2s.data(), seps.data(), np);
+    }
+    else {
+        throw py::value_error("Unknown light curve function: " + model);
+    }
+}
+
+// Number of parameters of the light curve functions supported by LightCurveGradient
+static int GradientParameters(const std::string &model) {
+    static const std::map<std::string, int> npars{
+        { "PSPLLightCurve", 3 }, { "PSPLLightCurveParallax", 5 },
+        { "ESPLLightCurve", 4 }, { "ESPLLightCurveParallax", 6 },
+        { "BinaryLightCurve", 7 }, { "BinaryLightCurveW", 7 }, { "BinaryLightCurveParallax", 9 },
+        { "BinaryLightCurveOrbital", 12 }, { "BinaryLightCurveKepler", 14 } };
+    if (!npars.count(model)) throw py::value_error("Unknown light curve function: " + model);
+    return npars.at(model);
+}
+
+// NumPy versions of the light curve functions. Input arrays are read in place and results 
+// are written directly into new NumPy arrays or into arrays provided by the caller in out.
+// They are registered before the list versions, so that float64 arrays are never converted to lists.
+typedef py::array_t<double, py::array::c_style> pyarray;
+
+template <class LC> static void def_numpy_lightcurve(py::class_<VBBinaryLensing> &vbb, const char *name, LC lc) {
+    vbb.def(name,
+        [lc](VBBinaryLensing &self, pyarray params, pyarray times)
+        {
+            int np = times.size(), nout = LightCurveOutputs(lc);
+            std::vector<pyarray> results;
+            double *outs[5];
+            for (int i = 0; i < nout; i++) {
+                results.push_back(pyarray(np));
+                outs[i] = results[i].mutable_data();
+            }
+            {
+                py::gil_scoped_release release;
+                CallLightCurve(self, lc, (double *) params.data(), (double *) times.data(), outs, np);
+            }
+            return results;
+        },
+        py::arg("params"), py::arg("times").noconvert(),
+        "Same as above with times given as a NumPy array. Returns a list of NumPy arrays.");
+    vbb.def(name,
+        [lc](VBBinaryLensing &self, pyarray params, pyarray times, py::list out)
+        {
+            int np = times.size(), nout = LightCurveOutputs(lc);
+            double *outs[5];
+            if ((int) out.size() != nout) throw py::value_error("Wrong number of output arrays.");
+            for (int i = 0; i < nout; i++) {
+                if (!py::isinstance<pyarray>(out[i])) throw py::value_error("Output arrays must be C-contiguous float64 NumPy arrays.");
+                pyarray a = py::reinterpret_borrow<pyarray>(out[i]);
+                if (a.size() < np) throw py::value_error("Output arrays are shorter than times.");
+                outs[i] = a.mutable_data();
+            }
+            {
+                py::gil_scoped_release release;
+                CallLightCurve(self, lc, (double *) params.data(), (double *) times.data(), outs, np);
+            }
+            return out;
+        },
+        py::arg("params"), py::arg("times").noconvert(), py::arg("out"),
+        "Same as above, writing the results into out, a list of preallocated NumPy arrays.");
+}
 
 PYBIND11_MODULE(VBBinaryLensing, m) {
     py::options options;
@@ -23,6 +195,8 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 "Absolute accuracy goal.");
         vbb.def_readwrite("RelTol", &VBBinaryLensing::RelTol,
                 "Relative precision goal.");
+        vbb.def_readwrite("InterpolationTol", &VBBinaryLensing::InterpolationTol,
+                "Tolerance for interpolation between calculated points in binary light curves (0 = no interpolation).");
         vbb.def_readwrite("a1", &VBBinaryLensing::a1,
                 "Linear limb darkening coefficient. I(r)=I(0)(1-a1(1-\sqrt{1-r^2/\rho^2}))");
         vbb.def_readwrite("a2", &VBBinaryLensing::a2,
@@ -31,6 +205,24 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
             "Number of points in critical curves or caustics.");
         vbb.def_readwrite("minannuli", &VBBinaryLensing::minannuli,
                 "Minimum number of annuli to calculate for limb darkening.");
+        vbb.def_readwrite("maxNPS", &VBBinaryLensing::maxNPS,
+                "Maximum number of points on the contours of a finite-source magnification (0 for no limit).");
+        vbb.def_readwrite("maxannuli", &VBBinaryLensing::maxannuli,
+                "Maximum number of annuli of BinaryMagDark (0 for no limit).");
+        vbb.def_readwrite("maxtime", &VBBinaryLensing::maxtime,
+                "Maximum time in seconds of a finite-source magnification (0 for no limit).");
+        vbb.def_readwrite("nthreads", &VBBinaryLensing::nthreads,
+                "Number of threads used by binary lens light curve functions.");
+        vbb.def_readonly("lenscachehits", &VBBinaryLensing::lenscachehits,
+                "Number of lookups of (s,q) found in the lens cache.");
+        vbb.def_readonly("lenscachemisses", &VBBinaryLensing::lenscachemisses,
+                "Number of lookups of (s,q) not found in the lens cache.");
+        vbb.def_readonly("magcachehits", &VBBinaryLensing::magcachehits,
+                "Number of finite-source magnifications found in the result cache.");
+        vbb.def_readonly("magcachemisses", &VBBinaryLensing::magcachemisses,
+                "Number of finite-source magnifications not found in the result cache.");
+        vbb.def_readonly("stats", &VBBinaryLensing::stats,
+                "Cost counters of the magnification calculations since the last ResetStats.");
         vbb.def_readwrite("parallaxsystem", &VBBinaryLensing::parallaxsystem,
                 "0 for parallel-perpendicular, 1 for North-Eeast.");
         vbb.def_readwrite("t0_par_fixed", &VBBinaryLensing::t0_par_fixed,
@@ -42,6 +234,10 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 (0 for observations from the ground);.");
         vbb.def_readwrite("astrometry", &VBBinaryLensing::astrometry,
                 "Unlock astrometry centroid calculation.");
+        vbb.def_readwrite("causticindex", &VBBinaryLensing::causticindex,
+                "Use bounding boxes of the caustics to skip the finite-source tests of BinaryMag2 far from them.");
+        vbb.def_readwrite("parallelannuli", &VBBinaryLensing::parallelannuli,
+                "Calculate the annuli of BinaryMagDark nthreads at a time on different threads.");
         vbb.def_readwrite("astrox1", &VBBinaryLensing::astrox1,
                 "The x component of the light centroid.");
         vbb.def_readwrite("astrox2", &VBBinaryLensing::astrox2,
@@ -53,9 +249,30 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
 
         vbb.def("LoadESPLTable", &VBBinaryLensing::LoadESPLTable,
             """Loads a pre calculated binary table for extended source calculation.""");
+        vbb.def("BuildESPLTable", &VBBinaryLensing::BuildESPLTable,
+            py::call_guard<py::gil_scoped_release>(),
+            R"mydelimiter(
+            Calculates a table for extended source calculation and writes it
+            to a file that can be read by LoadESPLTable.
+
+            Parameters
+            ----------
+            tablefilename : str
+                Name of the file to be written.
+            nrho : int
+                Number of values of the source radius, logarithmically spaced.
+            nz : int
+                Number of values of the source-lens distance in units of rho
+                (inside the source) and of its inverse (outside the source).
+            rhomin : float
+                Smallest source radius in the table.
+            rhomax : float
+                Largest source radius in the table.
+            )mydelimiter");
         // Maginfication calculations
-        vbb.def("ESPLMag", &VBBinaryLensing::ESPLMag,
+        vbb.def("ESPLMag", (double (VBBinaryLensing::*)(double, double)) &VBBinaryLensing::ESPLMag,
             py::return_value_policy::reference,
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Extended Source Point Lens magnification calculation.
 
@@ -75,7 +292,8 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
             float
                 Magnification.
             )mydelimiter");
-       vbb.def("ESPLMag2", &VBBinaryLensing::ESPLMag2,
+       vbb.def("ESPLMag2", (double (VBBinaryLensing::*)(double, double)) &VBBinaryLensing::ESPLMag2,
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Extended Source Point Lens magnification calculation v2.0.
 
@@ -95,8 +313,48 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
             float
                 Magnification.
             )mydelimiter");
+        vbb.def("ESPLMag",
+            [](VBBinaryLensing &self, pyarray u, double rho)
+            {
+                pyarray mags(u.size());
+                double *pmags = mags.mutable_data();
+                {
+                    py::gil_scoped_release release;
+                    self.ESPLMag((double *) u.data(), rho, pmags, u.size());
+                }
+                return mags;
+            },
+            py::arg("u").noconvert(), py::arg("rho"),
+            "Same as above for a NumPy array of source distances u. Returns a NumPy array of magnifications.");
+        vbb.def("ESPLMag2",
+            [](VBBinaryLensing &self, pyarray u, double rho)
+            {
+                pyarray mags(u.size());
+                double *pmags = mags.mutable_data();
+                {
+                    py::gil_scoped_release release;
+                    self.ESPLMag2((double *) u.data(), rho, pmags, u.size());
+                }
+                return mags;
+            },
+            py::arg("u").noconvert(), py::arg("rho"),
+            "Same as above for a NumPy array of source distances u. Returns a NumPy array of magnifications.");
+        vbb.def("PSPLMag",
+            [](VBBinaryLensing &self, pyarray u)
+            {
+                pyarray mags(u.size());
+                double *pmags = mags.mutable_data();
+                {
+                    py::gil_scoped_release release;
+                    self.PSPLMag((double *) u.data(), pmags, u.size());
+                }
+                return mags;
+            },
+            py::arg("u").noconvert(),
+            "Point Source Point Lens magnification for a NumPy array of source distances u. Returns a NumPy array of magnifications.");
         vbb.def("ESPLMagDark", &VBBinaryLensing::ESPLMagDark,
             py::return_value_policy::reference,
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Extended Source Point Lens magnification calculation v2.0. 
             including limb darkening.
@@ -119,6 +377,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
             (double (VBBinaryLensing::*)(double, double, double, double)) 
             &VBBinaryLensing::BinaryMag0,
             py::return_value_policy::reference,
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Magnification of a point-source by a binary lens.
 
@@ -140,10 +399,37 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 Magnification.
             )mydelimiter");
 
+        vbb.def("BinaryMag0",
+            [](VBBinaryLensing &self, double s, double q, pyarray y1, pyarray y2, bool astrometry)
+            {
+                int np = y1.size();
+                if ((int) y2.size() != np) throw py::value_error("y1 and y2 must have the same size.");
+                std::vector<pyarray> results;
+                for (int i = 0; i < ((astrometry) ? 3 : 1); i++) results.push_back(pyarray(np));
+                {
+                    py::gil_scoped_release release;
+                    if (astrometry) {
+                        self.BinaryMag0(s, q, (double *) y1.data(), (double *) y2.data(), results[0].mutable_data(), results[1].mutable_data(), results[2].mutable_data(), np);
+                    }
+                    else {
+                        self.BinaryMag0(s, q, (double *) y1.data(), (double *) y2.data(), results[0].mutable_data(), np);
+                    }
+                }
+                return (astrometry) ? py::cast(results) : py::cast(results[0]);
+            },
+            py::arg("s"), py::arg("q"), py::arg("y1").noconvert(), py::arg("y2").noconvert(), py::arg("astrometry") = false,
+            R"mydelimiter(
+            Same as above for NumPy arrays of source positions y1, y2, 
+            calculated on nthreads threads. Returns a NumPy array of 
+            magnifications or, with astrometry=True, a list with the 
+            magnifications and the two coordinates of the centroids.
+            )mydelimiter");
+
         vbb.def("BinaryMag", 
             (double (VBBinaryLensing::*)(double, double, double, double, double, double))
             &VBBinaryLensing::BinaryMag,
             py::return_value_policy::reference,
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Magnification of a uniform brightness finite source 
             by a binary lens.
@@ -173,6 +459,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
         vbb.def("BinaryMagDark", 
             &VBBinaryLensing::BinaryMagDark,
             py::return_value_policy::reference,
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Magnification of a limb-darkened finite source 
             by a binary lens.
@@ -207,6 +494,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
             (void (VBBinaryLensing::*)(double, double, double, double, double, double *, int, double *, double)) 
             &VBBinaryLensing::BinaryMagMultiDark,
             py::return_value_policy::reference,
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Magnification of a limb-darkened source by a binary lens in \
             different filters with different limb darkening coefficients.
@@ -239,8 +527,11 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
             void
             )mydelimiter");
 
-        vbb.def("BinaryMag2", &VBBinaryLensing::BinaryMag2,
+        vbb.def("BinaryMag2",
+            (double (VBBinaryLensing::*)(double, double, double, double, double))
+            &VBBinaryLensing::BinaryMag2,
             py::return_value_policy::reference,
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Magnification of a uniform brightness finite source 
             by a binary lens. New in v2.0, implements test described
@@ -269,6 +560,108 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 Magnification.
             )mydelimiter");
 
+        vbb.def("BinaryMag2",
+            [](VBBinaryLensing &self, double s, double q, pyarray y1, pyarray y2, double rho, bool astrometry)
+            {
+                int np = y1.size();
+                if ((int) y2.size() != np) throw py::value_error("y1 and y2 must have the same size.");
+                std::vector<pyarray> results;
+                for (int i = 0; i < ((astrometry) ? 3 : 1); i++) results.push_back(pyarray(np));
+                {
+                    py::gil_scoped_release release;
+                    if (astrometry) {
+                        self.BinaryMag2(s, q, (double *) y1.data(), (double *) y2.data(), rho, results[0].mutable_data(), results[1].mutable_data(), results[2].mutable_data(), np);
+                    }
+                    else {
+                        self.BinaryMag2(s, q, (double *) y1.data(), (double *) y2.data(), rho, results[0].mutable_data(), np);
+                    }
+                }
+                return (astrometry) ? py::cast(results) : py::cast(results[0]);
+            },
+            py::arg("s"), py::arg("q"), py::arg("y1").noconvert(), py::arg("y2").noconvert(), py::arg("rho"), py::arg("astrometry") = false,
+            R"mydelimiter(
+            Same as above for NumPy arrays of source positions y1, y2, 
+            e.g. a grid or a trajectory from an external code, calculated 
+            on nthreads threads. Returns a NumPy array of magnifications or, 
+            with astrometry=True, a list with the magnifications and the 
+            two coordinates of the centroids.
+            )mydelimiter");
+
+        // Magnification maps
+        vbb.def("BuildMagMap", &VBBinaryLensing::BuildMagMap,
+            py::call_guard<py::gil_scoped_release>(),
+            R"mydelimiter(
+            Builds a magnification map for a binary lens and a source of radius rho.
+            BinaryMag2 and the binary light curves with the same s, q, rho
+            interpolate the map wherever it meets the accuracy goal Tol.
+
+            Parameters
+            ----------
+            s : float 
+                The projected separation of the binary lens in units of the 
+                Einstein radius corresponding to the total mass.
+            q : float 
+                Binary lens mass fraction q = m1/m2 s.t. m1<m2 
+            rho : float 
+                Source radius in units of the Einstein radius.
+            y1min : float 
+                Lower limit of the map in y1.
+            y1max : float 
+                Upper limit of the map in y1.
+            y2max : float 
+                Upper limit of the map in |y2|.
+            nbase : int 
+                Number of base cells along y1.
+            maxdepth : int 
+                Maximum number of subdivisions of the base cells.
+            )mydelimiter");
+        vbb.def("MagMap", &VBBinaryLensing::MagMap,
+            "Interpolated magnification from the map, -1 outside the map or where it is not accurate enough.");
+        vbb.def("SaveMagMap", &VBBinaryLensing::SaveMagMap,
+            "Saves the magnification map to a binary file.");
+        vbb.def("LoadMagMap", &VBBinaryLensing::LoadMagMap,
+            "Loads a magnification map from a binary file.");
+        vbb.def("FreeMagMap", &VBBinaryLensing::FreeMagMap,
+            "Discards the magnification map.");
+        vbb.def("OpenMagCache", &VBBinaryLensing::OpenMagCache,
+            R"mydelimiter(
+            Opens a persistent cache of finite-source magnifications, shared 
+            by all processes opening the same file. The file is created if it 
+            does not exist.
+
+            Parameters
+            ----------
+            filename : str
+                Name of the cache file.
+            nslots : int
+                Number of slots of a new cache file (ignored for existing files).
+
+            Returns
+            -------
+            bool
+                True if the cache has been opened.
+            )mydelimiter");
+        vbb.def("CloseMagCache", &VBBinaryLensing::CloseMagCache,
+            "Stops using the result cache.");
+        vbb.def("ClearMagCache", &VBBinaryLensing::ClearMagCache,
+            "Empties the result cache for all processes and resets its counters.");
+        vbb.def("UseGPU", &VBBinaryLensing::UseGPU,
+            R"mydelimiter(
+            Offloads point-lens batches and point-source binary magnifications 
+            to a CUDA device. Only available if the library has been built with 
+            the GPU backend.
+
+            Parameters
+            ----------
+            device : int
+                Number of the CUDA device, -1 to calculate on the CPU.
+
+            Returns
+            -------
+            bool
+                True if the device is used.
+            )mydelimiter");
+
         vbb.def("SetObjectCoordinates", (void (VBBinaryLensing::*)(char *, char *)) &VBBinaryLensing::SetObjectCoordinates,
             R"mydelimiter(
             Sets the astronomical coordinates of the microlensing target.            
@@ -292,8 +685,57 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
             sattabledir : string 
                 Name of the directory containing the position tables of the satellites. 
             )mydelimiter");
+        vbb.def("ConvertSatelliteTables", &VBBinaryLensing::ConvertSatelliteTables,
+            R"mydelimiter(
+            Reads the text position tables of the satellites in a directory
+            and writes them to a single binary file satellites.bin in the same
+            directory, which SetObjectCoordinates will use in place of the text tables.
+
+            Parameters
+            ----------
+            sattabledir : string 
+                Name of the directory containing the position tables of the satellites. 
+            )mydelimiter");
+        vbb.def("PrepareParallax",
+            [](VBBinaryLensing &self, pyarray times)
+            {
+                self.PrepareParallax((double *)times.data(), (int)times.size());
+            },
+            py::arg("times").noconvert(),
+            R"mydelimiter(
+            Precalculates the observer positions at the given times, which are then
+            reused by all parallax calculations at these times with the current satellite.
+            An empty list frees the precalculated positions.
+
+            Parameters
+            ----------
+            times : list[float] 
+                Array of times at which parallax calculations will be performed.
+            )mydelimiter");
+        vbb.def("PrepareParallax",
+            [](VBBinaryLensing &self, std::vector<double> times)
+            {
+                self.PrepareParallax(times.data(), (int)times.size());
+            },
+            py::arg("times"));
 
         // Light curve calculations
+        def_numpy_lightcurve<LightCurve3>(vbb, "PSPLLightCurve", &VBBinaryLensing::PSPLLightCurve);
+        def_numpy_lightcurve<LightCurve3>(vbb, "PSPLLightCurveParallax", &VBBinaryLensing::PSPLLightCurveParallax);
+        def_numpy_lightcurve<LightCurve3>(vbb, "ESPLLightCurve", &VBBinaryLensing::ESPLLightCurve);
+        def_numpy_lightcurve<LightCurve3>(vbb, "ESPLLightCurveParallax", &VBBinaryLensing::ESPLLightCurveParallax);
+        def_numpy_lightcurve<LightCurve3>(vbb, "BinaryLightCurve", &VBBinaryLensing::BinaryLightCurve);
+        def_numpy_lightcurve<LightCurve3>(vbb, "BinaryLightCurveW", &VBBinaryLensing::BinaryLightCurveW);
+        def_numpy_lightcurve<LightCurve3>(vbb, "BinaryLightCurveParallax", &VBBinaryLensing::BinaryLightCurveParallax);
+        def_numpy_lightcurve<LightCurve4>(vbb, "BinaryLightCurveOrbital", &VBBinaryLensing::BinaryLightCurveOrbital);
+        def_numpy_lightcurve<LightCurve4>(vbb, "BinaryLightCurveKepler", &VBBinaryLensing::BinaryLightCurveKepler);
+        def_numpy_lightcurve<LightCurve3>(vbb, "BinSourceLightCurve", &VBBinaryLensing::BinSourceLightCurve);
+        def_numpy_lightcurve<LightCurve3>(vbb, "BinSourceLightCurveParallax", &VBBinaryLensing::BinSourceLightCurveParallax);
+        def_numpy_lightcurve<LightCurve5>(vbb, "BinSourceSingleLensXallarap", &VBBinaryLensing::BinSourceSingleLensXallarap);
+        def_numpy_lightcurve<LightCurve3>(vbb, "BinSourceExtLightCurve", &VBBinaryLensing::BinSourceExtLightCurve);
+        def_numpy_lightcurve<LightCurve3>(vbb, "BinSourceBinLensXallarap", &VBBinaryLensing::BinSourceBinLensXallarap);
+        def_numpy_lightcurve<LightCurve4>(vbb, "BinSourceLightCurveXallarap", &VBBinaryLensing::BinSourceLightCurveXallarap);
+
         vbb.def("PSPLLightCurve",
             [](VBBinaryLensing &self, std::vector<double> params, std::vector<double> times)
             {
@@ -305,6 +747,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s,y2s };
                 return results;
             },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             PSPL light curve for a full array of observations.
 
@@ -332,6 +775,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s,y2s };
                 return results;
            },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             PSPL light curve for a full array of observations including parallax.
 
@@ -361,6 +805,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s,y2s };
                 return results;
             },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             ESPL light curve for a full array of observations.
 
@@ -387,6 +832,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s,y2s };
                 return results;
              },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             ESPL light curve for a full array of observations including parallax.
 
@@ -414,6 +860,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s,y2s };
                 return results;
             },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Static binary lens light curve for a given set of parameters.
             Uses the BinaryMag2 function.
@@ -442,6 +889,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s,y2s };
                 return results;
             },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Static binary lens light curve for a given set of parameters 
             using the center of the caustic of the lens on the right as 
@@ -471,6 +919,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s,y2s };
                 return results;
              },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Static binary lens light curve for a given set of parameters including parallax.
             Uses the BinaryMag2 function.
@@ -502,6 +951,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s,y2s, separations };
                 return results;
             },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Static binary lens light curve for a given set of parameters including parallax.
             Uses the BinaryMag2 function.
@@ -535,6 +985,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s,y2s, separations };
                 return results;
             },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
              binary lens light curve for a given set of parameters including keplerian orbital motion.
             Uses the BinaryMag2 function.
@@ -567,6 +1018,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s,y2s };
                 return results;
             },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Light curve for a single lens and a binary source. Sources are 
             treated as point-like.
@@ -595,6 +1047,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s,y2s };
                 return results;
             },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Light curve for a single lens and a binary source including parallax.
 
@@ -626,6 +1079,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s1,y2s1,y1s2,y2s2 };
                 return results;
             },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Binary source Single Lens Xallarap light curve.
 
@@ -656,6 +1110,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                     std::vector< std::vector<double> > results{ mags,y1s,y2s };
                     return results;
                 },
+                py::call_guard<py::gil_scoped_release>(),
                 R"mydelimiter(
             Light curve for a single lens and a binary source. Sources are 
             treated as point-like.
@@ -685,6 +1140,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                     std::vector< std::vector<double> > results{ mags,y1s,y2s };
                     return results;
                 },
+                py::call_guard<py::gil_scoped_release>(),
                 R"mydelimiter(
             Binary source Single Lens Xallarap light curve.
 
@@ -717,6 +1173,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 std::vector< std::vector<double> > results{ mags,y1s,y2s, separations };
                 return results;
             },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Binary source light curve.
 
@@ -743,11 +1200,246 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 [Magnification array, y1 array, y2 array, separation-between-lenses array]
             )mydelimiter");
 
+        vbb.def("LightCurveBatch",
+            [](VBBinaryLensing &self, std::string model, pyarray params, pyarray times)
+            {
+                if (params.ndim() != 2) throw py::value_error("params must be a two-dimensional array.");
+                int nmodels = params.shape(0), npr = params.shape(1), np = times.size();
+                pyarray mags(std::vector<ssize_t>{ nmodels, np });
+                double *pmags = mags.mutable_data();
+                {
+                    py::gil_scoped_release release;
+                    LightCurveBatch(self, model, (double *) params.data(), npr, nmodels, (double *) times.data(), pmags, np);
+                }
+                return mags;
+            },
+            py::arg("model"), py::arg("params").noconvert(), py::arg("times").noconvert(),
+            "Same as below with NumPy arrays: params has one row per model and the result has one row of magnifications per model.");
+        vbb.def("LightCurveBatch",
+            [](VBBinaryLensing &self, std::string model, std::vector< std::vector<double> > params, std::vector<double> times)
+            {
+                int nmodels = params.size(), npr = (nmodels > 0) ? params[0].size() : 0, np = times.size();
+                std::vector<double> prs(nmodels * npr), mags(nmodels * np);
+                for (int im = 0; im < nmodels; im++) {
+                    if ((int) params[im].size() != npr) throw py::value_error("All parameter vectors must have the same length.");
+                    std::copy(params[im].begin(), params[im].end(), prs.begin() + im * npr);
+                }
+                LightCurveBatch(self, model, prs.data(), npr, nmodels, times.data(), mags.data(), np);
+                std::vector< std::vector<double> > results(nmodels);
+                for (int im = 0; im < nmodels; im++) {
+                    results[im].assign(mags.begin() + im * np, mags.begin() + (im + 1) * np);
+                }
+                return results;
+            },
+            py::call_guard<py::gil_scoped_release>(),
+            R"mydelimiter(
+            Light curves for many sets of parameters on the same time array.
+            Observer positions for parallax are computed once for all models
+            and models are distributed among nthreads threads.
+
+            Parameters
+            ----------
+            model : str
+                Name of the light curve function, e.g. "BinaryLightCurveParallax".
+            params : list[list[float]]
+                List of parameter vectors, one per model, in the format of the 
+                chosen light curve function.
+            times : list[float] 
+                Array of times at which the magnification is calculated.
+ 
+            Returns
+            -------
+            results: list[list[float]] 
+                Magnification arrays, one per model.
+            )mydelimiter");
+
+        vbb.def("StreamOpen",
+            [](VBBinaryLensing &self, std::string model, std::vector<double> params)
+            {
+                self.StreamOpen(StreamLightCurve(model), params.data(), params.size());
+            },
+            R"mydelimiter(
+            Starts a stream of epochs for a fixed model. Observer positions 
+            for parallax are computed once per epoch and new epochs start 
+            from the roots of the lens equation of the last one.
+
+            Parameters
+            ----------
+            model : str
+                Name of the light curve function, e.g. "BinaryLightCurveParallax".
+            params : list[float]
+                Parameters in the format of the chosen light curve function.
+            )mydelimiter");
+        vbb.def("StreamAdd",
+            [](VBBinaryLensing &self, std::vector<double> times)
+            {
+                std::vector<double> mags(times.size());
+                self.StreamAdd(times.data(), mags.data(), times.size());
+                return mags;
+            },
+            py::call_guard<py::gil_scoped_release>(),
+            R"mydelimiter(
+            Appends new epochs to the stream and calculates them only.
+
+            Parameters
+            ----------
+            times : list[float]
+                New times.
+
+            Returns
+            -------
+            mags: list[float]
+                Magnifications at the new times.
+            )mydelimiter");
+        vbb.def("StreamReevaluate",
+            [](VBBinaryLensing &self, std::vector<double> params, int nlast)
+            {
+                std::vector<double> mags((nlast > 0) ? nlast : 0);
+                mags.resize(self.StreamReevaluate(params.data(), nlast, mags.data()));
+                return mags;
+            },
+            py::call_guard<py::gil_scoped_release>(),
+            R"mydelimiter(
+            Magnifications of the last epochs of the stream for different 
+            parameters. The stream keeps its own parameters.
+
+            Parameters
+            ----------
+            params : list[float]
+                Perturbed parameters.
+            nlast : int
+                Number of epochs to recalculate, starting from the last one.
+
+            Returns
+            -------
+            mags: list[float]
+                Magnifications at the last nlast epochs.
+            )mydelimiter");
+        vbb.def("StreamClose", &VBBinaryLensing::StreamClose,
+            "Discards the stream.");
+
+        vbb.def("LightCurveMultiBand",
+            [](VBBinaryLensing &self, std::string model, pyarray params, pyarray times, std::vector<VBBinaryLensing::LDprofiles> LD_list, pyarray a1_list, pyarray a2_list)
+            {
+                int nbands = LD_list.size(), np = times.size();
+                if ((int) a1_list.size() != nbands || (int) a2_list.size() != nbands) throw py::value_error("LD_list, a1_list and a2_list must have the same length.");
+                pyarray mags(std::vector<ssize_t>{ nbands, np });
+                double *pmags = mags.mutable_data();
+                {
+                    py::gil_scoped_release release;
+                    LightCurveMultiBand(self, model, (double *) params.data(), (double *) times.data(), pmags, np, LD_list.data(), (double *) a1_list.data(), (double *) a2_list.data(), nbands);
+                }
+                return mags;
+            },
+            py::arg("model"), py::arg("params").noconvert(), py::arg("times").noconvert(), py::arg("LD_list"), py::arg("a1_list").noconvert(), py::arg("a2_list").noconvert(),
+            "Same as below with NumPy arrays: the result has one row of magnifications per band.");
+        vbb.def("LightCurveMultiBand",
+            [](VBBinaryLensing &self, std::string model, std::vector<double> params, std::vector<double> times, std::vector<VBBinaryLensing::LDprofiles> LD_list, std::vector<double> a1_list, std::vector<double> a2_list)
+            {
+                int nbands = LD_list.size(), np = times.size();
+                if ((int) a1_list.size() != nbands || (int) a2_list.size() != nbands) throw py::value_error("LD_list, a1_list and a2_list must have the same length.");
+                std::vector<double> mags(nbands * np);
+                LightCurveMultiBand(self, model, params.data(), times.data(), mags.data(), np, LD_list.data(), a1_list.data(), a2_list.data(), nbands);
+                std::vector< std::vector<double> > results(nbands);
+                for (int ib = 0; ib < nbands; ib++) {
+                    results[ib].assign(mags.begin() + ib * np, mags.begin() + (ib + 1) * np);
+                }
+                return results;
+            },
+            py::call_guard<py::gil_scoped_release>(),
+            R"mydelimiter(
+            Light curve in several bands with different limb darkening.
+            For binary lenses the contours are calculated once per epoch for 
+            the band with the strongest limb darkening and re-weighted for 
+            the other bands.
+
+            Parameters
+            ----------
+            model : str
+                Name of the light curve function, e.g. "BinaryLightCurveParallax".
+            params : list[float]
+                Parameters in the format of the chosen light curve function.
+            times : list[float] 
+                Array of times at which the magnification is calculated.
+            LD_list : list[LDprofiles]
+                Limb darkening profile of each band.
+            a1_list : list[float]
+                First limb darkening coefficient of each band.
+            a2_list : list[float]
+                Second limb darkening coefficient of each band (ignored by LDlinear).
+ 
+            Returns
+            -------
+            results: list[list[float]] 
+                Magnification arrays, one per band.
+            )mydelimiter");
+
+        vbb.def("LightCurveGradient",
+            [](VBBinaryLensing &self, std::string model, pyarray params, pyarray times)
+            {
+                int npr = GradientParameters(model), np = times.size();
+                if ((int) params.size() != npr) throw py::value_error("Wrong number of parameters for " + model + ".");
+                pyarray mags(np), grads(std::vector<ssize_t>{ npr, np });
+                double *pmags = mags.mutable_data(), *pgrads = grads.mutable_data();
+                {
+                    py::gil_scoped_release release;
+                    LightCurveGradient(self, model, (double *) params.data(), (double *) times.data(), pmags, pgrads, np);
+                }
+                return py::make_tuple(mags, grads);
+            },
+            py::arg("model"), py::arg("params").noconvert(), py::arg("times").noconvert(),
+            "Same as below with NumPy arrays: the gradient has one row of derivatives per parameter.");
+        vbb.def("LightCurveGradient",
+            [](VBBinaryLensing &self, std::string model, std::vector<double> params, std::vector<double> times)
+            {
+                int npr = GradientParameters(model), np = times.size();
+                if ((int) params.size() != npr) throw py::value_error("Wrong number of parameters for " + model + ".");
+                std::vector<double> mags(np), grads(npr * np);
+                LightCurveGradient(self, model, params.data(), times.data(), mags.data(), grads.data(), np);
+                std::vector< std::vector<double> > results(npr);
+                for (int ip = 0; ip < npr; ip++) {
+                    results[ip].assign(grads.begin() + ip * np, grads.begin() + (ip + 1) * np);
+                }
+                return std::make_pair(mags, results);
+            },
+            py::call_guard<py::gil_scoped_release>(),
+            R"mydelimiter(
+            Light curve with its derivatives with respect to all parameters.
+            Derivatives are analytic for point-source magnifications and
+            computed by central differences for finite-source points.
+
+            Parameters
+            ----------
+            model : str
+                Name of the light curve function, e.g. "BinaryLightCurveParallax".
+                Binary source and xallarap models are not supported.
+            params : list[float]
+                Parameters in the format of the chosen light curve function.
+            times : list[float] 
+                Array of times at which the magnification is calculated.
+ 
+            Returns
+            -------
+            mags: list[float] 
+                Magnification array.
+            grads: list[list[float]] 
+                Derivatives of the magnification, one array per parameter.
+            )mydelimiter");
+
 
 
         // Other functions
-        vbb.def("PlotCrit", &VBBinaryLensing::PlotCrit,
+        vbb.def("SetLensCacheSize", &VBBinaryLensing::SetLensCacheSize,
+            "Sets the maximum number of (s,q) pairs kept in the lens cache (default 16, 0 disables the cache). Clears the cache.");
+        vbb.def("LensCacheLength", &VBBinaryLensing::LensCacheLength,
+            "Number of (s,q) pairs currently in the lens cache.");
+        vbb.def("ClearLensCache", &VBBinaryLensing::ClearLensCache,
+            "Empties the lens cache and resets its counters.");
+        vbb.def("ResetStats", &VBBinaryLensing::ResetStats,
+            "Resets the cost counters in stats.");
+        vbb.def("PlotCrit", (_sols *(VBBinaryLensing::*)(double, double))&VBBinaryLensing::PlotCrit,
             py::return_value_policy::reference,
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Critical curves and caustics for given separation and mass ratio.
 
@@ -765,6 +1457,42 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 List of critical curves and caustics.
             )mydelimiter");
 
+        vbb.def("PlotCrit",
+            [](VBBinaryLensing &self, double s, double q, int maxpoints)
+            {
+                std::vector<double> x1(maxpoints), x2(maxpoints);
+                std::vector<int> offsets(7);
+                int ncurves;
+                {
+                    py::gil_scoped_release release;
+                    ncurves = self.PlotCrit(s, q, x1.data(), x2.data(), offsets.data(), maxpoints);
+                }
+                offsets.resize(ncurves + 1);
+                x1.resize(offsets[ncurves]);
+                x2.resize(offsets[ncurves]);
+                return py::make_tuple(x1, x2, offsets);
+            },
+            R"mydelimiter(
+            Critical curves and caustics in flat arrays, refined around cusps.
+
+            Parameters
+            ----------
+            s : float 
+                The projected separation of the binary lens in units of the 
+                Einstein radius corresponding to the total mass.
+            q : float 
+                Binary lens mass fraction q = m1/m2 such that m1<m2 
+            maxpoints : int
+                Maximum total number of points, at least 8*NPcrit.
+
+            Returns
+            -------
+            x1, x2, offsets : list[float], list[float], list[int]
+                Coordinates of all points and the start of each curve.
+                Curve k runs from offsets[k] to offsets[k+1]. The critical curves
+                come first, followed by the caustics in the same order.
+            )mydelimiter");
+
         vbb.def("Caustics",
             [](VBBinaryLensing& self, double s, double q)
             {
@@ -790,6 +1518,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 delete critcau;
                 return caustics;
             },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Caustics for given separation and mass ratio.
 
@@ -831,6 +1560,7 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
                 delete critcau;
                 return criticalcurves;
             },
+            py::call_guard<py::gil_scoped_release>(),
             R"mydelimiter(
             Critical curves for given separation and mass ratio.
 
@@ -896,4 +1626,17 @@ PYBIND11_MODULE(VBBinaryLensing, m) {
         .def(py::init()) //constructor
         .def_readwrite("first", &_sols::first)
         .def_readwrite("last", &_sols::last);
+
+    py::class_<_stats>(m, "_stats")
+        .def_readonly("newimages", &_stats::newimages, "Calls to NewImages (one lens equation solution each).")
+        .def_readonly("rootiterations", &_stats::rootiterations, "Iterations of the polynomial root finders.")
+        .def_readonly("thetas", &_stats::thetas, "Points inserted on source boundaries by BinaryMag.")
+        .def_readonly("annuli", &_stats::annuli, "Annuli calculated by BinaryMagDark and ESPLMagDark.")
+        .def_readonly("fallbacks", &_stats::fallbacks, "Failed contour integrations repeated by BinaryMagSafe.")
+        .def_readonly("shortcuts", &_stats::shortcuts, "Point-source calculations in BinaryMag2.")
+        .def_readonly("finitesource", &_stats::finitesource, "Finite-source calculations in BinaryMag2.")
+        .def_readonly("budgetstops", &_stats::budgetstops, "Calculations stopped by maxNPS, maxannuli or maxtime.")
+        .def_readonly("tcontour", &_stats::tcontour, "Time in BinaryMag (seconds).")
+        .def_readonly("tdark", &_stats::tdark, "Time in BinaryMagDark, including contours (seconds).")
+        .def_readonly("tlightcurve", &_stats::tlightcurve, "Time in binary lens light curves and array versions of BinaryMag2 (seconds).");
 }
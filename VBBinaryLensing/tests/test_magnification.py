@@ -62,6 +62,17 @@ def test_BinaryLightCurveOrbital():
 
     assert np.allclose(mag,[14.446493529090516, 1.0811430891964906, 1.0], rtol=rel_tol, atol=tol)
 
+def test_BinaryLightCurveKepler():
+    # Eccentric orbit: separations must repeat after three orbital periods
+    params = [np.log(0.9),np.log(0.1),1.5,0.6,np.log(0.001),np.log(40),7150,0,0,0.01,0.03,0.02,0.5,0.9]
+    w1, w2, w3, szs, ar = params[9], params[10], params[11], params[12], params[13]+1.e-8
+    period = 2*np.pi*ar*np.sqrt((2*ar-1)*(1+szs*szs)/(w1*w1+w2*w2+w3*w3))
+    times = np.linspace(7000,7000+5*period,401)
+    seps = np.array(VBBL.BinaryLightCurveKepler(params,list(times)+list(times+3*period))[3])
+
+    assert seps.min() < 0.5 and seps.max() > 1
+    assert np.allclose(seps[:401],seps[401:],rtol=1.e-9)
+
 def test_BinaryLightCurveParallax():
 
     mag =  VBBL.BinaryLightCurveParallax([np.log10(0.97),-1.5,0.01,0.1,-2.5,1.5,10,0.6,0.025],
@@ -102,6 +113,23 @@ def test_BinaryMag2():
     
     assert np.allclose(mag, mag2, rtol=rel_tol, atol=tol)
 
+def test_BinaryMag2Array():
+
+    V = VBBinaryLensing.VBBinaryLensing()
+    V.nthreads = 2
+    s, q, rho = 0.9, 0.1, 0.01
+    y1, y2 = [g.ravel().copy() for g in np.meshgrid(np.linspace(-1,1,20), np.linspace(-0.5,0.5,10))]
+    mags = V.BinaryMag2(s, q, y1, y2, rho)
+    assert np.allclose(mags, [V.BinaryMag2(s,q,a,b,rho) for a,b in zip(y1,y2)], rtol=1.e-10)
+    mags0 = V.BinaryMag0(s, q, y1, y2)
+    assert np.allclose(mags0, [V.BinaryMag0(s,q,a,b) for a,b in zip(y1,y2)], rtol=1.e-10)
+
+    mags, astrox1, astrox2 = V.BinaryMag2(s, q, y1[:5], y2[:5], rho, astrometry=True)
+    assert not V.astrometry
+    V.astrometry = True
+    V.BinaryMag2(s, q, y1[4], y2[4], rho)
+    assert np.allclose([astrox1[4], astrox2[4]], [V.astrox1, V.astrox2], rtol=1.e-10)
+
 def test_BinaryMagDark():
 
     mag = VBBL.BinaryMagDark(1.28,0.05,0.28,0.0056,0.05,a1,tol)
@@ -176,6 +204,196 @@ def test_ESPLMagDark():
    
     assert np.allclose(magnification, 40.012478065951136, rtol=rel_tol, atol=tol)
 
+def test_BuildESPLTable(tmp_path):
+
+    VBBL2 = VBBinaryLensing.VBBinaryLensing()
+    VBBL2.BuildESPLTable(str(tmp_path / "ESPL.tbl"), 151, 101, 1.e-4, 1.e2)
+    VBBL2.LoadESPLTable(str(tmp_path / "ESPL.tbl"))
+    for u, rho in [(10**-5, 0.05), (0.009, 0.01), (0.5, 0.3), (2., 0.1)]:
+        assert np.allclose(VBBL2.ESPLMag(u, rho), VBBL.ESPLMag(u, rho), rtol=1.e-4)
+
+def test_MagMap():
+
+    V = VBBinaryLensing.VBBinaryLensing()
+    s, q, rho = 0.9, 0.1, 0.01
+    mags = [V.BinaryMag2(s,q,y1,0.3,rho) for y1 in [-1.2,-0.4,0.5,1.3]]
+    V.BuildMagMap(s,q,rho,-1.5,1.5,1.5,8,3)
+    mapmags = [V.BinaryMag2(s,q,y1,0.3,rho) for y1 in [-1.2,-0.4,0.5,1.3]]
+
+    assert np.allclose(mags,mapmags,atol=2*V.Tol)
+    assert V.MagMap(2.0,0.3) == -1
+
+def test_LightCurveBatch():
+
+    params = [[np.log(0.97),-1.5,0.01*i,0.1,-2.5,1.5,10,0.6,0.025] for i in range(1,4)]
+    times = [9.5,10.25,11,69]
+    VBBL.nthreads = 2
+    mags = VBBL.LightCurveBatch("BinaryLightCurveParallax",params,times)
+    VBBL.nthreads = 1
+
+    for i in range(3):
+        assert np.allclose(mags[i],VBBL.BinaryLightCurveParallax(params[i],times)[0])
+
+def test_Stream():
+
+    params = [np.log(0.9),np.log(0.1),0.05,0.6,np.log(0.01),np.log(40),7150,0.1,-0.2]
+    times = list(np.linspace(7000,7300,50))
+    mags = VBBL.BinaryLightCurveParallax(params,times)[0]
+    VBBL.StreamOpen("BinaryLightCurveParallax",params)
+    smags = VBBL.StreamAdd(times[:30])
+    for t in times[30:]:
+        smags += VBBL.StreamAdd([t])
+    perturbed = list(params)
+    perturbed[2] = 0.06
+    rmags = VBBL.StreamReevaluate(perturbed,5)
+    VBBL.StreamClose()
+
+    assert np.allclose(smags,mags,rtol=1.e-10)
+    assert np.allclose(rmags,VBBL.BinaryLightCurveParallax(perturbed,times)[0][-5:],rtol=1.e-10)
+
+def test_NumPyLightCurve():
+
+    params = np.array([np.log(0.97),-1.5,0.01,0.1,-2.5,1.5,10])
+    times = np.array([9.5,10.25,11,69])
+    mags = VBBL.BinaryLightCurve(params,times)
+    out = [np.empty(len(times)) for i in range(3)]
+    VBBL.BinaryLightCurve(params,times,out)
+    batch = VBBL.LightCurveBatch("BinaryLightCurve",np.array([params,params]),times)
+
+    assert np.allclose(mags[0],VBBL.BinaryLightCurve(list(params),list(times))[0])
+    assert np.allclose(out[0],mags[0])
+    assert np.allclose(batch[1],mags[0])
+
+def test_InterpolationTol():
+
+    params = [np.log(0.9),np.log(0.1),0.25,0.6,np.log(0.005),np.log(40),7150]
+    times = 7100+0.02*np.arange(5000)
+    mags = VBBL.BinaryLightCurve(params,times)[0]
+    VBBL.InterpolationTol = 1.e-3
+    imags = VBBL.BinaryLightCurve(params,times)[0]
+    VBBL.InterpolationTol = 0
+
+    assert np.allclose(imags,mags,rtol=2*rel_tol,atol=2*tol)
+
+def test_LightCurveMultiBand():
+
+    params = [np.log(0.9),np.log(0.1),0.05,0.6,np.log(0.01),np.log(40),7150]
+    times = [7147,7149.5,7151,7160]
+    bands = VBBL.LightCurveMultiBand("BinaryLightCurve",params,times,[VBBL.LDlinear,VBBL.LDlinear],[0.3,a1],[0,0])
+
+    assert np.allclose(bands[1],VBBL.BinaryLightCurve(params,times)[0],rtol=2*rel_tol,atol=2*tol)
+    VBBL.a1 = 0.3
+    try:
+        assert np.allclose(bands[0],VBBL.BinaryLightCurve(params,times)[0],rtol=2*rel_tol,atol=2*tol)
+    finally:
+        VBBL.a1 = a1
+
+def test_LightCurveGradient():
+
+    params = [np.log(0.9),np.log(0.1),0.05,0.6,np.log(0.01),np.log(40),7150]
+    times = [7140,7147,7149.5,7151,7160]
+    # Finite differences need a good accuracy on the magnification
+    VBBL.Tol = 1.e-5
+    VBBL.RelTol = 0
+    try:
+        mags, grads = VBBL.LightCurveGradient("BinaryLightCurve",params,times)
+
+        assert np.allclose(mags,VBBL.BinaryLightCurve(params,times)[0],rtol=rel_tol,atol=tol)
+        for k in range(len(params)):
+            h = 1.e-4
+            pp = list(params)
+            pm = list(params)
+            pp[k] += h
+            pm[k] -= h
+            fd = (np.array(VBBL.BinaryLightCurve(pp,times)[0])-np.array(VBBL.BinaryLightCurve(pm,times)[0]))/(2*h)
+            assert np.allclose(grads[k],fd,rtol=1.e-2,atol=1.e-2)
+    finally:
+        VBBL.Tol = tol
+        VBBL.RelTol = rel_tol
+
+def test_MagCache(tmp_path):
+
+    assert VBBL.OpenMagCache(str(tmp_path / "magcache.bin"), 1000)
+    mag = VBBL.BinaryMag2(0.8, 0.1, 0.01, 0.3, 0.01)
+    assert VBBL.magcachemisses == 1
+    assert VBBL.BinaryMag2(0.8, 0.1, 0.01, 0.3, 0.01) == mag
+    assert VBBL.magcachehits == 1
+    VBBL.CloseMagCache()
+
+def test_stats():
+
+    VBBL.ResetStats()
+    VBBL.BinaryMag2(0.8, 0.1, 0.01, 0.3, 0.01)
+    VBBL.BinaryMag2(0.8, 0.1, 3, 3, 0.01)
+    assert VBBL.stats.shortcuts == 1
+    assert VBBL.stats.finitesource == 1
+    assert VBBL.stats.annuli > 0 and VBBL.stats.thetas > 0 and VBBL.stats.newimages > 0
+
+def test_budget():
+
+    VBBL.Tol = 1.e-5
+    VBBL.RelTol = 0
+    try:
+        mag = VBBL.BinaryMag2(0.9, 0.1, 0.05, 0, 0.01)
+        VBBL.ResetStats()
+        VBBL.maxNPS = 500
+        bmag = VBBL.BinaryMag2(0.9, 0.1, 0.05, 0, 0.01)
+        nps, err = VBBL.NPS, VBBL.therr
+    finally:
+        VBBL.maxNPS = 0
+        VBBL.Tol = tol
+        VBBL.RelTol = rel_tol
+
+    assert VBBL.stats.budgetstops == 1
+    assert nps <= 501
+    assert abs(bmag-mag) < err
+
+def test_parallelannuli():
+
+    VBBL.Tol = 1.e-4
+    VBBL.RelTol = 1.e-4
+    try:
+        mag = VBBL.BinaryMag2(0.9, 0.01, -0.2, 0, 0.3)
+        VBBL.nthreads = 4
+        VBBL.parallelannuli = True
+        pmag = VBBL.BinaryMag2(0.9, 0.01, -0.2, 0, 0.3)
+        nann = VBBL.nannuli
+    finally:
+        VBBL.parallelannuli = False
+        VBBL.nthreads = 1
+        VBBL.Tol = tol
+        VBBL.RelTol = rel_tol
+
+    assert nann > 4
+    assert np.isclose(pmag, mag, rtol=1.e-4)
+
+def test_causticindex():
+
+    params = [np.log(0.9),np.log(0.1),0.05,0.6,np.log(0.01),np.log(40),7150]
+    times = np.linspace(7000,7300,500)
+    mags = VBBL.BinaryLightCurve(params,times)[0]
+    VBBL.causticindex = True
+    VBBL.ResetStats()
+    imags = VBBL.BinaryLightCurve(params,times)[0]
+    far = VBBL.BinaryMag2(0.9, 0.1, 3, 3, 0.01)
+    VBBL.causticindex = False
+
+    assert VBBL.stats.shortcuts > 300
+    assert np.allclose(imags,mags,rtol=rel_tol,atol=tol)
+    assert np.isclose(far,VBBL.BinaryMag0(0.9, 0.1, 3, 3),rtol=1.e-12)
+
+def test_UseGPU():
+
+    params = np.array([[0.1+0.01*i,np.log(30),7100+i,np.log(0.01),0.1,-0.2] for i in range(20)])
+    times = np.linspace(7000,7300,500)
+    mags = VBBL.LightCurveBatch("ESPLLightCurveParallax",params,times)
+    # Without the GPU backend UseGPU returns False and the batch stays on the CPU
+    VBBL.UseGPU(0)
+    gmags = VBBL.LightCurveBatch("ESPLLightCurveParallax",params,times)
+    assert not VBBL.UseGPU(-1)
+
+    assert np.allclose(gmags,mags,rtol=1.e-10)
+
 def test_PSPLLightCurve():
    
     magnification = VBBL.PSPLLightCurve([-1,1.5,0],[0.1,-0.26,58],[0],[0])
@@ -195,6 +413,38 @@ def test_PlotCrit():
     
     pass
 
+def test_PlotCritArrays():
+    s = 1.56
+    q = 0.29
+    crit = VBBL.CriticalCurves(s, q)
+    x1, x2, offsets = VBBL.PlotCrit(s, q, 8 * VBBL.NPcrit)
+
+    assert len(offsets) == 2 * len(crit) + 1
+    assert offsets[-1] == len(x1) == len(x2)
+    assert np.isclose(max(x1[:offsets[len(crit)]]), max(max(c[0]) for c in crit), atol=1.e-6)
+
+    x1, x2, offsets = VBBL.PlotCrit(s, q, 16 * VBBL.NPcrit)
+    assert offsets[-1] > 8 * VBBL.NPcrit
+
+def test_LensCache():
+    V = VBBinaryLensing.VBBinaryLensing()
+    V.SetLensCacheSize(2)
+    V.CriticalCurves(1.0, 0.1)
+    V.CriticalCurves(1.0, 0.1)
+    assert (V.lenscachehits, V.lenscachemisses) == (1, 1)
+
+    # The least recently used pair is discarded
+    V.CriticalCurves(1.2, 0.1)
+    V.CriticalCurves(1.4, 0.1)
+    assert V.LensCacheLength() == 2
+    V.CriticalCurves(1.0, 0.1)
+    V.CriticalCurves(1.4, 0.1)
+    assert (V.lenscachehits, V.lenscachemisses) == (2, 4)
+
+    # Magnifications only use the coefficients, which are not cached
+    V.BinaryMag2(0.7, 0.1, 0.1, 0.1, 0.01)
+    assert (V.lenscachehits, V.lenscachemisses) == (2, 4)
+
 def test_amplification_USBL():
     s = 1.
     q = 0.02
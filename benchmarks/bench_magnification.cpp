@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+// Google Benchmark goes first, since the library header defines short macros (as _L1 and _Jac)
+#include <benchmark/benchmark.h>
+#include "VBBinaryLensingLibrary.h"
+
+// Throughput benchmarks of the main entry points of the library (Google Benchmark).
+// Run through "make bench" from the repository root, which writes the results to benchmark.json.
+// The shipped data files (ESPL table, event coordinates, satellite tables) are read from
+// VBBinaryLensing/data, or from the directory given by --data_dir=<dir>.
+
+static char datadir[1024] = "VBBinaryLensing/data";
+
+static bool LoadData(VBBinaryLensing &VBBL, benchmark::State &state, bool espl, bool coords) {
+	char filename[1100];
+	FILE *f;
+	if (espl) {
+		sprintf(filename, "%s/ESPL.tbl", datadir);
+		if (!(f = fopen(filename, "rb"))) {
+			state.SkipWithError("ESPL.tbl not found");
+			return false;
+		}
+		fclose(f);
+		VBBL.LoadESPLTable(filename);
+	}
+	if (coords) {
+		sprintf(filename, "%s/OB151212coords.txt", datadir);
+		if (!(f = fopen(filename, "r"))) {
+			state.SkipWithError("OB151212coords.txt not found");
+			return false;
+		}
+		fclose(f);
+		VBBL.SetObjectCoordinates(filename, datadir);
+	}
+	return true;
+}
+
+////////////////////////////////
+// Single lens
+////////////////////////////////
+
+static void BM_PSPLMag(benchmark::State &state) {
+	VBBinaryLensing VBBL;
+	const int np = 1000;
+	double u[np];
+	for (int i = 0; i < np; i++) u[i] = 1.e-3 + 2. * i / np;
+	for (auto _ : state) {
+		for (int i = 0; i < np; i++) benchmark::DoNotOptimize(VBBL.PSPLMag(u[i]));
+	}
+	state.SetItemsProcessed(state.iterations() * np);
+}
+BENCHMARK(BM_PSPLMag);
+
+static void BM_ESPLMag2(benchmark::State &state) {
+	VBBinaryLensing VBBL;
+	const int np = 1000;
+	double u[np], rho = 0.01;
+	if (!LoadData(VBBL, state, true, false)) return;
+	for (int i = 0; i < np; i++) u[i] = 1.e-3 + 0.1 * i / np;
+	for (auto _ : state) {
+		for (int i = 0; i < np; i++) benchmark::DoNotOptimize(VBBL.ESPLMag2(u[i], rho));
+	}
+	state.SetItemsProcessed(state.iterations() * np);
+}
+BENCHMARK(BM_ESPLMag2);
+
+////////////////////////////////
+// Binary lens
+////////////////////////////////
+
+// Complex polynomial solver on quintics whose roots move slowly, as in consecutive calls from NewImages
+static void BM_cmplx_roots_gen(benchmark::State &state) {
+	VBBinaryLensing VBBL;
+	const int np = 1000;
+	complex roots[5], poly[6], r[5];
+	for (auto _ : state) {
+		for (int i = 0; i < np; i++) {
+			double ph = 1.e-3 * i;
+			for (int k = 0; k < 5; k++) r[k] = complex((1 + 0.2 * k) * cos(ph + 1.3 * k), (1 + 0.2 * k) * sin(ph + 1.3 * k));
+			// Coefficients of (z-r[0])...(z-r[4])
+			poly[0] = 1;
+			for (int k = 1; k <= 5; k++) poly[k] = 0;
+			for (int k = 0; k < 5; k++) {
+				for (int j = k + 1; j > 0; j--) poly[j] = poly[j - 1] - r[k] * poly[j];
+				poly[0] = -r[k] * poly[0];
+			}
+			VBBL.cmplx_roots_gen(roots, poly, 5, true, true);
+			benchmark::DoNotOptimize(roots[0].re);
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * np);
+}
+BENCHMARK(BM_cmplx_roots_gen);
+
+// Point-source magnification on a grid covering the resonant caustic of s=1, q=0.1
+static void BM_BinaryMag0(benchmark::State &state) {
+	VBBinaryLensing VBBL;
+	const int n_side = 100;
+	double y1, y2;
+	for (auto _ : state) {
+		for (int i = 0; i < n_side; i++) {
+			y2 = -1. + 2. * i / (n_side - 1);
+			for (int j = 0; j < n_side; j++) {
+				y1 = -1. + 2. * j / (n_side - 1);
+				benchmark::DoNotOptimize(VBBL.BinaryMag0(1.0, 0.1, y1, y2));
+			}
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * n_side * n_side);
+}
+BENCHMARK(BM_BinaryMag0);
+
+// Finite-source magnification with rho=0.01 for s=1, q=0.1, whose caustic extends over -0.255<y1<0.451:
+// far from the caustic (point-source shortcut), two source radii outside the on-axis cusp
+// (full contour without crossing) and across the cusp.
+static void BM_BinaryMag2(benchmark::State &state, double y1, double y2) {
+	VBBinaryLensing VBBL;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(VBBL.BinaryMag2(1.0, 0.1, y1, y2, 0.01));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_CAPTURE(BM_BinaryMag2, far, 1.5, 1.0);
+BENCHMARK_CAPTURE(BM_BinaryMag2, near_caustic, 0.4714, 0.0);
+BENCHMARK_CAPTURE(BM_BinaryMag2, crossing, 0.4514, 0.0);
+
+// Light curve of 1000 points for OGLE-2015-BLG-1212 as seen from Spitzer (1) and Kepler (2)
+static void BM_BinaryLightCurveParallax(benchmark::State &state, int satellite) {
+	VBBinaryLensing VBBL;
+	const int np = 1000;
+	double pr[] = { log(0.97), log(0.1), 0.05, 0.5, log(0.005), log(25.), 7205., 0.2, -0.1 };
+	double t[np], mag[np], y1[np], y2[np];
+	if (!LoadData(VBBL, state, false, true)) return;
+	VBBL.satellite = satellite;
+	for (int i = 0; i < np; i++) t[i] = 7155. + 100. * i / np;
+	for (auto _ : state) {
+		VBBL.BinaryLightCurveParallax(pr, t, mag, y1, y2, np);
+		benchmark::ClobberMemory();
+	}
+	state.SetItemsProcessed(state.iterations() * np);
+}
+BENCHMARK_CAPTURE(BM_BinaryLightCurveParallax, satellite1, 1)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_BinaryLightCurveParallax, satellite2, 2)->Unit(benchmark::kMillisecond);
+
+// Critical curves and caustics in the close, intermediate and wide topologies
+static void BM_PlotCrit(benchmark::State &state, double s) {
+	VBBinaryLensing VBBL;
+	_sols *critcau;
+	for (auto _ : state) {
+		critcau = VBBL.PlotCrit(s, 0.1);
+		benchmark::DoNotOptimize(critcau);
+		delete critcau;
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_CAPTURE(BM_PlotCrit, close, 0.5)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_PlotCrit, intermediate, 1.0)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_PlotCrit, wide, 3.0)->Unit(benchmark::kMicrosecond);
+
+int main(int argc, char **argv) {
+	int nargs = 1;
+	// Our own option is removed before passing the command line to Google Benchmark
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--data_dir=", 11) == 0) {
+			strncpy(datadir, argv[i] + 11, sizeof(datadir) - 1);
+		}
+		else {
+			argv[nargs++] = argv[i];
+		}
+	}
+	argc = nargs;
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
@@ -0,0 +1,62 @@
+import numpy as np
+import VBBinaryLensing
+import os
+import pytest
+
+# Throughput benchmarks of the Python interface, matching benchmarks/bench_magnification.cpp.
+# Run with
+#   pytest benchmarks --benchmark-json=benchmark_python.json
+# (requires the pytest-benchmark plugin).
+
+pytest.importorskip("pytest_benchmark")
+
+datadir = os.path.dirname(VBBinaryLensing.__file__) + "/VBBinaryLensing/data"
+
+
+@pytest.fixture
+def VBBL():
+    return VBBinaryLensing.VBBinaryLensing()
+
+
+def test_PSPLMag(benchmark, VBBL):
+    u = np.linspace(1.e-3, 2., 1000, endpoint=False)
+    benchmark(VBBL.PSPLMag, u)
+
+
+def test_ESPLMag2(benchmark, VBBL):
+    VBBL.LoadESPLTable(datadir + "/ESPL.tbl")
+    u = np.linspace(1.e-3, 0.101, 1000, endpoint=False)
+    benchmark(VBBL.ESPLMag2, u, 0.01)
+
+
+def test_BinaryMag0(benchmark, VBBL):
+    y = np.linspace(-1., 1., 100)
+
+    def grid():
+        for y2 in y:
+            for y1 in y:
+                VBBL.BinaryMag0(1.0, 0.1, y1, y2)
+
+    benchmark(grid)
+
+
+# Same regimes as in the C++ suite: the caustic of s=1, q=0.1 extends over -0.255<y1<0.451
+@pytest.mark.parametrize("y1,y2", [(1.5, 1.0), (0.4714, 0.0), (0.4514, 0.0)],
+                         ids=["far", "near_caustic", "crossing"])
+def test_BinaryMag2(benchmark, VBBL, y1, y2):
+    benchmark(VBBL.BinaryMag2, 1.0, 0.1, y1, y2, 0.01)
+
+
+@pytest.mark.parametrize("satellite", [1, 2], ids=["satellite1", "satellite2"])
+def test_BinaryLightCurveParallax(benchmark, VBBL, satellite):
+    VBBL.SetObjectCoordinates(datadir + "/OB151212coords.txt", datadir)
+    VBBL.satellite = satellite
+    params = [np.log(0.97), np.log(0.1), 0.05, 0.5, np.log(0.005), np.log(25.), 7205., 0.2, -0.1]
+    times = np.linspace(7155., 7255., 1000, endpoint=False)
+    benchmark(VBBL.BinaryLightCurveParallax, params, times)
+
+
+# Caustics wraps PlotCrit and frees the curves after copying them
+@pytest.mark.parametrize("s", [0.5, 1.0, 3.0], ids=["close", "intermediate", "wide"])
+def test_PlotCrit(benchmark, VBBL, s):
+    benchmark(VBBL.Caustics, s, 0.1)